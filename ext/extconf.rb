@@ -28,7 +28,21 @@ end
 have_func("rb_class_boot", "ruby.h")
 have_func("rb_errinfo", "ruby.h")
 have_func('fmemopen')
+have_func('clock_gettime', 'time.h')
+have_func('mmap', 'sys/mman.h')
+
+if not have_func('dladdr', 'dlfcn.h') then
+  have_library('dl') and have_func('dladdr', 'dlfcn.h')
+end
 have_func("rb_ensure", "ruby.h")
+have_struct_member("rb_data_type_t", "flags", "ruby.h")
+have_func("rb_thread_blocking_region", "ruby.h")
+
+if have_header('ruby/thread.h') then
+  have_func("rb_thread_call_without_gvl", "ruby/thread.h")
+end
+
+have_header('ruby/version.h')
 
 have_header('env.h')
 
@@ -8,7 +8,39 @@
 
 #include <ruby.h>
 
+#ifdef HAVE_RUBY_THREAD_H
+#include <ruby/thread.h>
+#endif
+
+#ifdef HAVE_RUBY_VERSION_H
+#include <ruby/version.h>
+#endif
+
 #include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <time.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
+#ifdef HAVE_DLADDR
+#include <dlfcn.h>
+#include <sys/stat.h>
+#endif
 
 #include <jit/jit.h>
 #include <jit/jit-dump.h>
@@ -23,6 +55,14 @@
 #define RARRAY_PTR(a) RARRAY(a)->ptr
 #endif
 
+#ifndef RSTRING_LEN
+#define RSTRING_LEN(s) RSTRING(s)->len
+#endif
+
+#ifndef RSTRING_PTR
+#define RSTRING_PTR(s) RSTRING(s)->ptr
+#endif
+
 static VALUE rb_mJIT;
 static VALUE rb_cContext;
 static VALUE rb_cFunction;
@@ -30,25 +70,71 @@ static VALUE rb_cType;
 static VALUE rb_mABI;
 static VALUE rb_cValue;
 static VALUE rb_cLabel;
+static VALUE rb_cHandle;
 static VALUE rb_mCall;
 static VALUE rb_cClosure;
+static VALUE rb_mStats;
+
+/* Closures for methods defined with define_jit_method, keyed by
+ * [klass, name], so a method's closure can be dropped when it is
+ * redefined */
+static VALUE jit_methods;
+static VALUE interned_types;
+static VALUE predefined_types;
+static VALUE types_by_pointer;
+static ID id_interned_types;
+
+/* Since ruby 2.7, ObjectSpace::WeakMap accepts Integer keys, so
+ * types_by_pointer can be one and not keep the types alive */
+#if defined(RUBY_API_VERSION_CODE) && RUBY_API_VERSION_CODE >= 20700
+#define TYPES_BY_POINTER_ARE_WEAK
+#endif
+
+static FILE * perf_map_file;
+static char perf_map_path[1024];
+
+struct Stats;
+static struct Stats * create_stats(void);
 
-static VALUE closures;
+struct Recorder;
+static void mark_recorder(struct Recorder * recorder);
+struct Optimizer;
+static void mark_optimizer(struct Optimizer * opt);
+
+struct Tier_State;
+static void mark_tier_state(struct Tier_State * tier);
 
 jit_type_t jit_type_VALUE;
 jit_type_t jit_type_ID;
 jit_type_t jit_type_Function_Ptr;
 
 static jit_type_t ruby_vararg_signature;
+static jit_type_t tier_up_signature;
+static jit_type_t exception_builtin_signature;
+
+static unsigned long default_tier_up_threshold = 1000;
 
 typedef void (*Void_Function_Ptr)();
 
 struct Closure
 {
   VALUE function;
+  VALUE context;
   Void_Function_Ptr function_ptr;
 };
 
+/* Get the jit function for a JIT::Function, which must not have been
+ * released */
+#define Get_Function(obj, ptr) \
+  do \
+  { \
+    Get_Data(obj, function, struct _jit_function, ptr); \
+    if(!ptr) \
+    { \
+      rb_raise(rb_eRuntimeError, "Function has been released"); \
+    } \
+  } while(0)
+
 #ifdef VALUE_IS_PTR
 /* Rubinius */
 typedef jit_ptr jit_VALUE;
@@ -131,6 +217,159 @@ void raise_memory_error_if_zero(void * v)
   }
 }
 
+typedef void * (*Without_Gvl_Func)(void *);
+
+/* Call func without holding the global VM lock, where the interpreter
+ * allows it, so other ruby threads can run in the meantime.  func must
+ * not touch any ruby objects. */
+static void * call_without_gvl(Without_Gvl_Func func, void * arg)
+{
+#if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+  return rb_thread_call_without_gvl(func, arg, 0, 0);
+#elif defined(HAVE_RB_THREAD_BLOCKING_REGION)
+  return (void *)rb_thread_blocking_region(
+      (rb_blocking_function_t *)func, arg, 0, 0);
+#else
+  return func(arg);
+#endif
+}
+
+/* Each context's build lock is a Monitor rather than libjit's own
+ * build lock.  A thread that already holds it (for instance, when a
+ * lazy function is applied inside Context#build) can take it again,
+ * and a thread waiting for it lets other ruby threads run, including
+ * the thread holding it.  libjit's lock is taken by libjit itself
+ * around on-demand compilation, which may happen while the GVL is
+ * held, so we never hold it while running ruby code (see
+ * function_on_demand_compiler). */
+static VALUE build_lock_class;
+
+static void acquire_build_lock(jit_context_t context)
+{
+  rb_funcall(
+      (VALUE)jit_context_get_meta(context, RJT_BUILD_LOCK),
+      rb_intern("mon_enter"),
+      0);
+}
+
+static VALUE release_build_lock(VALUE context)
+{
+  rb_funcall(
+      (VALUE)jit_context_get_meta((jit_context_t)context, RJT_BUILD_LOCK),
+      rb_intern("mon_exit"),
+      0);
+  return Qnil;
+}
+
+/* Call func(arg) while holding the context's build lock */
+static VALUE with_build_lock(jit_context_t context, VALUE (*func)(VALUE), VALUE arg)
+{
+  acquire_build_lock(context);
+#ifdef HAVE_RB_ENSURE
+  return rb_ensure(func, arg, release_build_lock, (VALUE)context);
+#else
+  /* Rubinius does not yet have rb_ensure */
+  {
+    VALUE result = func(arg);
+    release_build_lock((VALUE)context);
+    return result;
+  }
+#endif
+}
+
+/* ---------------------------------------------------------------------------
+ * Data types
+ * ---------------------------------------------------------------------------
+ */
+
+static void context_mark(jit_context_t context);
+static void context_free(jit_context_t context);
+static size_t context_memsize(jit_context_t context);
+static void mark_function(jit_function_t function);
+static size_t function_memsize(jit_function_t function);
+static size_t type_memsize(jit_type_t type);
+static void mark_closure(struct Closure * closure);
+
+#ifdef HAVE_RB_DATA_TYPE_T_FLAGS
+
+#define DEFINE_DATA_TYPE(name, class_name, mark, free, size, flags) \
+  static rb_data_type_t const name##_data_type = { \
+    class_name, \
+    { \
+      (RUBY_DATA_FUNC)(mark), \
+      (RUBY_DATA_FUNC)(free), \
+      (size_t (*)(void const *))(size), \
+    }, \
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY | (flags) \
+  }
+
+#define Wrap_Data(klass, name, ptr) \
+  TypedData_Wrap_Struct(klass, &name##_data_type, ptr)
+
+#define Make_Data(klass, type, name, ptr) \
+  TypedData_Make_Struct(klass, type, &name##_data_type, ptr)
+
+#define Get_Data(obj, name, type, ptr) \
+  TypedData_Get_Struct(obj, type, &name##_data_type, ptr)
+
+#else
+/* Ruby 1.8, 1.9, 2.0 and Rubinius: plain data objects, without sizes */
+
+struct Data_Type
+{
+  RUBY_DATA_FUNC mark;
+  RUBY_DATA_FUNC free;
+};
+
+#define DEFINE_DATA_TYPE(name, class_name, mark, free, size, flags) \
+  static struct Data_Type const name##_data_type = { \
+    (RUBY_DATA_FUNC)(mark), \
+    (RUBY_DATA_FUNC)(free) \
+  }
+
+#define Wrap_Data(klass, name, ptr) \
+  Data_Wrap_Struct(klass, name##_data_type.mark, name##_data_type.free, ptr)
+
+#define Make_Data(klass, type, name, ptr) \
+  Data_Make_Struct( \
+      klass, type, name##_data_type.mark, name##_data_type.free, ptr)
+
+#define Get_Data(obj, name, type, ptr) \
+  Data_Get_Struct(obj, type, ptr)
+
+#define RUBY_TYPED_WB_PROTECTED 0
+
+#endif
+
+#ifndef RB_OBJ_WRITE
+#define RB_OBJ_WRITE(obj, slot, value) (*(slot) = (value))
+#endif
+
+#ifndef RB_GC_GUARD
+#define RB_GC_GUARD(v) (v)
+#endif
+
+/* For JIT.memory_stats */
+static unsigned long live_contexts = 0;
+static unsigned long freed_functions = 0;
+static unsigned long freed_code_size = 0;
+
+/* A context's references are all set when it is created, so it needs
+ * no write barriers.  A function's references are kept in libjit meta
+ * data and change throughout its life, so it is left unprotected. */
+DEFINE_DATA_TYPE(context, "JIT::Context",
+    context_mark, context_free, context_memsize, RUBY_TYPED_WB_PROTECTED);
+DEFINE_DATA_TYPE(function, "JIT::Function",
+    mark_function, 0, function_memsize, 0);
+DEFINE_DATA_TYPE(type, "JIT::Type",
+    0, jit_type_free, type_memsize, RUBY_TYPED_WB_PROTECTED);
+DEFINE_DATA_TYPE(value, "JIT::Value",
+    0, 0, 0, RUBY_TYPED_WB_PROTECTED);
+DEFINE_DATA_TYPE(label, "JIT::Label",
+    0, xfree, 0, RUBY_TYPED_WB_PROTECTED);
+DEFINE_DATA_TYPE(closure, "JIT::Closure",
+    mark_closure, xfree, 0, RUBY_TYPED_WB_PROTECTED);
+
 /* ---------------------------------------------------------------------------
  * Context
  * ---------------------------------------------------------------------------
@@ -140,6 +379,8 @@ static void context_mark(jit_context_t context)
 {
   VALUE functions = (VALUE)jit_context_get_meta(context, RJT_FUNCTIONS);
   rb_gc_mark(functions);
+  rb_gc_mark((VALUE)jit_context_get_meta(context, RJT_RETAINED_OBJECTS));
+  rb_gc_mark((VALUE)jit_context_get_meta(context, RJT_BUILD_LOCK));
 }
 
 /* 
@@ -152,7 +393,12 @@ static VALUE context_s_new(VALUE klass)
 {
   jit_context_t context = jit_context_create();
   jit_context_set_meta(context, RJT_FUNCTIONS, (void*)rb_ary_new(), 0);
-  return Data_Wrap_Struct(rb_cContext, context_mark, jit_context_destroy, context);
+  jit_context_set_meta(context, RJT_RETAINED_OBJECTS, (void*)rb_ary_new(), 0);
+  jit_context_set_meta(
+      context, RJT_BUILD_LOCK, (void*)rb_class_new_instance(0, 0, build_lock_class), 0);
+  jit_context_set_meta(context, RJT_STATS, create_stats(), xfree);
+  ++live_contexts;
+  return Wrap_Data(rb_cContext, context, context);
 }
 
 /* 
@@ -160,26 +406,124 @@ static VALUE context_s_new(VALUE klass)
  *   context.build { ... }
  *
  * Acquire a lock on the context so it can be used to build a function.
+ * The lock is reentrant, so a thread that holds it may build again,
+ * or apply a lazy function from the same context, inside the block.
  */
 static VALUE context_build(VALUE self)
 {
   jit_context_t context;
-  Data_Get_Struct(self, struct _jit_context, context);
-  jit_context_build_start(context);
-#ifdef HAVE_RB_ENSURE
-  return rb_ensure(
-      rb_yield,
-      self,
-      RUBY_METHOD_FUNC(jit_context_build_end),
-      (VALUE)context);
-#else
-  /* Rubinius does not yet have rb_ensure */
-  rb_yield(self);
-  jit_context_build_end(context);
-#endif
+  Get_Data(self, context, struct _jit_context, context);
+  return with_build_lock(context, rb_yield, self);
 }
 
 static VALUE function_s_compile(int argc, VALUE * argv, VALUE klass);
+static VALUE function_migrate(VALUE self, VALUE context_v);
+static int function_can_migrate(VALUE function_v);
+
+static VALUE stats_to_hash(struct Stats const * stats, int is_function);
+
+/*
+ * call-seq:
+ *   functions = context.functions
+ *
+ * Get the functions in this context that have not been released or
+ * migrated to another context.
+ */
+static VALUE context_functions(VALUE self)
+{
+  jit_context_t context;
+  Get_Data(self, context, struct _jit_context, context);
+  return rb_ary_dup((VALUE)jit_context_get_meta(context, RJT_FUNCTIONS));
+}
+
+/*
+ * call-seq:
+ *   context.keep_recipes = true
+ *
+ * Record the instructions emitted into every function subsequently
+ * created in this context, and keep the recording after the function
+ * is compiled, so the function can later be migrated to another
+ * context (see Function#migrate and Context#compact).
+ */
+static VALUE context_set_keep_recipes(VALUE self, VALUE keep_recipes)
+{
+  jit_context_t context;
+  Get_Data(self, context, struct _jit_context, context);
+  if(!jit_context_set_meta(
+      context, RJT_KEEP_RECIPES, (void *)(long)RTEST(keep_recipes), 0))
+  {
+    rb_raise(rb_eNoMemError, "Out of memory");
+  }
+  return keep_recipes;
+}
+
+/*
+ * call-seq:
+ *   keep_recipes = context.keep_recipes?
+ *
+ * Determine whether this context keeps its functions' recipes (see
+ * keep_recipes=).
+ */
+static VALUE context_keeps_recipes(VALUE self)
+{
+  jit_context_t context;
+  Get_Data(self, context, struct _jit_context, context);
+  return jit_context_get_meta(context, RJT_KEEP_RECIPES) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   new_context = context.compact([new_context])
+ *
+ * Migrate every function in this context that can be migrated (see
+ * Function#migrate) to new_context (by default a new context that
+ * keeps recipes).  Once the functions left behind have been released
+ * and nothing refers to this context's code any longer, the context
+ * and all of its code memory can be reclaimed.
+ */
+static VALUE context_compact(int argc, VALUE * argv, VALUE self)
+{
+  VALUE target_v;
+  VALUE functions;
+  long j;
+
+  rb_scan_args(argc, argv, "01", &target_v);
+
+  if(NIL_P(target_v))
+  {
+    target_v = context_s_new(rb_cContext);
+    context_set_keep_recipes(target_v, Qtrue);
+  }
+
+  check_type("context", rb_cContext, target_v);
+
+  functions = context_functions(self);
+  for(j = 0; j < RARRAY_LEN(functions); ++j)
+  {
+    VALUE function_v = RARRAY_PTR(functions)[j];
+    if(function_can_migrate(function_v))
+    {
+      function_migrate(function_v, target_v);
+    }
+  }
+
+  return target_v;
+}
+
+/*
+ * call-seq:
+ *   stats = context.stats
+ *
+ * Get the statistics for the functions created in this context, as a
+ * hash with the same keys as JIT::Stats.totals.
+ */
+static VALUE context_stats(VALUE self)
+{
+  jit_context_t context;
+  Get_Data(self, context, struct _jit_context, context);
+  return stats_to_hash(
+      (struct Stats *)jit_context_get_meta(context, RJT_STATS), 0);
+}
 
 /* 
  * call-seq:
@@ -215,13 +559,17 @@ static VALUE context_s_build(VALUE klass)
 static void mark_closure(struct Closure * closure)
 {
   rb_gc_mark(closure->function);
+
+  /* The closure points into the context's code, so keep the context
+   * alive even if the function is released */
+  rb_gc_mark(closure->context);
 }
 
 VALUE closure_to_int(VALUE self)
 {
   struct Closure * closure;
   VALUE v;
-  Data_Get_Struct(self, struct Closure, closure);
+  Get_Data(self, closure, struct Closure, closure);
   v = ULONG2NUM((unsigned long)closure->function_ptr);
   return v;
 }
@@ -230,7 +578,7 @@ VALUE closure_to_s(VALUE self)
 {
   struct Closure * closure;
   VALUE args[4];
-  Data_Get_Struct(self, struct Closure, closure);
+  Get_Data(self, closure, struct Closure, closure);
   args[0] = rb_str_new2("#<JIT::Closure:0x%x function=%s function_ptr=0x%x>");
   args[1] = ULONG2NUM((unsigned long)self);
   args[2] = rb_any_to_s(closure->function);
@@ -244,334 +592,5258 @@ VALUE closure_inspect(VALUE self)
 }
 
 /* ---------------------------------------------------------------------------
- * Function
+ * Apply plan
  * ---------------------------------------------------------------------------
  */
 
-static void mark_function(jit_function_t function)
+/* An apply plan describes how to marshal arguments to and from a
+ * function's signature.  It is built once per function (when the
+ * function is compiled) so that apply does not need to interpret the
+ * signature on every call. */
+
+typedef void (*Arg_Converter)(VALUE value, void * arg_data);
+typedef VALUE (*Return_Converter)(void * result, size_t size);
+
+enum Apply_Plan_Kind
 {
-  rb_gc_mark((VALUE)jit_function_get_meta(function, RJT_VALUE_OBJECTS));
-  rb_gc_mark((VALUE)jit_function_get_meta(function, RJT_CONTEXT));
-}
+  APPLY_PLAN_GENERIC,
+  APPLY_PLAN_ALL_INT,
+  APPLY_PLAN_ALL_OBJECT,
+  APPLY_PLAN_RUBY_VARARG
+};
 
-static VALUE create_function(int argc, VALUE * argv, VALUE klass)
+struct Apply_Plan_Arg
 {
-  VALUE context_v;
-  VALUE signature_v;
-  VALUE parent_function_v;
+  Arg_Converter convert;
+  size_t offset;
 
-  jit_function_t function;
-  jit_function_t parent_function;
-  jit_context_t context;
-  jit_type_t signature;
-  jit_type_t untagged_signature;
+  /* Where this argument lives in a row of a packed buffer passed to
+   * apply_many */
+  size_t packed_offset;
+};
 
-  VALUE function_v;
-  VALUE functions;
+struct Apply_Plan
+{
+  enum Apply_Plan_Kind kind;
+  int num_args;
+  size_t arg_data_size;
+  size_t return_size;
+  Return_Converter convert_return;
+  int return_kind;
+  int unsupported_kind;
+
+  /* The layout of packed rows (as a C struct of the params) and packed
+   * results; packable is false if the signature contains OBJECTs, which
+   * cannot safely be stored in a string */
+  size_t packed_row_size;
+  size_t packed_return_size;
+  int packable;
+
+  /* uses_ruby_objects is true if any param or the return is an OBJECT
+   * or ID, in which case the function cannot be called without the
+   * GVL; release_gvl is set by Function#release_gvl= */
+  int uses_ruby_objects;
+  int release_gvl;
+
+  struct Apply_Plan_Arg args[1];
+};
 
-  int signature_tag;
+#define APPLY_PLAN_NO_UNSUPPORTED_KIND (-1)
 
-  rb_scan_args(argc, argv, "21", &context_v, &signature_v, &parent_function_v);
+/* Whether apply uses the specialized code for the all-INT and
+ * all-OBJECT plans (see JIT.apply_fast_paths=) */
+static int apply_fast_paths = 1;
 
-  /* Allow the user to specify the signature as a hash */
-  if (TYPE(signature_v) == T_HASH)
-  {
-    signature_v = rb_funcall(
-        rb_cType,
-        rb_intern("create_signature"),
-        1,
-        signature_v);
-  }
+static void convert_sbyte_arg(VALUE value, void * arg_data)
+{
+  *(jit_sbyte *)arg_data = NUM2INT(value);
+}
 
-  check_type("context", rb_cContext, context_v);
-  check_type("signature", rb_cType, signature_v);
+static void convert_ubyte_arg(VALUE value, void * arg_data)
+{
+  *(jit_ubyte *)arg_data = NUM2UINT(value);
+}
 
-  Data_Get_Struct(context_v, struct _jit_context, context);
-  Data_Get_Struct(signature_v, struct _jit_type, signature);
+static void convert_short_arg(VALUE value, void * arg_data)
+{
+  *(jit_short *)arg_data = NUM2INT(value);
+}
 
-  signature_tag = jit_type_get_kind(signature);
+static void convert_ushort_arg(VALUE value, void * arg_data)
+{
+  *(jit_ushort *)arg_data = NUM2UINT(value);
+}
 
-  /* If this signature was tagged, get the untagged type */
-  if((untagged_signature = jit_type_get_tagged_type(signature)))
-  {
-    signature = untagged_signature;
-  }
+static void convert_int_arg(VALUE value, void * arg_data)
+{
+  *(jit_int *)arg_data = NUM2INT(value);
+}
 
-  if(RTEST(parent_function_v))
-  {
-    /* If this function has a parent, then it is a nested function */
-    Data_Get_Struct(parent_function_v, struct _jit_function, parent_function);
-    function = jit_function_create_nested(context, signature, parent_function);
-  }
-  else
-  {
-    /* Otherwise, it's a standalone function */
-    function = jit_function_create(context, signature);
-  }
+static void convert_uint_arg(VALUE value, void * arg_data)
+{
+  *(jit_uint *)arg_data = NUM2UINT(value);
+}
 
-  /* Make sure the function is around as long as the context is */
-  if(!jit_function_set_meta(function, RJT_VALUE_OBJECTS, (void *)rb_ary_new(), 0, 0))
-  {
-    rb_raise(rb_eNoMemError, "Out of memory");
-  }
+static void convert_nint_arg(VALUE value, void * arg_data)
+{
+  *(jit_nint *)arg_data = NUM2LONG(value);
+}
 
-  /* Remember the signature's tag for later */
-  if(!jit_function_set_meta(function, RJT_TAG_FOR_SIGNATURE, (void *)signature_tag, 0, 0))
-  {
-    rb_raise(rb_eNoMemError, "Out of memory");
-  }
+static void convert_nuint_arg(VALUE value, void * arg_data)
+{
+  *(jit_nuint *)arg_data = NUM2ULONG(value);
+}
 
-  /* And remember the function's context for later */
-  if(!jit_function_set_meta(function, RJT_CONTEXT, (void *)context_v, 0, 0))
-  {
-    rb_raise(rb_eNoMemError, "Out of memory");
-  }
+static void convert_long_arg(VALUE value, void * arg_data)
+{
+  *(jit_long *)arg_data = NUM2LL(value);
+}
 
-  function_v = Data_Wrap_Struct(rb_cFunction, mark_function, 0, function);
+static void convert_ulong_arg(VALUE value, void * arg_data)
+{
+  *(jit_ulong *)arg_data = NUM2ULL(value);
+}
 
-  /* Add this function to the context's list of functions */
-  functions = (VALUE)jit_context_get_meta(context, RJT_FUNCTIONS);
-  rb_ary_push(functions, function_v);
+static void convert_float32_arg(VALUE value, void * arg_data)
+{
+  *(jit_float32 *)arg_data = NUM2DBL(value);
+}
 
-  return function_v;
+static void convert_float64_arg(VALUE value, void * arg_data)
+{
+  *(jit_float64 *)arg_data = NUM2DBL(value);
 }
 
-/*
- * call-seq:
- *   function.compile()
- *
- * Begin compiling a function.
- */
-static VALUE function_compile(VALUE self)
+static void convert_nfloat_arg(VALUE value, void * arg_data)
 {
-  jit_function_t function;
-  Data_Get_Struct(self, struct _jit_function, function);
-  if(!jit_function_compile(function))
-  {
-    rb_raise(rb_eRuntimeError, "Unable to compile function");
-  }
-  return self;
+  *(jit_nfloat *)arg_data = NUM2DBL(value);
 }
 
-/*
- * call-seq:
- *   function = Function.new(context, signature, [parent])
- *
- * Create a new function.
- */
-static VALUE function_s_new(int argc, VALUE * argv, VALUE klass)
+/* A pointer may be given as nil, as a String (in which case the
+ * function gets a pointer to the string's buffer), or as anything that
+ * can be converted to an integer address */
+static void convert_ptr_arg(VALUE value, void * arg_data)
 {
-  if(rb_block_given_p())
+  if(NIL_P(value))
   {
-    rb_raise(rb_eArgError, "Function.new does not take a block");
+    *(void * *)arg_data = 0;
+  }
+  else if(TYPE(value) == T_STRING)
+  {
+    rb_str_modify(value);
+    *(void * *)arg_data = RSTRING_PTR(value);
+  }
+  else
+  {
+    *(void * *)arg_data = (void *)NUM2ULONG(rb_to_int(value));
   }
-
-  return create_function(argc, argv, klass);
 }
 
-static VALUE function_abandon_if_exception(VALUE function_v)
+static void convert_object_arg(VALUE value, void * arg_data)
+{
+  *(VALUE *)arg_data = value;
+}
+
+static void convert_id_arg(VALUE value, void * arg_data)
+{
+  *(ID *)arg_data = SYM2ID(value);
+}
+
+static void convert_function_ptr_arg(VALUE value, void * arg_data)
+{
+  *(Void_Function_Ptr *)arg_data =
+    (Void_Function_Ptr)NUM2ULONG(rb_to_int(value));
+}
+
+static VALUE convert_void_return(void * result, size_t size)
+{
+  return Qnil;
+}
+
+static VALUE convert_sbyte_return(void * result, size_t size)
+{
+  return INT2FIX(*(jit_sbyte *)result);
+}
+
+static VALUE convert_ubyte_return(void * result, size_t size)
+{
+  return INT2FIX(*(jit_ubyte *)result);
+}
+
+static VALUE convert_short_return(void * result, size_t size)
+{
+  return INT2FIX(*(jit_short *)result);
+}
+
+static VALUE convert_ushort_return(void * result, size_t size)
+{
+  return INT2FIX(*(jit_ushort *)result);
+}
+
+static VALUE convert_int_return(void * result, size_t size)
+{
+  return INT2NUM(*(jit_int *)result);
+}
+
+static VALUE convert_uint_return(void * result, size_t size)
+{
+  return UINT2NUM(*(jit_uint *)result);
+}
+
+static VALUE convert_nint_return(void * result, size_t size)
+{
+  return LONG2NUM(*(jit_nint *)result);
+}
+
+static VALUE convert_nuint_return(void * result, size_t size)
+{
+  return ULONG2NUM(*(jit_nuint *)result);
+}
+
+static VALUE convert_long_return(void * result, size_t size)
+{
+  return LL2NUM(*(jit_long *)result);
+}
+
+static VALUE convert_ulong_return(void * result, size_t size)
+{
+  return ULL2NUM(*(jit_ulong *)result);
+}
+
+static VALUE convert_float32_return(void * result, size_t size)
+{
+  return rb_float_new(*(jit_float32 *)result);
+}
+
+static VALUE convert_float64_return(void * result, size_t size)
+{
+  return rb_float_new(*(jit_float64 *)result);
+}
+
+static VALUE convert_nfloat_return(void * result, size_t size)
+{
+  return rb_float_new(*(jit_nfloat *)result);
+}
+
+static VALUE convert_ptr_return(void * result, size_t size)
+{
+  return ULONG2NUM((unsigned long)*(void * *)result);
+}
+
+/* Structs and unions are returned as a string containing the raw
+ * bytes; use apply_into to avoid allocating a new string for each
+ * call */
+static VALUE convert_struct_return(void * result, size_t size)
+{
+  return rb_str_new(result, size);
+}
+
+static VALUE convert_object_return(void * result, size_t size)
+{
+  return (VALUE)*(jit_VALUE *)result;
+}
+
+static VALUE convert_id_return(void * result, size_t size)
+{
+  return ID2SYM(*(jit_ID *)result);
+}
+
+static Arg_Converter arg_converter_for_kind(int kind)
+{
+  switch(kind)
+  {
+    case JIT_TYPE_SBYTE: return convert_sbyte_arg;
+    case JIT_TYPE_UBYTE: return convert_ubyte_arg;
+    case JIT_TYPE_SHORT: return convert_short_arg;
+    case JIT_TYPE_USHORT: return convert_ushort_arg;
+    case JIT_TYPE_INT: return convert_int_arg;
+    case JIT_TYPE_UINT: return convert_uint_arg;
+    case JIT_TYPE_NINT: return convert_nint_arg;
+    case JIT_TYPE_NUINT: return convert_nuint_arg;
+    case JIT_TYPE_LONG: return convert_long_arg;
+    case JIT_TYPE_ULONG: return convert_ulong_arg;
+    case JIT_TYPE_FLOAT32: return convert_float32_arg;
+    case JIT_TYPE_FLOAT64: return convert_float64_arg;
+    case JIT_TYPE_NFLOAT: return convert_nfloat_arg;
+    case JIT_TYPE_PTR: return convert_ptr_arg;
+    case JIT_TYPE_FIRST_TAGGED + RJT_OBJECT: return convert_object_arg;
+    case JIT_TYPE_FIRST_TAGGED + RJT_ID: return convert_id_arg;
+    case JIT_TYPE_FIRST_TAGGED + RJT_FUNCTION_PTR: return convert_function_ptr_arg;
+    default: return 0;
+  }
+}
+
+static Return_Converter return_converter_for_kind(int kind)
+{
+  switch(kind)
+  {
+    case JIT_TYPE_VOID: return convert_void_return;
+    case JIT_TYPE_SBYTE: return convert_sbyte_return;
+    case JIT_TYPE_UBYTE: return convert_ubyte_return;
+    case JIT_TYPE_SHORT: return convert_short_return;
+    case JIT_TYPE_USHORT: return convert_ushort_return;
+    case JIT_TYPE_INT: return convert_int_return;
+    case JIT_TYPE_UINT: return convert_uint_return;
+    case JIT_TYPE_NINT: return convert_nint_return;
+    case JIT_TYPE_NUINT: return convert_nuint_return;
+    case JIT_TYPE_LONG: return convert_long_return;
+    case JIT_TYPE_ULONG: return convert_ulong_return;
+    case JIT_TYPE_FLOAT32: return convert_float32_return;
+    case JIT_TYPE_FLOAT64: return convert_float64_return;
+    case JIT_TYPE_NFLOAT: return convert_nfloat_return;
+    case JIT_TYPE_PTR: return convert_ptr_return;
+    case JIT_TYPE_STRUCT: return convert_struct_return;
+    case JIT_TYPE_UNION: return convert_struct_return;
+    case JIT_TYPE_FIRST_TAGGED + RJT_OBJECT: return convert_object_return;
+    case JIT_TYPE_FIRST_TAGGED + RJT_ID: return convert_id_return;
+    case JIT_TYPE_FIRST_TAGGED + RJT_FUNCTION_PTR: return convert_ptr_return;
+    default: return 0;
+  }
+}
+
+/* Round up to a multiple of the largest scalar we might store, so each
+ * argument in the buffer is suitably aligned */
+static size_t align_arg_size(size_t size)
+{
+  size_t align = sizeof(jit_nfloat) > sizeof(jit_ulong)
+    ? sizeof(jit_nfloat)
+    : sizeof(jit_ulong);
+  return (size + align - 1) & ~(align - 1);
+}
+
+static int is_ruby_object_kind(int kind)
+{
+  return kind == JIT_TYPE_FIRST_TAGGED + RJT_OBJECT
+    || kind == JIT_TYPE_FIRST_TAGGED + RJT_ID;
+}
+
+static size_t align_to(size_t offset, size_t align)
+{
+  return align ? (offset + align - 1) / align * align : offset;
+}
+
+static struct Apply_Plan * create_apply_plan(jit_function_t function)
+{
+  jit_type_t signature = jit_function_get_signature(function);
+  int signature_tag = (int)(long)jit_function_get_meta(function, RJT_TAG_FOR_SIGNATURE);
+  int n = jit_type_num_params(signature);
+  int all_int = 1;
+  int all_object = 1;
+  size_t offset = 0;
+  size_t packed_offset = 0;
+  size_t packed_align = 1;
+  int j;
+
+  struct Apply_Plan * plan = (struct Apply_Plan *)xmalloc(
+      sizeof(struct Apply_Plan) + n * sizeof(struct Apply_Plan_Arg));
+
+  jit_type_t return_type = jit_type_get_return(signature);
+
+  plan->num_args = n;
+  plan->unsupported_kind = APPLY_PLAN_NO_UNSUPPORTED_KIND;
+  plan->return_kind = jit_type_get_kind(return_type);
+  plan->return_size = align_arg_size(jit_type_get_size(return_type));
+  plan->convert_return = return_converter_for_kind(plan->return_kind);
+  plan->packed_return_size = jit_type_get_size(return_type);
+  plan->packable = plan->return_kind != JIT_TYPE_FIRST_TAGGED + RJT_OBJECT;
+  plan->uses_ruby_objects = is_ruby_object_kind(plan->return_kind);
+  plan->release_gvl = 0;
+
+  for(j = 0; j < n; ++j)
+  {
+    jit_type_t arg_type = jit_type_get_param(signature, j);
+    int kind = jit_type_get_kind(arg_type);
+    size_t align = jit_type_get_alignment(arg_type);
+
+    plan->args[j].convert = arg_converter_for_kind(kind);
+    plan->args[j].offset = offset;
+    offset += align_arg_size(jit_type_get_size(arg_type));
+
+    packed_offset = align_to(packed_offset, align);
+    plan->args[j].packed_offset = packed_offset;
+    packed_offset += jit_type_get_size(arg_type);
+    packed_align = align > packed_align ? align : packed_align;
+
+    if(kind == JIT_TYPE_FIRST_TAGGED + RJT_OBJECT)
+    {
+      plan->packable = 0;
+    }
+
+    if(!plan->args[j].convert
+        && plan->unsupported_kind == APPLY_PLAN_NO_UNSUPPORTED_KIND)
+    {
+      plan->unsupported_kind = kind;
+    }
+
+    if(is_ruby_object_kind(kind))
+    {
+      plan->uses_ruby_objects = 1;
+    }
+
+    all_int = all_int && kind == JIT_TYPE_INT;
+    all_object = all_object && kind == JIT_TYPE_FIRST_TAGGED + RJT_OBJECT;
+  }
+
+  plan->arg_data_size = offset;
+  plan->packed_row_size = align_to(packed_offset, packed_align);
+
+  if(signature_tag == JIT_TYPE_FIRST_TAGGED + RJT_RUBY_VARARG_SIGNATURE)
+  {
+    plan->kind = APPLY_PLAN_RUBY_VARARG;
+  }
+  else if(all_int && plan->return_kind == JIT_TYPE_INT)
+  {
+    plan->kind = APPLY_PLAN_ALL_INT;
+  }
+  else if(all_object && plan->return_kind == JIT_TYPE_FIRST_TAGGED + RJT_OBJECT)
+  {
+    plan->kind = APPLY_PLAN_ALL_OBJECT;
+  }
+  else
+  {
+    plan->kind = APPLY_PLAN_GENERIC;
+  }
+
+  return plan;
+}
+
+static void free_apply_plan(void * plan)
+{
+  xfree(plan);
+}
+
+static void build_lazy_function(jit_function_t function);
+
+/* Convert each of the Ruby arguments in argv into arg_data, according
+ * to the plan, and point args at the converted values */
+static void convert_apply_args(
+    struct Apply_Plan * plan, VALUE * argv, void * * args, char * arg_data)
+{
+  int j;
+  for(j = 0; j < plan->num_args; ++j)
+  {
+    args[j] = arg_data + plan->args[j].offset;
+    plan->args[j].convert(argv[j], args[j]);
+  }
+}
+
+/* libjit's builtin exceptions (thrown, for instance, by a failed
+ * insn_check_bounds) and the ruby exceptions they are raised as */
+struct Builtin_Exception
+{
+  int type;
+  VALUE * klass;
+  char const * message;
+};
+
+static struct Builtin_Exception const builtin_exceptions[] = {
+  { JIT_RESULT_OVERFLOW, &rb_eRangeError, "Overflow during checked arithmetic operation" },
+  { JIT_RESULT_ARITHMETIC, &rb_eRangeError, "Arithmetic exception" },
+  { JIT_RESULT_DIVISION_BY_ZERO, &rb_eZeroDivError, "Division by zero" },
+  { JIT_RESULT_OUT_OF_MEMORY, &rb_eNoMemError, "Out of memory" },
+  { JIT_RESULT_NULL_REFERENCE, &rb_eRuntimeError, "Null pointer dereferenced" },
+  { JIT_RESULT_NULL_FUNCTION, &rb_eRuntimeError, "Null function pointer called" },
+  { JIT_RESULT_OUT_OF_BOUNDS, &rb_eIndexError, "Index out of bounds" },
+  { JIT_RESULT_UNDEFINED_LABEL, &rb_eRuntimeError, "Undefined label" },
+  { JIT_RESULT_OK, &rb_eRuntimeError, "Unknown builtin exception" },
+};
+
+#define NUM_BUILTIN_EXCEPTIONS \
+  (int)(sizeof(builtin_exceptions) / sizeof(builtin_exceptions[0]))
+
+/* Called by libjit when JIT code throws a builtin exception.  Without
+ * a handler libjit would print a message and exit; returning an object
+ * makes it throw that instead, which unwinds to jit_function_apply. */
+static void * builtin_exception_handler(int exception_type)
+{
+  int j;
+  for(j = 0; j < NUM_BUILTIN_EXCEPTIONS - 1; ++j)
+  {
+    if(builtin_exceptions[j].type == exception_type)
+    {
+      break;
+    }
+  }
+  return (void *)&builtin_exceptions[j];
+}
+
+/* Call the function, catching any exception it throws.  The handler is
+ * per thread in libjit, so it is set on each call.  Returns 0 if an
+ * exception was thrown (see raise_jit_exception). */
+static int apply_catching(jit_function_t function, void * * args, void * result)
+{
+  jit_exception_set_handler(builtin_exception_handler);
+  return jit_function_apply(function, args, result);
+}
+
+/* Raise the exception thrown by a call made with apply_catching */
+static void raise_jit_exception(void)
+{
+  void * exception = jit_exception_get_last();
+  int j;
+
+  jit_exception_clear_last();
+
+  for(j = 0; j < NUM_BUILTIN_EXCEPTIONS; ++j)
+  {
+    if(exception == (void *)&builtin_exceptions[j])
+    {
+      rb_raise(*builtin_exceptions[j].klass, "%s", builtin_exceptions[j].message);
+    }
+  }
+
+  rb_raise(rb_eRuntimeError, "Exception thrown by JIT code");
+}
+
+struct Apply_Call
+{
+  jit_function_t function;
+  void * * args;
+  void * result;
+  int ok;
+};
+
+static void * apply_without_gvl(void * call_ptr)
+{
+  struct Apply_Call * call = (struct Apply_Call *)call_ptr;
+  call->ok = apply_catching(call->function, call->args, call->result);
+  return 0;
+}
+
+/* Call the function, releasing the GVL for the duration of the call if
+ * requested (the caller must already have checked that the function
+ * does not use ruby objects) */
+static void call_function(
+    jit_function_t function, void * * args, void * result, int release_gvl)
+{
+  int ok;
+
+  if(release_gvl)
+  {
+    struct Apply_Call call;
+    call.function = function;
+    call.args = args;
+    call.result = result;
+    call_without_gvl(apply_without_gvl, &call);
+    ok = call.ok;
+  }
+  else
+  {
+    ok = apply_catching(function, args, result);
+  }
+
+  if(!ok)
+  {
+    raise_jit_exception();
+  }
+}
+
+static void check_apply_plan_gvl_free(jit_function_t function, struct Apply_Plan * plan)
+{
+  if(plan->kind == APPLY_PLAN_RUBY_VARARG || plan->uses_ruby_objects)
+  {
+    rb_raise(
+        rb_eTypeError,
+        "Cannot call a function without the GVL if it takes or returns OBJECT or ID");
+  }
+
+  if(jit_function_get_meta(function, RJT_TIER_STATE))
+  {
+    rb_raise(
+        rb_eTypeError,
+        "Cannot call a tiered function without the GVL");
+  }
+}
+
+static void check_apply_plan_supported(struct Apply_Plan * plan)
+{
+  if(plan->unsupported_kind != APPLY_PLAN_NO_UNSUPPORTED_KIND)
+  {
+    rb_raise(rb_eTypeError, "Unsupported type %d", plan->unsupported_kind);
+  }
+
+  if(!plan->convert_return)
+  {
+    rb_raise(rb_eTypeError, "Unsupported return type %d", plan->return_kind);
+  }
+}
+
+/* Get the function's apply plan, creating it if it does not yet exist
+ * (e.g. if the function was compiled on demand by libjit) */
+static struct Apply_Plan * get_apply_plan(jit_function_t function)
+{
+  struct Apply_Plan * plan =
+    (struct Apply_Plan *)jit_function_get_meta(function, RJT_APPLY_PLAN);
+
+  if(!plan)
+  {
+    /* A lazy function gets its plan when it is compiled */
+    build_lazy_function(function);
+    plan = (struct Apply_Plan *)jit_function_get_meta(function, RJT_APPLY_PLAN);
+  }
+
+  if(!plan)
+  {
+    plan = create_apply_plan(function);
+    if(!jit_function_set_meta(function, RJT_APPLY_PLAN, plan, free_apply_plan, 0))
+    {
+      free_apply_plan(plan);
+      rb_raise(rb_eNoMemError, "Out of memory");
+    }
+  }
+
+  return plan;
+}
+
+/* ---------------------------------------------------------------------------
+ * Function names and perf map
+ * ---------------------------------------------------------------------------
+ */
+
+/* Find the native code for a compiled function.  libjit does not
+ * expose where a function's code ends, so we probe forward from the
+ * entry point with jit_function_from_pc, which maps any address inside
+ * a function's code back to the function.  Returns 0 if the range
+ * cannot be determined. */
+static int function_code_range(jit_function_t function, char * * start, size_t * size)
+{
+  jit_context_t context = jit_function_get_context(function);
+  char * entry;
+  size_t low;
+  size_t high;
+
+  if(!jit_function_is_compiled(function))
+  {
+    return 0;
+  }
+
+  entry = (char *)jit_function_to_vtable_pointer(function);
+  if(!entry || jit_function_from_pc(context, entry, 0) != function)
+  {
+    return 0;
+  }
+
+  /* entry + low is inside the function; double high until it is not */
+  low = 0;
+  high = 16;
+  while(jit_function_from_pc(context, entry + high, 0) == function)
+  {
+    low = high;
+    high *= 2;
+  }
+
+  while(high - low > 1)
+  {
+    size_t mid = low + (high - low) / 2;
+    if(jit_function_from_pc(context, entry + mid, 0) == function)
+    {
+      low = mid;
+    }
+    else
+    {
+      high = mid;
+    }
+  }
+
+  *start = entry;
+  *size = high;
+  return 1;
+}
+
+static char * copy_string(char const * str)
+{
+  size_t len = strlen(str);
+  char * copy = ALLOC_N(char, len + 1);
+  memcpy(copy, str, len + 1);
+  return copy;
+}
+
+static void set_function_meta_string(jit_function_t function, int type, char const * str)
+{
+  char * copy = copy_string(str);
+  if(!jit_function_set_meta(function, type, copy, xfree, 0))
+  {
+    xfree(copy);
+    rb_raise(rb_eNoMemError, "Out of memory");
+  }
+}
+
+/* The name to use for a function in profiles: the name given to
+ * insn_call or define_jit_method, else the location of the block that
+ * built it, else nil */
+static char const * function_display_name(jit_function_t function)
+{
+  char const * name = (char const *)jit_function_get_meta(function, RJT_NAME);
+  if(!name)
+  {
+    name = (char const *)jit_function_get_meta(function, RJT_SOURCE_LOCATION);
+  }
+  return name;
+}
+
+static void write_perf_map_entry(jit_function_t function)
+{
+  char * start;
+  size_t size;
+  char const * name;
+
+  if(!perf_map_file || !function_code_range(function, &start, &size))
+  {
+    return;
+  }
+
+  name = function_display_name(function);
+  if(name)
+  {
+    fprintf(perf_map_file, "%lx %lx %s\n",
+        (unsigned long)start, (unsigned long)size, name);
+  }
+  else
+  {
+    fprintf(perf_map_file, "%lx %lx jit_function_%lx\n",
+        (unsigned long)start, (unsigned long)size, (unsigned long)start);
+  }
+  fflush(perf_map_file);
+}
+
+static void set_function_name(jit_function_t function, char const * name)
+{
+  set_function_meta_string(function, RJT_NAME, name);
+
+  /* If the function is already compiled, record the new name */
+  write_perf_map_entry(function);
+}
+
+/* Remember where the block that builds this function came from, to name
+ * the function in the perf map if it is not given a better name */
+static void record_builder_location(jit_function_t function)
+{
+  VALUE proc;
+  VALUE location;
+  char buf[1024];
+
+  if(!perf_map_file || !rb_block_given_p())
+  {
+    return;
+  }
+
+  proc = rb_block_proc();
+  if(!rb_respond_to(proc, rb_intern("source_location")))
+  {
+    return;
+  }
+
+  location = rb_funcall(proc, rb_intern("source_location"), 0);
+  if(TYPE(location) != T_ARRAY || RARRAY_LEN(location) < 2)
+  {
+    return;
+  }
+
+  snprintf(buf, sizeof(buf), "jit %s:%d",
+      StringValuePtr(RARRAY_PTR(location)[0]),
+      NUM2INT(RARRAY_PTR(location)[1]));
+  set_function_meta_string(function, RJT_SOURCE_LOCATION, buf);
+}
+
+/* Open the perf map at path, or at /tmp/perf-<pid>.map (where perf
+ * looks for it) if path is 0 */
+static void open_perf_map(char const * path)
+{
+  if(perf_map_file)
+  {
+    return;
+  }
+
+  if(path)
+  {
+    if(strlen(path) >= sizeof(perf_map_path))
+    {
+      rb_raise(rb_eArgError, "Perf map path too long");
+    }
+    strcpy(perf_map_path, path);
+  }
+  else
+  {
+    snprintf(perf_map_path, sizeof(perf_map_path), "/tmp/perf-%d.map", (int)getpid());
+  }
+
+  perf_map_file = fopen(perf_map_path, "a");
+  if(!perf_map_file)
+  {
+    rb_sys_fail(perf_map_path);
+  }
+}
+
+/*
+ * call-seq:
+ *   JIT.enable_perf_map
+ *   JIT.enable_perf_map(path)
+ *
+ * Start writing an entry to /tmp/perf-<pid>.map (or to +path+) for
+ * each function that is compiled or recompiled from now on, so that
+ * Linux perf can symbolize jit frames.  Functions are named by the name
+ * given to insn_call or define_jit_method if there is one, otherwise by
+ * the location of the block that built them.  A new entry is written
+ * when a compiled function is given a name.  Does nothing if the perf
+ * map is already enabled.
+ *
+ * Setting the RUBY_LIBJIT_PERF_MAP environment variable has the same
+ * effect when the extension is loaded.
+ */
+static VALUE jit_s_enable_perf_map(int argc, VALUE * argv, VALUE self)
+{
+  VALUE path_v = Qnil;
+  rb_scan_args(argc, argv, "01", &path_v);
+  open_perf_map(NIL_P(path_v) ? 0 : StringValueCStr(path_v));
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   JIT.disable_perf_map
+ *
+ * Stop writing perf map entries and close the perf map.  The file is
+ * left in place.
+ */
+static VALUE jit_s_disable_perf_map(VALUE self)
+{
+  if(perf_map_file)
+  {
+    fclose(perf_map_file);
+    perf_map_file = 0;
+  }
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   path = JIT.perf_map_path
+ *
+ * Get the path perf map entries are being written to, or nil if the
+ * perf map is not enabled.
+ */
+static VALUE jit_s_perf_map_path(VALUE self)
+{
+  return perf_map_file ? rb_str_new2(perf_map_path) : Qnil;
+}
+
+/*
+ * call-seq:
+ *   is_enabled = JIT.perf_map_enabled?
+ *
+ * Determine whether perf map entries are being written.
+ */
+static VALUE jit_s_is_perf_map_enabled(VALUE self)
+{
+  return perf_map_file ? Qtrue : Qfalse;
+}
+
+/* ---------------------------------------------------------------------------
+ * Statistics
+ * ---------------------------------------------------------------------------
+ */
+
+/* Counters kept for each function, for each context (the sum over its
+ * functions), and for the whole process.  They are only updated while
+ * holding the GVL. */
+struct Stats
+{
+  unsigned long functions;
+  unsigned long compiles;
+  unsigned long insns;
+  unsigned long values;
+  unsigned long constants;
+  unsigned long saved_constants;
+  unsigned long code_size;
+  unsigned long evictions;
+  unsigned long rebuilds;
+  double build_time;
+  double compile_time;
+  int optimization_level;
+};
+
+static struct Stats process_stats;
+
+static double stats_now(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+#endif
+}
+
+static struct Stats * create_stats(void)
+{
+  struct Stats * stats = ALLOC(struct Stats);
+  MEMZERO(stats, struct Stats, 1);
+  return stats;
+}
+
+static struct Stats * get_function_stats(jit_function_t function)
+{
+  return (struct Stats *)jit_function_get_meta(function, RJT_STATS);
+}
+
+/* Add the given delta to the function's counters and to the counters
+ * of its context and of the process.  Deltas to the counters that are
+ * replaced rather than accumulated (insns and code_size) may wrap
+ * around; the sums are still correct. */
+static void add_stats(jit_function_t function, struct Stats const * delta)
+{
+  struct Stats * chain[3];
+  int n = 0;
+  int i;
+
+  if((chain[n] = get_function_stats(function)))
+  {
+    ++n;
+  }
+  if((chain[n] = (struct Stats *)jit_context_get_meta(
+          jit_function_get_context(function), RJT_STATS)))
+  {
+    ++n;
+  }
+  chain[n++] = &process_stats;
+
+  for(i = 0; i < n; ++i)
+  {
+    chain[i]->functions += delta->functions;
+    chain[i]->compiles += delta->compiles;
+    chain[i]->insns += delta->insns;
+    chain[i]->values += delta->values;
+    chain[i]->constants += delta->constants;
+    chain[i]->saved_constants += delta->saved_constants;
+    chain[i]->code_size += delta->code_size;
+    chain[i]->evictions += delta->evictions;
+    chain[i]->rebuilds += delta->rebuilds;
+    chain[i]->build_time += delta->build_time;
+    chain[i]->compile_time += delta->compile_time;
+  }
+}
+
+static void stats_count_value(jit_function_t function, int is_constant)
+{
+  struct Stats delta = { 0 };
+  if(is_constant)
+  {
+    delta.constants = 1;
+  }
+  else
+  {
+    delta.values = 1;
+  }
+  add_stats(function, &delta);
+}
+
+static void stats_add_build_time(jit_function_t function, double build_time)
+{
+  struct Stats delta = { 0 };
+  delta.build_time = build_time;
+  add_stats(function, &delta);
+}
+
+static void stats_add_compile(jit_function_t function, double compile_time)
+{
+  struct Stats delta = { 0 };
+  delta.compiles = 1;
+  delta.compile_time = compile_time;
+  add_stats(function, &delta);
+}
+
+/* Record the number of instructions in the function's IR.  This must
+ * be called before the function is compiled, since libjit discards the
+ * IR afterward. */
+static void stats_count_insns(jit_function_t function)
+{
+  struct Stats * stats = get_function_stats(function);
+  struct Stats delta = { 0 };
+  unsigned long insns = 0;
+  jit_block_t block = 0;
+
+  if(!stats)
+  {
+    return;
+  }
+
+  while((block = jit_block_next(function, block)))
+  {
+    jit_insn_iter_t iter;
+    jit_insn_iter_init(&iter, block);
+    while(jit_insn_iter_next(&iter))
+    {
+      ++insns;
+    }
+  }
+
+  delta.insns = insns - stats->insns;
+  add_stats(function, &delta);
+}
+
+/* Record the size of the function's native code and the optimization
+ * level it was compiled at */
+static void stats_record_code(jit_function_t function)
+{
+  struct Stats * stats = get_function_stats(function);
+  struct Stats delta = { 0 };
+  char * start;
+  size_t size = 0;
+
+  if(!stats)
+  {
+    return;
+  }
+
+  function_code_range(function, &start, &size);
+  delta.code_size = size - stats->code_size;
+  add_stats(function, &delta);
+  stats->optimization_level = jit_function_get_optimization_level(function);
+}
+
+/* Called each time a function is successfully compiled or recompiled */
+static void function_compiled(jit_function_t function)
+{
+  /* The IR is gone, so any handles and interned constants are no
+   * longer usable */
+  jit_function_free_meta(function, RJT_HANDLES);
+  jit_function_free_meta(function, RJT_CONSTANTS);
+  jit_function_free_meta(function, RJT_OPTIMIZER);
+
+  stats_record_code(function);
+  write_perf_map_entry(function);
+}
+
+static VALUE stats_to_hash(struct Stats const * stats, int is_function)
+{
+  VALUE hash = rb_hash_new();
+  if(!is_function)
+  {
+    rb_hash_aset(hash, ID2SYM(rb_intern("functions")), ULONG2NUM(stats->functions));
+  }
+  rb_hash_aset(hash, ID2SYM(rb_intern("compiles")), ULONG2NUM(stats->compiles));
+  rb_hash_aset(hash, ID2SYM(rb_intern("insns")), ULONG2NUM(stats->insns));
+  rb_hash_aset(hash, ID2SYM(rb_intern("values")), ULONG2NUM(stats->values));
+  rb_hash_aset(hash, ID2SYM(rb_intern("constants")), ULONG2NUM(stats->constants));
+  rb_hash_aset(hash, ID2SYM(rb_intern("saved_constants")), ULONG2NUM(stats->saved_constants));
+  rb_hash_aset(hash, ID2SYM(rb_intern("code_size")), ULONG2NUM(stats->code_size));
+  rb_hash_aset(hash, ID2SYM(rb_intern("evictions")), ULONG2NUM(stats->evictions));
+  rb_hash_aset(hash, ID2SYM(rb_intern("rebuilds")), ULONG2NUM(stats->rebuilds));
+  rb_hash_aset(hash, ID2SYM(rb_intern("build_time")), rb_float_new(stats->build_time));
+  rb_hash_aset(hash, ID2SYM(rb_intern("compile_time")), rb_float_new(stats->compile_time));
+  if(is_function)
+  {
+    rb_hash_aset(hash, ID2SYM(rb_intern("optimization_level")), INT2NUM(stats->optimization_level));
+  }
+  return hash;
+}
+
+/*
+ * call-seq:
+ *   totals = JIT::Stats.totals
+ *
+ * Get the statistics for every function created in this process, as a
+ * hash with these keys:
+ *
+ * +functions+::    The number of functions created.
+ * +compiles+::     The number of times a function was compiled or
+ *                  recompiled.
+ * +insns+::        The number of IR instructions in the functions, as
+ *                  of their most recent compilation.
+ * +values+::       The number of values (other than constants) created
+ *                  through the builder interface.
+ * +constants+::    The number of constants created.
+ * +saved_constants+:: The number of times an existing constant was
+ *                  reused rather than created again.
+ * +code_size+::    The size in bytes of the functions' native code.
+ * +evictions+::    The number of times a function's code was evicted to
+ *                  keep within JIT.code_budget.
+ * +rebuilds+::     The number of times an evicted function was rebuilt.
+ * +build_time+::   Seconds spent running builder blocks.
+ * +compile_time+:: Seconds spent in libjit compiling.
+ *
+ * See also Context#stats and Function#stats.
+ */
+static VALUE stats_s_totals(VALUE klass)
+{
+  return stats_to_hash(&process_stats, 0);
+}
+
+/* ---------------------------------------------------------------------------
+ * Handles
+ * ---------------------------------------------------------------------------
+ */
+
+/* Values and labels can be referred to by small integer handles
+ * instead of JIT::Value and JIT::Label objects, so building a large
+ * function does not allocate a ruby object per value.  A handle is an
+ * index into a table kept with the function while it is being built;
+ * the table is discarded once the function is compiled. */
+struct Handle_Table
+{
+  jit_value_t * values;
+  long num_values;
+  long values_capacity;
+  jit_label_t * labels;
+  long num_labels;
+  long labels_capacity;
+};
+
+/* Flags describing the value arguments to an instruction */
+enum
+{
+  SAW_HANDLE = 1,
+  SAW_OBJECT = 2
+};
+
+static void free_handle_table(void * table_ptr)
+{
+  struct Handle_Table * table = (struct Handle_Table *)table_ptr;
+  xfree(table->values);
+  xfree(table->labels);
+  xfree(table);
+}
+
+static struct Handle_Table * get_handle_table(jit_function_t function)
+{
+  struct Handle_Table * table = (struct Handle_Table *)jit_function_get_meta(
+      function, RJT_HANDLES);
+
+  if(!table)
+  {
+    table = ALLOC(struct Handle_Table);
+    MEMZERO(table, struct Handle_Table, 1);
+    if(!jit_function_set_meta(function, RJT_HANDLES, table, free_handle_table, 0))
+    {
+      xfree(table);
+      rb_raise(rb_eNoMemError, "Out of memory");
+    }
+  }
+
+  return table;
+}
+
+static VALUE create_value_handle(jit_function_t function, jit_value_t value)
+{
+  struct Handle_Table * table = get_handle_table(function);
+
+  if(table->num_values == table->values_capacity)
+  {
+    table->values_capacity = table->values_capacity ? table->values_capacity * 2 : 64;
+    REALLOC_N(table->values, jit_value_t, table->values_capacity);
+  }
+
+  table->values[table->num_values] = value;
+  return LONG2FIX(table->num_values++);
+}
+
+static VALUE create_label_handle(jit_function_t function)
+{
+  struct Handle_Table * table = get_handle_table(function);
+
+  if(table->num_labels == table->labels_capacity)
+  {
+    table->labels_capacity = table->labels_capacity ? table->labels_capacity * 2 : 16;
+    REALLOC_N(table->labels, jit_label_t, table->labels_capacity);
+  }
+
+  table->labels[table->num_labels] = jit_label_undefined;
+  return LONG2FIX(table->num_labels++);
+}
+
+/* Get the jit value for an argument that is either a JIT::Value or a
+ * value handle (or a JIT::Handle wrapping one), and note in flags
+ * which it was */
+static jit_value_t get_jit_value(
+    jit_function_t function, char const * param_name, VALUE value_v, int * flags)
+{
+  jit_value_t value;
+
+  if(!FIXNUM_P(value_v) && RTEST(rb_obj_is_kind_of(value_v, rb_cHandle)))
+  {
+    value_v = rb_iv_get(value_v, "@handle");
+  }
+
+  if(FIXNUM_P(value_v))
+  {
+    struct Handle_Table * table = (struct Handle_Table *)jit_function_get_meta(
+        function, RJT_HANDLES);
+    long handle = FIX2LONG(value_v);
+
+    if(!table || handle < 0 || handle >= table->num_values)
+    {
+      rb_raise(rb_eIndexError, "Invalid value handle %ld for %s", handle, param_name);
+    }
+
+    *flags |= SAW_HANDLE;
+    return table->values[handle];
+  }
+
+  check_type(param_name, rb_cValue, value_v);
+  Get_Data(value_v, value, struct _jit_value, value);
+  *flags |= SAW_OBJECT;
+  return value;
+}
+
+/* Get the jit label for an argument that is either a JIT::Label or a
+ * label handle.  The pointer is only good until the next label handle
+ * is created. */
+static jit_label_t * get_jit_label(
+    jit_function_t function, char const * param_name, VALUE label_v)
+{
+  jit_label_t * label;
+
+  if(FIXNUM_P(label_v))
+  {
+    struct Handle_Table * table = (struct Handle_Table *)jit_function_get_meta(
+        function, RJT_HANDLES);
+    long handle = FIX2LONG(label_v);
+
+    if(!table || handle < 0 || handle >= table->num_labels)
+    {
+      rb_raise(rb_eIndexError, "Invalid label handle %ld for %s", handle, param_name);
+    }
+
+    return &table->labels[handle];
+  }
+
+  check_type(param_name, rb_cLabel, label_v);
+  Get_Data(label_v, label, jit_label_t, label);
+  return label;
+}
+
+/* ---------------------------------------------------------------------------
+ * Memory usage
+ * ---------------------------------------------------------------------------
+ */
+
+/* Rough sizes of libjit's IR structures, which are private to libjit,
+ * for estimating the memory used by a function while it is built */
+#define IR_VALUE_SIZE (6 * sizeof(void *))
+#define IR_INSN_SIZE (4 * sizeof(void *))
+#define IR_TYPE_COMPONENT_SIZE (3 * sizeof(void *))
+
+static VALUE jit_s_code_budget(VALUE self);
+static VALUE jit_s_code_cache_size(VALUE self);
+
+static void context_free(jit_context_t context)
+{
+  struct Stats * stats = (struct Stats *)jit_context_get_meta(context, RJT_STATS);
+  if(stats)
+  {
+    freed_functions += stats->functions;
+    freed_code_size += stats->code_size;
+  }
+  --live_contexts;
+  jit_context_destroy(context);
+}
+
+/* A context owns the native code of all its functions, including those
+ * that have been released, until it is destroyed */
+static size_t context_memsize(jit_context_t context)
+{
+  struct Stats * stats = (struct Stats *)jit_context_get_meta(context, RJT_STATS);
+  return sizeof(struct Stats) + (stats ? stats->code_size : 0);
+}
+
+/* A function's code is counted by its context; a function that has not
+ * been compiled yet holds its IR and the tables used to build it */
+static size_t function_memsize(jit_function_t function)
+{
+  struct Stats * stats;
+  struct Handle_Table * table;
+  struct Apply_Plan * plan;
+  size_t size = 0;
+
+  if(!function)
+  {
+    return 0;
+  }
+
+  if((stats = get_function_stats(function)))
+  {
+    size += sizeof(struct Stats);
+    if(!jit_function_is_compiled(function))
+    {
+      size += (stats->values + stats->constants) * IR_VALUE_SIZE;
+      size += stats->values * IR_INSN_SIZE;
+    }
+  }
+
+  if((table = (struct Handle_Table *)jit_function_get_meta(function, RJT_HANDLES)))
+  {
+    size += sizeof(struct Handle_Table);
+    size += table->values_capacity * sizeof(jit_value_t);
+    size += table->labels_capacity * sizeof(jit_label_t);
+  }
+
+  if((plan = (struct Apply_Plan *)jit_function_get_meta(function, RJT_APPLY_PLAN)))
+  {
+    size += sizeof(struct Apply_Plan)
+      + plan->num_args * sizeof(struct Apply_Plan_Arg);
+  }
+
+  return size;
+}
+
+static size_t type_memsize(jit_type_t type)
+{
+  switch(jit_type_get_kind(type))
+  {
+    case JIT_TYPE_STRUCT:
+    case JIT_TYPE_UNION:
+      return IR_VALUE_SIZE + jit_type_num_fields(type) * IR_TYPE_COMPONENT_SIZE;
+
+    case JIT_TYPE_SIGNATURE:
+      return IR_VALUE_SIZE + jit_type_num_params(type) * IR_TYPE_COMPONENT_SIZE;
+
+    default:
+      return 0;
+  }
+}
+
+/*
+ * call-seq:
+ *   stats = JIT.memory_stats
+ *
+ * Get a summary of the memory used by the JIT, as a hash with these
+ * keys:
+ *
+ * +contexts+::            The number of contexts that have not been
+ *                         freed.
+ * +functions+::           The number of functions in those contexts.
+ * +code_size+::           The size in bytes of those functions' native
+ *                         code.
+ * +evictable_code_size+:: The part of code_size that may be evicted
+ *                         (see JIT.code_budget).
+ * +code_budget+::         The limit set with JIT.code_budget=, or nil.
+ *
+ * ObjectSpace.memsize_of reports a context's code and the IR of a
+ * function that is being built.
+ */
+static VALUE jit_s_memory_stats(VALUE self)
+{
+  VALUE hash = rb_hash_new();
+  rb_hash_aset(hash, ID2SYM(rb_intern("contexts")), ULONG2NUM(live_contexts));
+  rb_hash_aset(hash, ID2SYM(rb_intern("functions")),
+      ULONG2NUM(process_stats.functions - freed_functions));
+  rb_hash_aset(hash, ID2SYM(rb_intern("code_size")),
+      ULONG2NUM(process_stats.code_size - freed_code_size));
+  rb_hash_aset(hash, ID2SYM(rb_intern("evictable_code_size")), jit_s_code_cache_size(self));
+  rb_hash_aset(hash, ID2SYM(rb_intern("code_budget")), jit_s_code_budget(self));
+  return hash;
+}
+
+/* ---------------------------------------------------------------------------
+ * Function
+ * ---------------------------------------------------------------------------
+ */
+
+static void mark_function(jit_function_t function)
+{
+  if(!function)
+  {
+    /* Released */
+    return;
+  }
+
+  rb_gc_mark((VALUE)jit_function_get_meta(function, RJT_VALUE_OBJECTS));
+  rb_gc_mark((VALUE)jit_function_get_meta(function, RJT_METHODS));
+  rb_gc_mark((VALUE)jit_function_get_meta(function, RJT_RECIPE));
+  rb_gc_mark((VALUE)jit_function_get_meta(function, RJT_CONTEXT));
+  rb_gc_mark((VALUE)jit_function_get_meta(function, RJT_BUILDER));
+  rb_gc_mark((VALUE)jit_function_get_meta(function, RJT_REBUILDER));
+  rb_gc_mark((VALUE)jit_function_get_meta(function, RJT_CONSTANTS));
+
+  {
+    struct Recorder * recorder = (struct Recorder *)jit_function_get_meta(
+        function, RJT_RECORDER);
+    if(recorder)
+    {
+      mark_recorder(recorder);
+    }
+  }
+
+  {
+    struct Optimizer * opt = (struct Optimizer *)jit_function_get_meta(
+        function, RJT_OPTIMIZER);
+    if(opt)
+    {
+      mark_optimizer(opt);
+    }
+  }
+
+  {
+    struct Tier_State * tier = (struct Tier_State *)jit_function_get_meta(
+        function, RJT_TIER_STATE);
+    if(tier)
+    {
+      mark_tier_state(tier);
+    }
+  }
+}
+
+/* Get the JIT::Function for a jit function */
+static VALUE function_object(jit_function_t function)
+{
+  VALUE function_v = (VALUE)jit_function_get_meta(function, RJT_SELF);
+  if(function_v && DATA_PTR(function_v) == function)
+  {
+    return function_v;
+  }
+
+  /* The function was released, but its code is still being used */
+  return Wrap_Data(rb_cFunction, function, function);
+}
+
+static VALUE function_start_recording(VALUE self);
+
+/* Keep obj alive for as long as the function is (its code may refer to
+ * it).  The objects are kept in a Hash keyed by address, used as a set,
+ * so each is only kept once however often the function refers to it
+ * or is rebuilt. */
+static void retain_object(jit_function_t function, VALUE obj)
+{
+  if(SPECIAL_CONST_P(obj))
+  {
+    return;
+  }
+
+  rb_hash_aset(
+      (VALUE)jit_function_get_meta(function, RJT_VALUE_OBJECTS),
+      ULONG2NUM((unsigned long)obj),
+      obj);
+}
+
+static VALUE create_function(int argc, VALUE * argv, VALUE klass)
+{
+  VALUE context_v;
+  VALUE signature_v;
+  VALUE parent_function_v;
+
+  jit_function_t function;
+  jit_function_t parent_function;
+  jit_context_t context;
+  jit_type_t signature;
+  jit_type_t untagged_signature;
+
+  VALUE function_v;
+  VALUE functions;
+
+  int signature_tag;
+
+  struct Stats * stats;
+  struct Stats delta = { 0 };
+
+  rb_scan_args(argc, argv, "21", &context_v, &signature_v, &parent_function_v);
+
+  /* Allow the user to specify the signature as a hash */
+  if (TYPE(signature_v) == T_HASH)
+  {
+    signature_v = rb_funcall(
+        rb_cType,
+        rb_intern("create_signature"),
+        1,
+        signature_v);
+  }
+
+  check_type("context", rb_cContext, context_v);
+  check_type("signature", rb_cType, signature_v);
+
+  Get_Data(context_v, context, struct _jit_context, context);
+  Get_Data(signature_v, type, struct _jit_type, signature);
+
+  signature_tag = jit_type_get_kind(signature);
+
+  /* If this signature was tagged, get the untagged type */
+  if((untagged_signature = jit_type_get_tagged_type(signature)))
+  {
+    signature = untagged_signature;
+  }
+
+  if(RTEST(parent_function_v))
+  {
+    /* If this function has a parent, then it is a nested function */
+    Get_Function(parent_function_v, parent_function);
+    function = jit_function_create_nested(context, signature, parent_function);
+  }
+  else
+  {
+    /* Otherwise, it's a standalone function */
+    function = jit_function_create(context, signature);
+  }
+
+  /* Make sure the function is around as long as the context is */
+  if(!jit_function_set_meta(function, RJT_VALUE_OBJECTS, (void *)rb_hash_new(), 0, 0))
+  {
+    rb_raise(rb_eNoMemError, "Out of memory");
+  }
+
+  /* Remember the signature's tag for later */
+  if(!jit_function_set_meta(function, RJT_TAG_FOR_SIGNATURE, (void *)signature_tag, 0, 0))
+  {
+    rb_raise(rb_eNoMemError, "Out of memory");
+  }
+
+  /* And remember the function's context for later */
+  if(!jit_function_set_meta(function, RJT_CONTEXT, (void *)context_v, 0, 0))
+  {
+    rb_raise(rb_eNoMemError, "Out of memory");
+  }
+
+  record_builder_location(function);
+
+  stats = create_stats();
+  if(!jit_function_set_meta(function, RJT_STATS, stats, xfree, 0))
+  {
+    xfree(stats);
+    rb_raise(rb_eNoMemError, "Out of memory");
+  }
+  delta.functions = 1;
+  add_stats(function, &delta);
+
+  /* Remember the signature, so the function can be rebuilt in another
+   * context (see migrate) */
+  retain_object(function, signature_v);
+  if(!jit_function_set_meta(function, RJT_SIGNATURE, (void *)signature_v, 0, 0))
+  {
+    rb_raise(rb_eNoMemError, "Out of memory");
+  }
+
+  function_v = Wrap_Data(rb_cFunction, function, function);
+  if(!jit_function_set_meta(function, RJT_SELF, (void *)function_v, 0, 0))
+  {
+    rb_raise(rb_eNoMemError, "Out of memory");
+  }
+
+  /* Add this function to the context's list of functions */
+  functions = (VALUE)jit_context_get_meta(context, RJT_FUNCTIONS);
+  rb_ary_push(functions, function_v);
+
+  if(jit_context_get_meta(context, RJT_KEEP_RECIPES))
+  {
+    function_start_recording(function_v);
+  }
+
+  return function_v;
+}
+
+static void * compile_without_gvl(void * function)
+{
+  return (void *)(long)jit_function_compile((jit_function_t)function);
+}
+
+/* Compile the function.  The IR has already been built, so libjit does
+ * not need to call back into ruby, and we can let other threads run
+ * (including threads compiling other functions) in the meantime. */
+static void keep_recipe(jit_function_t function);
+
+struct Cache_Entry;
+static struct Cache_Entry * get_cache_entry(jit_function_t function);
+static void emit_cache_prologue(jit_function_t function, struct Cache_Entry * entry);
+static void cache_insert(jit_function_t function);
+static void cache_remove(jit_function_t function);
+
+static void compile_function(jit_function_t function)
+{
+  double start;
+
+  keep_recipe(function);
+  stats_count_insns(function);
+  start = stats_now();
+  if(!call_without_gvl(compile_without_gvl, function))
+  {
+    rb_raise(rb_eRuntimeError, "Unable to compile function");
+  }
+  stats_add_compile(function, stats_now() - start);
+
+  get_apply_plan(function);
+  function_compiled(function);
+}
+
+/* Run a lazy function's builder block and compile the result, unless
+ * another thread got there first.  The builder is removed before it is
+ * run, so it is only ever run once.  Called with the context's build
+ * lock held. */
+static VALUE run_lazy_builder(VALUE function_v)
+{
+  jit_function_t function;
+  struct Cache_Entry * entry;
+  VALUE builder;
+  double start;
+
+  Get_Function(function_v, function);
+  builder = (VALUE)jit_function_get_meta(function, RJT_BUILDER);
+  if(jit_function_is_compiled(function) || !builder)
+  {
+    return function_v;
+  }
+  jit_function_free_meta(function, RJT_BUILDER);
+
+  entry = get_cache_entry(function);
+  if(entry)
+  {
+    /* Keep the builder, to rebuild the function if it is evicted */
+    if(!jit_function_set_meta(function, RJT_REBUILDER, (void *)builder, 0, 0))
+    {
+      rb_raise(rb_eNoMemError, "Out of memory");
+    }
+    emit_cache_prologue(function, entry);
+  }
+
+  start = stats_now();
+  rb_funcall(builder, rb_intern("call"), 1, function_v);
+  stats_add_build_time(function, stats_now() - start);
+
+  compile_function(function);
+  cache_insert(function);
+
+  return function_v;
+}
+
+static VALUE build_lazy_function_locked(VALUE function_v)
+{
+  jit_function_t function;
+  Get_Function(function_v, function);
+  return with_build_lock(
+      jit_function_get_context(function), run_lazy_builder, function_v);
+}
+
+/* If the function is lazy and not yet built, build and compile it
+ * now */
+static void build_lazy_function(jit_function_t function)
+{
+  if(jit_function_is_compiled(function)
+      || !jit_function_get_meta(function, RJT_BUILDER))
+  {
+    return;
+  }
+
+  build_lazy_function_locked(function_object(function));
+}
+
+/* Called by libjit the first time a lazy function is entered through
+ * a closure or through a call from another jit function.  libjit takes
+ * its own build lock, with the GVL held, before calling us.  If we kept
+ * it while the builder runs, a thread that entered another lazy
+ * function in the meantime would wait for it without releasing the
+ * GVL, and the builder could never finish.  So release it, build under
+ * the context's build lock (which another thread may already hold, to
+ * build this same function), and take it again for libjit to release
+ * once we return.  This cannot block for long: libjit's lock is now
+ * only held by a thread that also holds the GVL. */
+static int function_on_demand_compiler(jit_function_t function)
+{
+  jit_context_t context = jit_function_get_context(function);
+  int state = 0;
+
+  jit_context_build_end(context);
+  rb_protect(build_lazy_function_locked, function_object(function), &state);
+
+  if(state)
+  {
+    /* The exception unwinds through libjit, which will not release
+     * its lock, so leave it released */
+    rb_jump_tag(state);
+  }
+
+  jit_context_build_start(context);
+
+  return jit_function_is_compiled(function)
+    ? JIT_RESULT_OK
+    : JIT_RESULT_COMPILE_ERROR;
+}
+
+/*
+ * call-seq:
+ *   function.compile()
+ *
+ * Begin compiling a function.  If the function was created with
+ * Function.compile_lazy and has not yet been built, its builder block
+ * is run first.
+ *
+ * Other ruby threads may run while the function is being compiled.
+ */
+static VALUE function_compile(VALUE self)
+{
+  jit_function_t function;
+  Get_Function(self, function);
+  if(jit_function_get_meta(function, RJT_BUILDER))
+  {
+    build_lazy_function(function);
+  }
+  else
+  {
+    compile_function(function);
+  }
+  return self;
+}
+
+/*
+ * call-seq:
+ *   function = Function.new(context, signature, [parent])
+ *
+ * Create a new function.
+ */
+static VALUE function_s_new(int argc, VALUE * argv, VALUE klass)
+{
+  if(rb_block_given_p())
+  {
+    rb_raise(rb_eArgError, "Function.new does not take a block");
+  }
+
+  return create_function(argc, argv, klass);
+}
+
+static VALUE function_abandon_if_exception(VALUE function_v)
 {
   if(ruby_errinfo)
   {
-    jit_function_t function;
-    Data_Get_Struct(function_v, struct _jit_function, function);
-    jit_function_abandon(function);
+    jit_function_t function;
+    Get_Function(function_v, function);
+    jit_function_abandon(function);
+  }
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   function = Function.new(context, signature, [parent]) { |function| ... }
+ *
+ * Create a new function, begin compiling it, and pass the function to
+ * the block.
+ */
+static VALUE function_s_compile(int argc, VALUE * argv, VALUE klass)
+{
+  VALUE function = create_function(argc, argv, klass);
+  jit_function_t j_function;
+  double start;
+
+  Get_Function(function, j_function);
+  start = stats_now();
+  rb_yield(function);
+  stats_add_build_time(j_function, stats_now() - start);
+
+#ifdef HAVE_RB_ENSURE
+  rb_ensure(
+      function_compile,
+      function,
+      function_abandon_if_exception,
+      function);
+#else
+  /* Rubinius does not yet have rb_ensure */
+  function_compile(function);
+  function_abandon_if_exception(function);
+#endif
+  return function;
+}
+
+/*
+ * call-seq:
+ *   function = Function.compile_lazy(context, signature, [parent]) { |function| ... }
+ *
+ * Create a new function, but defer building and compiling it until it
+ * is first needed.  The block is kept and run the first time the
+ * function is applied, called from another jit function (via
+ * insn_call), entered through a closure (e.g. a method defined with
+ * define_jit_method), or explicitly compiled with compile.
+ */
+static VALUE function_s_compile_lazy(int argc, VALUE * argv, VALUE klass)
+{
+  VALUE function_v;
+  jit_function_t function;
+
+  if(!rb_block_given_p())
+  {
+    rb_raise(rb_eArgError, "Function.compile_lazy requires a block");
+  }
+
+  function_v = create_function(argc, argv, klass);
+  Get_Function(function_v, function);
+
+  if(!jit_function_set_meta(function, RJT_BUILDER, (void *)rb_block_proc(), 0, 0))
+  {
+    rb_raise(rb_eNoMemError, "Out of memory");
+  }
+
+  jit_function_set_on_demand_compiler(function, function_on_demand_compiler);
+
+  return function_v;
+}
+
+/* Bookkeeping for a tiered function.  The counters are updated directly
+ * by the function's jit code, so calls through closures are counted as
+ * well as calls through apply. */
+struct Tier_State
+{
+  unsigned long calls;
+  unsigned long threshold;
+  int tier;
+  int failed;
+  VALUE error;  /* the exception the builder raised, if tier-up failed */
+};
+
+static void mark_tier_state(struct Tier_State * tier)
+{
+  rb_gc_mark(tier->error);
+}
+
+static struct Tier_State * get_tier_state(jit_function_t function)
+{
+  return (struct Tier_State *)jit_function_get_meta(function, RJT_TIER_STATE);
+}
+
+/* Describe the exception a tiered function's builder raised, without
+ * letting a failure to describe it escape */
+static VALUE describe_tier_error(VALUE error)
+{
+  VALUE description;
+  int state = 0;
+
+  if(NIL_P(error))
+  {
+    return rb_str_new2("the function could not be recompiled");
+  }
+
+  description = rb_protect(rb_inspect, error, &state);
+  if(state)
+  {
+#ifdef HAVE_RB_ERRINFO
+    rb_set_errinfo(Qnil);
+#else
+    ruby_errinfo = Qnil;
+#endif
+    return rb_str_new2(rb_obj_classname(error));
+  }
+
+  return description;
+}
+
+/* Called from a tier 0 function's jit code once it gets hot.  The
+ * function was marked recompilable before it was first compiled, so
+ * existing closures will pick up the new code. */
+static void tier_up(jit_function_t function)
+{
+  struct Tier_State * tier = get_tier_state(function);
+  struct Stats * stats = get_function_stats(function);
+  double build_time;
+  double start;
+
+  if(tier->tier != 0 || tier->failed)
+  {
+    return;
+  }
+
+  /* Set the tier first so the rebuilt code omits the tier-up check */
+  tier->tier = 1;
+  jit_function_set_optimization_level(
+      function, jit_function_get_max_optimization_level());
+
+  /* The builder runs inside jit_function_recompile and records its own
+   * time, so leave that out of the compile time */
+  build_time = stats ? stats->build_time : 0;
+  start = stats_now();
+  if(jit_function_recompile(function) != JIT_RESULT_OK)
+  {
+    VALUE description = describe_tier_error(tier->error);
+    tier->tier = 0;
+    tier->failed = 1;
+    rb_warn(
+        "Unable to recompile hot function (%s); leaving it at tier 0"
+        " (see Function#tier_up_error)",
+        StringValueCStr(description));
+    RB_GC_GUARD(description);
+    return;
+  }
+  stats_add_compile(function,
+      stats_now() - start - ((stats ? stats->build_time : 0) - build_time));
+
+  function_compiled(function);
+}
+
+/* Emit code to count calls to the function and, at tier 0, to tier up
+ * once the count reaches the threshold */
+static void emit_tier_prologue(jit_function_t function, struct Tier_State * tier)
+{
+  jit_value_t tier_ptr;
+  jit_value_t calls;
+
+  tier_ptr = jit_value_create_nint_constant(
+      function, jit_type_void_ptr, (jit_nint)tier);
+  calls = jit_insn_load_relative(
+      function, tier_ptr, offsetof(struct Tier_State, calls), jit_type_nuint);
+  calls = jit_insn_add(
+      function, calls, jit_value_create_nint_constant(function, jit_type_nuint, 1));
+  jit_insn_store_relative(
+      function, tier_ptr, offsetof(struct Tier_State, calls), calls);
+
+  if(tier->tier == 0)
+  {
+    jit_label_t done_label = jit_label_undefined;
+    jit_value_t threshold;
+    jit_value_t args[1];
+
+    threshold = jit_insn_load_relative(
+        function, tier_ptr, offsetof(struct Tier_State, threshold), jit_type_nuint);
+    jit_insn_branch_if_not(
+        function, jit_insn_ge(function, calls, threshold), &done_label);
+
+    args[0] = jit_value_create_nint_constant(
+        function, jit_type_void_ptr, (jit_nint)function);
+    jit_insn_call_native(
+        function, "tier_up", (void *)tier_up, tier_up_signature, args, 1,
+        JIT_CALL_NOTHROW);
+
+    jit_insn_label(function, &done_label);
+  }
+}
+
+/* Build the IR for a tiered function.  Unlike a lazy function, the
+ * builder is kept so the function can be rebuilt when it is
+ * recompiled. */
+static VALUE run_tiered_builder(VALUE function_v)
+{
+  jit_function_t function;
+  double start;
+
+  Get_Function(function_v, function);
+  start = stats_now();
+  emit_tier_prologue(function, get_tier_state(function));
+  rb_funcall(
+      (VALUE)jit_function_get_meta(function, RJT_BUILDER),
+      rb_intern("call"),
+      1,
+      function_v);
+  stats_add_build_time(function, stats_now() - start);
+  stats_count_insns(function);
+  return function_v;
+}
+
+static VALUE run_tiered_builder_locked(VALUE function_v)
+{
+  jit_function_t function;
+  Get_Function(function_v, function);
+  return with_build_lock(
+      jit_function_get_context(function), run_tiered_builder, function_v);
+}
+
+/* Called by libjit (via jit_function_recompile) to rebuild a tiered
+ * function's IR; libjit compiles it afterward.  As with a lazy
+ * function, libjit's build lock is released while the builder runs
+ * under the context's build lock (see function_on_demand_compiler), so
+ * a tier-up from inside Context#build, or while another thread is
+ * building in the same context, does not deadlock. */
+static int function_tiered_on_demand_compiler(jit_function_t function)
+{
+  jit_context_t context = jit_function_get_context(function);
+  VALUE function_v;
+  int state = 0;
+
+  function_v = function_object(function);
+  jit_context_build_end(context);
+  rb_protect(run_tiered_builder_locked, function_v, &state);
+  jit_context_build_start(context);
+
+  if(state)
+  {
+    /* We are inside the function's own jit code, so don't let the
+     * exception propagate; keep it for tier_up to report */
+#ifdef HAVE_RB_ERRINFO
+    get_tier_state(function)->error = rb_errinfo();
+    rb_set_errinfo(Qnil);
+#else
+    get_tier_state(function)->error = ruby_errinfo;
+    ruby_errinfo = Qnil;
+#endif
+    return JIT_RESULT_COMPILE_ERROR;
+  }
+
+  return JIT_RESULT_OK;
+}
+
+/*
+ * call-seq:
+ *   function = Function.compile_tiered(context, signature, [parent]) { |function| ... }
+ *
+ * Create a new function and compile it quickly (at optimization level
+ * 0).  The function counts its calls (through apply or through
+ * closures), and once the count reaches its tier_up_threshold, the
+ * block is run again and the function is recompiled at
+ * Function.max_optimization_level.  Closures and methods defined with
+ * define_jit_method pick up the new code.
+ *
+ * The block may be run more than once, so it should not have side
+ * effects other than building the function.
+ */
+static VALUE function_s_compile_tiered(int argc, VALUE * argv, VALUE klass)
+{
+  VALUE function_v;
+  jit_function_t function;
+  struct Tier_State * tier;
+
+  if(!rb_block_given_p())
+  {
+    rb_raise(rb_eArgError, "Function.compile_tiered requires a block");
+  }
+
+  function_v = create_function(argc, argv, klass);
+  Get_Function(function_v, function);
+
+  tier = ALLOC(struct Tier_State);
+  tier->calls = 0;
+  tier->threshold = default_tier_up_threshold;
+  tier->tier = 0;
+  tier->failed = 0;
+  tier->error = Qnil;
+
+  if(!jit_function_set_meta(function, RJT_TIER_STATE, tier, xfree, 0))
+  {
+    xfree(tier);
+    rb_raise(rb_eNoMemError, "Out of memory");
+  }
+
+  if(!jit_function_set_meta(function, RJT_BUILDER, (void *)rb_block_proc(), 0, 0))
+  {
+    rb_raise(rb_eNoMemError, "Out of memory");
+  }
+
+  jit_function_set_on_demand_compiler(function, function_tiered_on_demand_compiler);
+
+  /* This must be done before the function is first compiled */
+  jit_function_set_recompilable(function);
+  jit_function_set_optimization_level(function, 0);
+
+  run_tiered_builder(function_v);
+  compile_function(function);
+
+  return function_v;
+}
+
+/*
+ * call-seq:
+ *   tier = function.tier
+ *
+ * Get the current tier of a function created with
+ * Function.compile_tiered (0 for the quickly compiled code, 1 once it
+ * has been recompiled at the maximum optimization level), or nil if
+ * the function is not tiered.
+ */
+static VALUE function_tier(VALUE self)
+{
+  jit_function_t function;
+  struct Tier_State * tier;
+  Get_Function(self, function);
+  tier = get_tier_state(function);
+  return tier ? INT2NUM(tier->tier) : Qnil;
+}
+
+/*
+ * call-seq:
+ *   exception = function.tier_up_error
+ *
+ * Get the exception the block raised when a tiered function was being
+ * recompiled, which leaves the function at tier 0, or nil if there was
+ * none (or the function is not tiered).
+ */
+static VALUE function_tier_up_error(VALUE self)
+{
+  jit_function_t function;
+  struct Tier_State * tier;
+  Get_Function(self, function);
+  tier = get_tier_state(function);
+  return tier ? tier->error : Qnil;
+}
+
+/*
+ * call-seq:
+ *   count = function.call_count
+ *
+ * Get the number of times a tiered function has been called, or nil if
+ * the function is not tiered.
+ */
+static VALUE function_call_count(VALUE self)
+{
+  jit_function_t function;
+  struct Tier_State * tier;
+  Get_Function(self, function);
+  tier = get_tier_state(function);
+  return tier ? ULONG2NUM(tier->calls) : Qnil;
+}
+
+/*
+ * call-seq:
+ *   threshold = function.tier_up_threshold
+ *
+ * Get the number of calls after which a tiered function is recompiled,
+ * or nil if the function is not tiered.
+ */
+static VALUE function_tier_up_threshold(VALUE self)
+{
+  jit_function_t function;
+  struct Tier_State * tier;
+  Get_Function(self, function);
+  tier = get_tier_state(function);
+  return tier ? ULONG2NUM(tier->threshold) : Qnil;
+}
+
+/*
+ * call-seq:
+ *   function.tier_up_threshold = threshold
+ *
+ * Set the number of calls after which a tiered function is recompiled.
+ */
+static VALUE function_set_tier_up_threshold(VALUE self, VALUE threshold)
+{
+  jit_function_t function;
+  struct Tier_State * tier;
+  Get_Function(self, function);
+  tier = get_tier_state(function);
+  if(!tier)
+  {
+    rb_raise(rb_eRuntimeError, "Function is not tiered");
+  }
+  tier->threshold = NUM2ULONG(threshold);
+  return threshold;
+}
+
+/*
+ * call-seq:
+ *   threshold = Function.default_tier_up_threshold
+ *
+ * Get the tier_up_threshold given to newly created tiered functions.
+ */
+static VALUE function_s_default_tier_up_threshold(VALUE klass)
+{
+  return ULONG2NUM(default_tier_up_threshold);
+}
+
+/*
+ * call-seq:
+ *   Function.default_tier_up_threshold = threshold
+ *
+ * Set the tier_up_threshold given to newly created tiered functions.
+ */
+static VALUE function_s_set_default_tier_up_threshold(VALUE klass, VALUE threshold)
+{
+  default_tier_up_threshold = NUM2ULONG(threshold);
+  return threshold;
+}
+
+/*
+ * call-seq:
+ *   stats = function.stats
+ *
+ * Get the statistics for this function, as a hash with the same keys
+ * as JIT::Stats.totals (except +functions+), plus
+ * +optimization_level+, the level the function was last compiled at.
+ */
+static VALUE function_stats(VALUE self)
+{
+  jit_function_t function;
+  Get_Function(self, function);
+  return stats_to_hash(get_function_stats(function), 1);
+}
+
+/*
+ * call-seq:
+ *   name = function.name
+ *
+ * Get the name used for the function in profiles, or nil if the
+ * function has not been named.
+ */
+static VALUE function_name(VALUE self)
+{
+  jit_function_t function;
+  char const * name;
+  Get_Function(self, function);
+  name = function_display_name(function);
+  return name ? rb_str_new2(name) : Qnil;
+}
+
+/*
+ * call-seq:
+ *   function.name = name
+ *
+ * Set the name used for the function in profiles (see
+ * JIT.enable_perf_map).
+ */
+static VALUE function_set_name(VALUE self, VALUE name)
+{
+  jit_function_t function;
+  Get_Function(self, function);
+  set_function_name(function, StringValuePtr(name));
+  return name;
+}
+
+static void record_param(jit_function_t function, int index, jit_value_t value);
+static void record_value(jit_function_t function, jit_type_t type, jit_value_t value);
+static void record_const(jit_function_t function, jit_constant_t const * c, jit_value_t value);
+static void record_return(jit_function_t function, jit_value_t value);
+static void record_unsupported(jit_function_t function);
+static void optimizer_forget(jit_function_t function);
+
+/*
+ * Get the value that corresponds to a specified function parameter.
+ *
+ * call-seq:
+ *   value = function.get_param(index)
+ */
+static VALUE function_get_param(VALUE self, VALUE idx)
+{
+  jit_function_t function;
+  jit_value_t value;
+  Get_Function(self, function);
+  value = jit_value_get_param(function, NUM2INT(idx));
+  raise_memory_error_if_zero(value);
+  record_param(function, NUM2INT(idx), value);
+  return Wrap_Data(rb_cValue, value, value);
+}
+
+/* Wrap the result of an instruction, counting it as a new value.  If
+ * the instruction's value arguments were all handles, the result is
+ * returned as a handle too; otherwise it is a JIT::Value. */
+static VALUE wrap_insn_result(jit_function_t function, jit_value_t value, int flags)
+{
+  if(value)
+  {
+    stats_count_value(function, 0);
+  }
+
+  if(flags == SAW_HANDLE)
+  {
+    raise_memory_error_if_zero(value);
+    return create_value_handle(function, value);
+  }
+
+  return Wrap_Data(rb_cValue, value, value);
+}
+
+/* Describes an instruction for Function#emit_program.  The operands
+ * string has one character per operand: V for a value, L for a label,
+ * N for an integer and T for a type (and, for the pseudo-instructions
+ * defined below, C for a constant and R for an optional value). */
+struct Insn_Info
+{
+  char const * name;
+  int returns_value;
+  char const * operands;
+};
+
+union Program_Operand
+{
+  jit_value_t value;
+  jit_label_t * label;
+  jit_nint nint;
+  jit_type_t type;
+};
+
+static void record_insn(
+    jit_function_t function, int opcode, union Program_Operand const * ops,
+    jit_value_t result);
+static jit_value_t optimize_insn(
+    jit_function_t function, int opcode, union Program_Operand const * ops);
+static void optimizer_note_insn(
+    jit_function_t function, int opcode, union Program_Operand const * ops);
+
+#include "insns.inc"
+
+static VALUE function_value_klass(VALUE self, VALUE type_v, VALUE klass)
+{
+  jit_function_t function;
+  jit_type_t type;
+  jit_value_t value;
+
+  Get_Function(self, function);
+
+  type_v = lookup_const(rb_cType, type_v);
+  check_type("type", rb_cType, type_v);
+  Get_Data(type_v, type, struct _jit_type, type);
+
+  /* TODO: When we wrap a value, we should inject a reference to the
+   * function in the object, so the function stays around as long as the
+   * value does */
+  value = jit_value_create(function, type);
+  stats_count_value(function, 0);
+  record_value(function, type, value);
+  return Wrap_Data(klass, value, value);
+}
+
+static VALUE coerce_to_jit(VALUE function, VALUE type_v, VALUE value_v);
+
+/*
+ * call-seq:
+ *   value = function.value(type)
+ *   value = function.value(type, initial_value)
+ *
+ * Create a value (placeholder/variable) with the given type.
+ */
+static VALUE function_value(int argc, VALUE * argv, VALUE self)
+{
+  VALUE type_v = Qnil;
+  VALUE initial_value_v = Qnil;
+
+  VALUE new_value = Qnil;
+
+  rb_scan_args(argc, argv, "11", &type_v, &initial_value_v);
+
+  new_value = function_value_klass(self, type_v, rb_cValue);
+
+  if(argc > 1)
+  {
+    function_insn_store(
+        self,
+        new_value,
+        coerce_to_jit(self, type_v, initial_value_v));
+  }
+
+  return new_value;
+}
+
+/* Constants are interned while a function is being built, keyed by
+ * type and by the constant's bits (for floating point constants, the
+ * bits of the value as a double), so writing the same literal many
+ * times creates a single constant.  The table is discarded once the
+ * function is compiled. */
+static VALUE constant_table(jit_function_t function, jit_type_t type)
+{
+  VALUE table = (VALUE)jit_function_get_meta(function, RJT_CONSTANTS);
+  VALUE type_key = ULONG2NUM((unsigned long)type);
+  VALUE constants;
+
+  if(!table)
+  {
+    table = rb_hash_new();
+    if(!jit_function_set_meta(function, RJT_CONSTANTS, (void *)table, 0, 0))
+    {
+      rb_raise(rb_eNoMemError, "Out of memory");
+    }
+  }
+
+  constants = rb_hash_aref(table, type_key);
+  if(NIL_P(constants))
+  {
+    constants = rb_hash_new();
+    rb_hash_aset(table, type_key, constants);
+  }
+
+  return constants;
+}
+
+static jit_value_t find_interned_const(jit_function_t function, jit_type_t type, VALUE key)
+{
+  VALUE value = rb_hash_aref(constant_table(function, type), key);
+  struct Stats delta = { 0 };
+
+  if(NIL_P(value))
+  {
+    return 0;
+  }
+
+  delta.saved_constants = 1;
+  add_stats(function, &delta);
+  return (jit_value_t)NUM2ULONG(value);
+}
+
+static void intern_const(jit_function_t function, jit_type_t type, VALUE key, jit_value_t value)
+{
+  raise_memory_error_if_zero(value);
+  rb_hash_aset(
+      constant_table(function, type), key, ULONG2NUM((unsigned long)value));
+}
+
+/* The same key emit_program uses for a floating point constant */
+static VALUE double_key(double d)
+{
+  int64_t bits;
+  memcpy(&bits, &d, sizeof(bits));
+  return LL2NUM(bits);
+}
+
+static jit_value_t create_const(jit_function_t function, jit_type_t type, VALUE constant)
+{
+  jit_constant_t c;
+  jit_value_t value;
+  VALUE key;
+  int kind = jit_type_get_kind(type);
+
+  switch(kind)
+  {
+    case JIT_TYPE_INT:
+    {
+      c.type = type;
+      c.un.int_value = NUM2INT(constant);
+      key = INT2NUM(c.un.int_value);
+      break;
+    }
+
+    case JIT_TYPE_UINT:
+    {
+      c.type = type;
+      c.un.int_value = NUM2UINT(constant);
+      key = UINT2NUM((jit_uint)c.un.int_value);
+      break;
+    }
+
+    case JIT_TYPE_FLOAT32:
+    {
+      c.type = type;
+      c.un.float32_value = NUM2DBL(constant);
+      key = double_key(c.un.float32_value);
+      break;
+    }
+
+    case JIT_TYPE_FLOAT64:
+    {
+      c.type = type;
+      c.un.float64_value = NUM2DBL(constant);
+      key = double_key(c.un.float64_value);
+      break;
+    }
+
+    case JIT_TYPE_PTR:
+    {
+      c.type = type;
+      c.un.ptr_value = (void *)NUM2ULONG(constant);
+      key = ULONG2NUM((unsigned long)c.un.ptr_value);
+      break;
+    }
+
+    case JIT_TYPE_FIRST_TAGGED + RJT_OBJECT:
+    {
+      c.type = type;
+      SET_CONSTANT_VALUE(c, constant);
+      key = ULONG2NUM((unsigned long)constant);
+      break;
+    }
+
+    case JIT_TYPE_FIRST_TAGGED + RJT_ID:
+    {
+      c.type = type;
+      SET_CONSTANT_ID(c, SYM2ID(constant));
+      key = ULONG2NUM((unsigned long)SYM2ID(constant));
+      break;
+    }
+
+    case JIT_TYPE_FIRST_TAGGED + RJT_FUNCTION_PTR:
+    {
+      c.type = type;
+      SET_FUNCTION_POINTER_VALUE(
+          c,
+          (Void_Function_Ptr)NUM2ULONG(rb_to_int(constant)));
+      key = rb_to_int(constant);
+      break;
+    }
+
+    default:
+      rb_raise(rb_eTypeError, "Unsupported type");
+  }
+
+  if((value = find_interned_const(function, type, key)))
+  {
+    record_const(function, &c, value);
+    return value;
+  }
+
+  if(kind == JIT_TYPE_FIRST_TAGGED + RJT_OBJECT)
+  {
+    /* Make sure the object gets marked as long as the function is
+     * around */
+    retain_object(function, constant);
+  }
+
+  stats_count_value(function, 1);
+  value = jit_value_create_constant(function, &c);
+  intern_const(function, type, key, value);
+  record_const(function, &c, value);
+  return value;
+}
+
+/*
+ * call-seq:
+ *   value = function.const(type, constant_value)
+ *
+ * Create a constant value with the given type.
+ */
+static VALUE function_const(VALUE self, VALUE type_v, VALUE constant)
+{
+  jit_function_t function;
+  jit_type_t type;
+  jit_value_t value;
+
+  Get_Function(self, function);
+
+  type_v = lookup_const(rb_cType, type_v);
+  check_type("type", rb_cType, type_v);
+  Get_Data(type_v, type, struct _jit_type, type);
+
+  value = create_const(function, type, constant);
+  return Wrap_Data(rb_cValue, value, value);
+}
+
+/*
+ * call-seq:
+ *   handle = function.param_handle(index)
+ *
+ * Like get_param, but return a value handle rather than a JIT::Value.
+ *
+ * A handle is a small integer that can be passed to the insn_* methods
+ * in place of a JIT::Value (or, for label handles, a JIT::Label).  An
+ * instruction whose value arguments are all handles returns its result
+ * as a handle, so a function can be built without creating a ruby
+ * object for each value.  Handles belong to the function that created
+ * them and become invalid once the function is compiled.  To use
+ * operators on a handle, wrap it in a JIT::Handle, or use
+ * handle_to_value to get a JIT::Value.
+ */
+static VALUE function_param_handle(VALUE self, VALUE idx)
+{
+  jit_function_t function;
+  jit_value_t value;
+  Get_Function(self, function);
+  value = jit_value_get_param(function, NUM2INT(idx));
+  raise_memory_error_if_zero(value);
+  record_param(function, NUM2INT(idx), value);
+  return create_value_handle(function, value);
+}
+
+/*
+ * call-seq:
+ *   handle = function.value_handle(type)
+ *
+ * Like value, but return a value handle rather than a JIT::Value (see
+ * param_handle).
+ */
+static VALUE function_value_handle(VALUE self, VALUE type_v)
+{
+  jit_function_t function;
+  jit_type_t type;
+  jit_value_t value;
+
+  Get_Function(self, function);
+
+  type_v = lookup_const(rb_cType, type_v);
+  check_type("type", rb_cType, type_v);
+  Get_Data(type_v, type, struct _jit_type, type);
+
+  value = jit_value_create(function, type);
+  raise_memory_error_if_zero(value);
+  stats_count_value(function, 0);
+  record_value(function, type, value);
+  return create_value_handle(function, value);
+}
+
+/*
+ * call-seq:
+ *   handle = function.const_handle(type, constant_value)
+ *
+ * Like const, but return a value handle rather than a JIT::Value (see
+ * param_handle).
+ */
+static VALUE function_const_handle(VALUE self, VALUE type_v, VALUE constant)
+{
+  jit_function_t function;
+  jit_type_t type;
+  jit_value_t value;
+
+  Get_Function(self, function);
+
+  type_v = lookup_const(rb_cType, type_v);
+  check_type("type", rb_cType, type_v);
+  Get_Data(type_v, type, struct _jit_type, type);
+
+  value = create_const(function, type, constant);
+  raise_memory_error_if_zero(value);
+  return create_value_handle(function, value);
+}
+
+/*
+ * call-seq:
+ *   handle = function.label_handle
+ *
+ * Create a label and return a handle to it, which can be passed to the
+ * insn_* methods in place of a JIT::Label (see param_handle).
+ */
+static VALUE function_label_handle(VALUE self)
+{
+  jit_function_t function;
+  Get_Function(self, function);
+  return create_label_handle(function);
+}
+
+/*
+ * call-seq:
+ *   value = function.handle_to_value(handle)
+ *
+ * Get a JIT::Value for the given value handle.
+ */
+static VALUE function_handle_to_value(VALUE self, VALUE handle)
+{
+  jit_function_t function;
+  int flags = 0;
+  Get_Function(self, function);
+  if(!FIXNUM_P(handle))
+  {
+    rb_raise(rb_eTypeError, "Expected a value handle");
+  }
+  return Wrap_Data(
+      rb_cValue, value, get_jit_value(function, "handle", handle, &flags));
+}
+
+/*
+ * call-seq:
+ *   handle = function.value_to_handle(value)
+ *
+ * Get a value handle for the given JIT::Value.
+ */
+static VALUE function_value_to_handle(VALUE self, VALUE value_v)
+{
+  jit_function_t function;
+  jit_value_t value;
+  Get_Function(self, function);
+  check_type("value", rb_cValue, value_v);
+  Get_Data(value_v, value, struct _jit_value, value);
+  return create_value_handle(function, value);
+}
+
+/* Pseudo-instructions for emit_program, numbered after the
+ * instructions in insns.inc */
+enum
+{
+  PROGRAM_OP_PARAM = NUM_INSNS,
+  PROGRAM_OP_VALUE,
+  PROGRAM_OP_CONST,
+  PROGRAM_OP_RETURN,
+  PROGRAM_OP_CHECK_BOUNDS,
+  PROGRAM_OP_JUMP_TABLE,
+  NUM_PROGRAM_OPS
+};
+
+static struct Insn_Info const program_op_info[] = {
+  { "param", 1, "N" },
+  { "value", 1, "T" },
+  { "const", 1, "TC" },
+  { "return", 0, "R" },
+  { "check_bounds", 0, "VV" },
+  { "jump_table", 0, "VL" },
+};
+
+/* The types that may be named in a packed program, by index */
+static char const * const program_type_names[] = {
+  "VOID", "SBYTE", "UBYTE", "SHORT", "USHORT", "INT", "UINT", "NINT",
+  "NUINT", "LONG", "ULONG", "FLOAT32", "FLOAT64", "NFLOAT", "VOID_PTR",
+  "OBJECT", "ID", "FUNCTION_PTR"
+};
+
+#define NUM_PROGRAM_TYPES \
+  (int)(sizeof(program_type_names) / sizeof(program_type_names[0]))
+
+static jit_type_t program_types[NUM_PROGRAM_TYPES];
+
+/* Maps opcode names (as symbols) to opcodes */
+static VALUE program_opcodes;
+
+static struct Insn_Info const * program_op(int opcode)
+{
+  if(opcode >= 0 && opcode < NUM_INSNS)
+  {
+    return &insn_info[opcode];
+  }
+  else if(opcode >= NUM_INSNS && opcode < NUM_PROGRAM_OPS)
+  {
+    return &program_op_info[opcode - NUM_INSNS];
+  }
+  else
+  {
+    rb_raise(rb_eArgError, "Invalid opcode %d", opcode);
+  }
+}
+
+/* State for decoding one program.  Values and labels are numbered from
+ * 0 within the program, in the order they are created; value n is
+ * handle value_base + n. */
+struct Program
+{
+  jit_function_t function;
+  long value_base;
+  long label_base;
+  long pos;
+
+  /* For an Array program */
+  VALUE insns;
+  VALUE insn;
+
+  /* For a packed program */
+  int64_t const * words;
+  long num_words;
+};
+
+static jit_value_t program_value(struct Program * program, int64_t index)
+{
+  struct Handle_Table * table = get_handle_table(program->function);
+  if(index < 0 || index >= table->num_values - program->value_base)
+  {
+    rb_raise(rb_eIndexError, "Invalid value %ld in program", (long)index);
+  }
+  return table->values[program->value_base + index];
+}
+
+/* Get a label, creating it (and any labels numbered before it) on
+ * first use, so a program can branch forward to a label */
+static jit_label_t * program_label(struct Program * program, int64_t index)
+{
+  struct Handle_Table * table = get_handle_table(program->function);
+  if(index < 0 || index > 0xffff)
+  {
+    rb_raise(rb_eIndexError, "Invalid label %ld in program", (long)index);
+  }
+  while(table->num_labels - program->label_base <= index)
+  {
+    create_label_handle(program->function);
+  }
+  return &table->labels[program->label_base + index];
+}
+
+static jit_type_t program_type(int64_t code)
+{
+  if(code < 0 || code >= NUM_PROGRAM_TYPES)
+  {
+    rb_raise(rb_eArgError, "Invalid type %ld in program", (long)code);
+  }
+  return program_types[code];
+}
+
+/* Create a constant from a packed program, where the value is stored
+ * as an integer or, for floating point types, as the bits of a
+ * double */
+static jit_value_t create_packed_const_value(
+    jit_function_t function, jit_type_t type, int64_t word)
+{
+  double d;
+
+  switch(jit_type_get_kind(type))
+  {
+    case JIT_TYPE_FLOAT32:
+      memcpy(&d, &word, sizeof(d));
+      return jit_value_create_float32_constant(function, type, (jit_float32)d);
+
+    case JIT_TYPE_FLOAT64:
+      memcpy(&d, &word, sizeof(d));
+      return jit_value_create_float64_constant(function, type, d);
+
+    case JIT_TYPE_NFLOAT:
+      memcpy(&d, &word, sizeof(d));
+      return jit_value_create_nfloat_constant(function, type, d);
+
+    case JIT_TYPE_LONG:
+    case JIT_TYPE_ULONG:
+      return jit_value_create_long_constant(function, type, word);
+
+    case JIT_TYPE_SBYTE:
+    case JIT_TYPE_UBYTE:
+    case JIT_TYPE_SHORT:
+    case JIT_TYPE_USHORT:
+    case JIT_TYPE_INT:
+    case JIT_TYPE_UINT:
+    case JIT_TYPE_NINT:
+    case JIT_TYPE_NUINT:
+    case JIT_TYPE_PTR:
+      return jit_value_create_nint_constant(function, type, (jit_nint)word);
+
+    default:
+      rb_raise(rb_eTypeError, "Unsupported constant type in packed program");
+  }
+}
+
+static jit_value_t create_packed_const(
+    jit_function_t function, jit_type_t type, int64_t word)
+{
+  jit_value_t value;
+  VALUE key = LL2NUM(word);
+
+  if((value = find_interned_const(function, type, key)))
+  {
+    return value;
+  }
+
+  value = create_packed_const_value(function, type, word);
+  stats_count_value(function, 1);
+  intern_const(function, type, key, value);
+  return value;
+}
+
+/* Emit code to throw libjit's builtin out-of-bounds exception unless
+ * 0 <= index < length.  Comparing as unsigned catches negative indexes
+ * too. */
+static void emit_check_bounds(
+    jit_function_t function, jit_value_t index, jit_value_t length)
+{
+  jit_label_t ok_label = jit_label_undefined;
+  jit_value_t in_bounds;
+  jit_value_t args[1];
+
+  in_bounds = jit_insn_lt(
+      function,
+      jit_insn_convert(function, index, jit_type_nuint, 0),
+      jit_insn_convert(function, length, jit_type_nuint, 0));
+  jit_insn_branch_if(function, in_bounds, &ok_label);
+
+  args[0] = jit_value_create_nint_constant(
+      function, jit_type_int, JIT_RESULT_OUT_OF_BOUNDS);
+  jit_insn_call_native(
+      function, "jit_exception_builtin", (void *)jit_exception_builtin,
+      exception_builtin_signature, args, 1, JIT_CALL_NORETURN);
+
+  jit_insn_label(function, &ok_label);
+}
+
+/* Emit a jump table.  libjit numbers any undefined labels in the array
+ * it is given, so the labels are copied in and the numbers copied
+ * back out. */
+static void emit_jump_table(
+    jit_function_t function,
+    jit_value_t value,
+    jit_label_t * * labels,
+    long num_labels)
+{
+  jit_label_t * table = ALLOCA_N(jit_label_t, num_labels);
+  long j;
+
+  for(j = 0; j < num_labels; ++j)
+  {
+    table[j] = *labels[j];
+  }
+
+  value = jit_insn_convert(function, value, jit_type_nint, 0);
+  if(!value || !jit_insn_jump_table(function, value, table, num_labels))
+  {
+    rb_raise(rb_eNoMemError, "Out of memory");
+  }
+
+  for(j = 0; j < num_labels; ++j)
+  {
+    *labels[j] = table[j];
+  }
+}
+
+static int program_done(struct Program * program)
+{
+  if(program->words)
+  {
+    return program->pos >= program->num_words;
+  }
+  else
+  {
+    return program->pos >= RARRAY_LEN(program->insns);
+  }
+}
+
+/* Start decoding the next instruction, returning its opcode */
+static int program_next_insn(struct Program * program)
+{
+  VALUE opcode_v;
+
+  if(program->words)
+  {
+    return (int)program->words[program->pos++];
+  }
+
+  program->insn = RARRAY_PTR(program->insns)[program->pos++];
+  Check_Type(program->insn, T_ARRAY);
+  if(RARRAY_LEN(program->insn) == 0)
+  {
+    rb_raise(rb_eArgError, "Empty instruction in program");
+  }
+
+  opcode_v = RARRAY_PTR(program->insn)[0];
+  if(SYMBOL_P(opcode_v))
+  {
+    VALUE opcode = rb_hash_aref(program_opcodes, opcode_v);
+    if(NIL_P(opcode))
+    {
+      rb_raise(rb_eArgError, "Unknown opcode %s", rb_id2name(SYM2ID(opcode_v)));
+    }
+    return FIX2INT(opcode);
+  }
+  return NUM2INT(opcode_v);
+}
+
+/* Get the nth operand of the current instruction from an Array
+ * program */
+static VALUE program_operand(struct Program * program, int n)
+{
+  if(n + 1 >= RARRAY_LEN(program->insn))
+  {
+    rb_raise(rb_eArgError, "Missing operand in program");
+  }
+  return RARRAY_PTR(program->insn)[n + 1];
+}
+
+/* Get the next operand of the current instruction from a packed
+ * program */
+static int64_t program_word(struct Program * program)
+{
+  if(program->pos >= program->num_words)
+  {
+    rb_raise(rb_eArgError, "Missing operand in program");
+  }
+  return program->words[program->pos++];
+}
+
+static void emit_program_insn(struct Program * program, int opcode)
+{
+  struct Insn_Info const * info = program_op(opcode);
+  jit_function_t function = program->function;
+  union Program_Operand ops[4];
+  jit_value_t result;
+  int num_operands = strlen(info->operands);
+  int n;
+
+  if(!program->words
+      && RARRAY_LEN(program->insn) - 1 != num_operands
+      && info->operands[0] != 'R')
+  {
+    rb_raise(
+        rb_eArgError,
+        "Wrong number of operands for %s (%ld for %d)",
+        info->name,
+        RARRAY_LEN(program->insn) - 1,
+        num_operands);
+  }
+
+  switch(opcode)
+  {
+    case PROGRAM_OP_CONST:
+    {
+      jit_type_t type;
+      if(program->words)
+      {
+        type = program_type(program_word(program));
+        result = create_packed_const(function, type, program_word(program));
+      }
+      else
+      {
+        VALUE type_v = lookup_const(rb_cType, program_operand(program, 0));
+        check_type("type", rb_cType, type_v);
+        Get_Data(type_v, type, struct _jit_type, type);
+        result = create_const(function, type, program_operand(program, 1));
+      }
+      raise_memory_error_if_zero(result);
+      create_value_handle(function, result);
+      return;
+    }
+
+    case PROGRAM_OP_RETURN:
+    {
+      jit_value_t value = 0;
+      if(program->words)
+      {
+        int64_t index = program_word(program);
+        if(index >= 0)
+        {
+          value = program_value(program, index);
+        }
+      }
+      else if(RARRAY_LEN(program->insn) > 1)
+      {
+        value = program_value(program, NUM2LONG(program_operand(program, 0)));
+      }
+      jit_insn_return(function, value);
+      return;
+    }
+
+    case PROGRAM_OP_JUMP_TABLE:
+    {
+      jit_value_t value;
+      jit_label_t * * labels;
+      long * indexes;
+      long num_labels;
+      VALUE labels_v = Qnil;
+      long j;
+
+      if(program->words)
+      {
+        value = program_value(program, program_word(program));
+        num_labels = (long)program_word(program);
+        if(num_labels < 0 || num_labels > program->num_words - program->pos)
+        {
+          rb_raise(rb_eArgError, "Invalid jump table in program");
+        }
+      }
+      else
+      {
+        value = program_value(program, NUM2LONG(program_operand(program, 0)));
+        labels_v = program_operand(program, 1);
+        Check_Type(labels_v, T_ARRAY);
+        num_labels = RARRAY_LEN(labels_v);
+      }
+
+      /* Create all the labels before taking their addresses, since
+       * creating a label may move the others */
+      indexes = ALLOCA_N(long, num_labels);
+      for(j = 0; j < num_labels; ++j)
+      {
+        indexes[j] = program->words
+          ? (long)program_word(program)
+          : NUM2LONG(RARRAY_PTR(labels_v)[j]);
+        program_label(program, indexes[j]);
+      }
+
+      labels = ALLOCA_N(jit_label_t *, num_labels);
+      for(j = 0; j < num_labels; ++j)
+      {
+        labels[j] = program_label(program, indexes[j]);
+      }
+
+      emit_jump_table(function, value, labels, num_labels);
+      return;
+    }
+  }
+
+  for(n = 0; n < num_operands; ++n)
+  {
+    VALUE operand_v = Qnil;
+    int64_t word = 0;
+
+    if(program->words)
+    {
+      word = program_word(program);
+    }
+    else
+    {
+      operand_v = program_operand(program, n);
+    }
+
+    switch(info->operands[n])
+    {
+      case 'V':
+        ops[n].value = program_value(
+            program, program->words ? word : NUM2LONG(operand_v));
+        break;
+
+      case 'L':
+        /* Creating a label may move the others, so just make sure it
+         * exists for now and get its address below */
+        ops[n].nint = program->words ? (jit_nint)word : NUM2LONG(operand_v);
+        program_label(program, ops[n].nint);
+        break;
+
+      case 'N':
+        ops[n].nint = program->words ? (jit_nint)word : NUM2LONG(operand_v);
+        break;
+
+      case 'T':
+        if(program->words)
+        {
+          ops[n].type = program_type(word);
+        }
+        else
+        {
+          VALUE type_v = lookup_const(rb_cType, operand_v);
+          check_type("type", rb_cType, type_v);
+          Get_Data(type_v, type, struct _jit_type, ops[n].type);
+        }
+        break;
+    }
+  }
+
+  for(n = 0; n < num_operands; ++n)
+  {
+    if(info->operands[n] == 'L')
+    {
+      ops[n].label = program_label(program, ops[n].nint);
+    }
+  }
+
+  switch(opcode)
+  {
+    case PROGRAM_OP_PARAM:
+      result = jit_value_get_param(function, ops[0].nint);
+      break;
+
+    case PROGRAM_OP_VALUE:
+      result = jit_value_create(function, ops[0].type);
+      stats_count_value(function, 0);
+      break;
+
+    case PROGRAM_OP_CHECK_BOUNDS:
+      emit_check_bounds(function, ops[0].value, ops[1].value);
+      result = 0;
+      break;
+
+    default:
+      optimizer_note_insn(function, opcode, ops);
+      result = emit_insn(function, opcode, ops);
+      if(result)
+      {
+        stats_count_value(function, 0);
+      }
+      break;
+  }
+
+  if(info->returns_value)
+  {
+    raise_memory_error_if_zero(result);
+    create_value_handle(function, result);
+  }
+}
+
+/*
+ * call-seq:
+ *   base_handle = function.emit_program(program)
+ *
+ * Emit a whole sequence of instructions in a single call.
+ *
+ * The program is either an Array of instructions, each of which is an
+ * Array of an opcode followed by its operands, e.g.:
+ *
+ *   function.emit_program([
+ *     [ :param, 0 ],              # value 0
+ *     [ :const, :INT, 1 ],        # value 1
+ *     [ :add, 0, 1 ],             # value 2
+ *     [ :branch_if, 2, 0 ],       # branch to label 0
+ *     [ :return, 1 ],
+ *     [ :label, 0 ],
+ *     [ :return, 2 ],
+ *   ])
+ *
+ * or a packed String of native-endian 64-bit integers (see
+ * Array#pack's "q" directive), with each instruction written as its
+ * opcode followed by its operands.
+ *
+ * An opcode is the name of an insn_* method without the prefix, or its
+ * index in Function::OPCODES (which must be used in a packed program).
+ * In addition to the instructions, these opcodes are supported:
+ *
+ * <tt>[:param, n]</tt>::        The function's nth parameter.
+ * <tt>[:value, type]</tt>::     A new variable.
+ * <tt>[:const, type, c]</tt>::  A constant.
+ * <tt>[:return, v]</tt>::       Return v (or nothing if v is omitted,
+ *                               or, in a packed program, is -1).
+ * <tt>[:check_bounds, i, n]</tt>:: See insn_check_bounds.
+ *
+ * Each instruction that produces a value (including the above, except
+ * :return and :check_bounds) defines the program's next value; operands that are values
+ * refer to them by number, starting at 0.  Operands that are labels
+ * are numbered separately, starting at 0, and are created on first
+ * use.  In a packed program, a type is an index into
+ * Function::PROGRAM_TYPES, and a floating point constant is given as
+ * the bits of a double.
+ *
+ * Returns the handle (see param_handle) of the program's first value;
+ * value n of the program is handle base_handle + n.
+ */
+static VALUE function_emit_program(VALUE self, VALUE program_v)
+{
+  struct Program program;
+  struct Handle_Table * table;
+
+  MEMZERO(&program, struct Program, 1);
+  Get_Function(self, program.function);
+  record_unsupported(program.function);
+
+  table = get_handle_table(program.function);
+  program.value_base = table->num_values;
+  program.label_base = table->num_labels;
+
+  if(TYPE(program_v) == T_STRING)
+  {
+    if(RSTRING_LEN(program_v) % sizeof(int64_t) != 0)
+    {
+      rb_raise(rb_eArgError, "Packed program length must be a multiple of 8");
+    }
+    program.words = (int64_t const *)RSTRING_PTR(program_v);
+    program.num_words = RSTRING_LEN(program_v) / sizeof(int64_t);
+  }
+  else
+  {
+    Check_Type(program_v, T_ARRAY);
+    program.insns = program_v;
+  }
+
+  while(!program_done(&program))
+  {
+    emit_program_insn(&program, program_next_insn(&program));
+  }
+  optimizer_forget(program.function);
+
+  return LONG2FIX(program.value_base);
+}
+
+/* Recipes: a function's build recorded as a program, so it can be
+ * cached and later replayed without running the builder block.  A
+ * recipe is RECIPE_MAGIC followed by a packed program (see
+ * emit_program). */
+
+#define RECIPE_MAGIC "RJITRCP1"
+#define RECIPE_MAGIC_SIZE 8
+
+/* Identify the builds of the extension and of libjit, so that cached
+ * recipes are not replayed by a different build than recorded them */
+static VALUE recipe_version(void)
+{
+  char buf[512];
+
+  snprintf(buf, sizeof(buf), "%s/%d/%d/%s %s",
+      RECIPE_MAGIC, NUM_PROGRAM_OPS, (int)sizeof(void *), __DATE__, __TIME__);
+
+#ifdef HAVE_DLADDR
+  {
+    Dl_info info;
+    struct stat st;
+
+    if(dladdr((void *)jit_function_create, &info)
+        && info.dli_fname
+        && stat(info.dli_fname, &st) == 0)
+    {
+      size_t len = strlen(buf);
+      snprintf(buf + len, sizeof(buf) - len, "/%s/%ld/%ld",
+          info.dli_fname, (long)st.st_size, (long)st.st_mtime);
+    }
+  }
+#endif
+
+  return rb_str_new2(buf);
+}
+
+struct Recorder
+{
+  VALUE words;
+  VALUE values;  /* jit_value_t -> program value number */
+  VALUE labels;  /* libjit label -> program label number */
+  long num_values;
+  long num_labels;
+  int failed;
+};
+
+static void mark_recorder(struct Recorder * recorder)
+{
+  rb_gc_mark(recorder->words);
+  rb_gc_mark(recorder->values);
+  rb_gc_mark(recorder->labels);
+}
+
+static struct Recorder * get_recorder(jit_function_t function)
+{
+  struct Recorder * recorder = (struct Recorder *)jit_function_get_meta(
+      function, RJT_RECORDER);
+  return (recorder && !recorder->failed) ? recorder : 0;
+}
+
+static void record_word(struct Recorder * recorder, int64_t word)
+{
+  rb_str_buf_cat(recorder->words, (char const *)&word, sizeof(word));
+}
+
+static void record_new_value(struct Recorder * recorder, jit_value_t value)
+{
+  rb_hash_aset(
+      recorder->values,
+      ULONG2NUM((unsigned long)value),
+      LONG2NUM(recorder->num_values++));
+}
+
+static void record_value_operand(struct Recorder * recorder, jit_value_t value)
+{
+  VALUE n = rb_hash_aref(recorder->values, ULONG2NUM((unsigned long)value));
+  if(NIL_P(n))
+  {
+    /* Created some way we don't record */
+    recorder->failed = 1;
+    return;
+  }
+  record_word(recorder, NUM2LONG(n));
+}
+
+static void record_label_operand(struct Recorder * recorder, jit_label_t * label)
+{
+  /* The instruction has been emitted, so libjit has numbered the label */
+  VALUE key = ULONG2NUM((unsigned long)*label);
+  VALUE n = rb_hash_aref(recorder->labels, key);
+  if(NIL_P(n))
+  {
+    n = LONG2NUM(recorder->num_labels++);
+    rb_hash_aset(recorder->labels, key, n);
+  }
+  record_word(recorder, NUM2LONG(n));
+}
+
+static void record_type_operand(struct Recorder * recorder, jit_type_t type)
+{
+  int j;
+  for(j = 0; j < NUM_PROGRAM_TYPES; ++j)
+  {
+    if(program_types[j] == type)
+    {
+      record_word(recorder, j);
+      return;
+    }
+  }
+  recorder->failed = 1;
+}
+
+static void record_param(jit_function_t function, int index, jit_value_t value)
+{
+  struct Recorder * recorder = get_recorder(function);
+  if(!recorder
+      || !NIL_P(rb_hash_aref(recorder->values, ULONG2NUM((unsigned long)value))))
+  {
+    return;
+  }
+  record_word(recorder, PROGRAM_OP_PARAM);
+  record_word(recorder, index);
+  record_new_value(recorder, value);
+}
+
+static void record_value(jit_function_t function, jit_type_t type, jit_value_t value)
+{
+  struct Recorder * recorder = get_recorder(function);
+  if(!recorder)
+  {
+    return;
+  }
+  record_word(recorder, PROGRAM_OP_VALUE);
+  record_type_operand(recorder, type);
+  record_new_value(recorder, value);
+}
+
+static void record_const(jit_function_t function, jit_constant_t const * c, jit_value_t value)
+{
+  struct Recorder * recorder = get_recorder(function);
+  int64_t word;
+  double d;
+
+  if(!recorder
+      || !NIL_P(rb_hash_aref(recorder->values, ULONG2NUM((unsigned long)value))))
+  {
+    return;
+  }
+
+  /* Pointers and ruby objects are only meaningful in this process */
+  switch(jit_type_get_kind(c->type))
+  {
+    case JIT_TYPE_INT:
+      word = c->un.int_value;
+      break;
+
+    case JIT_TYPE_UINT:
+      word = c->un.uint_value;
+      break;
+
+    case JIT_TYPE_FLOAT32:
+      d = c->un.float32_value;
+      memcpy(&word, &d, sizeof(word));
+      break;
+
+    case JIT_TYPE_FLOAT64:
+      d = c->un.float64_value;
+      memcpy(&word, &d, sizeof(word));
+      break;
+
+    default:
+      recorder->failed = 1;
+      return;
+  }
+
+  record_word(recorder, PROGRAM_OP_CONST);
+  record_type_operand(recorder, c->type);
+  record_word(recorder, word);
+  record_new_value(recorder, value);
+}
+
+static void record_insn(
+    jit_function_t function, int opcode, union Program_Operand const * ops,
+    jit_value_t result)
+{
+  struct Recorder * recorder = get_recorder(function);
+  struct Insn_Info const * info = program_op(opcode);
+  int n;
+
+  if(!recorder)
+  {
+    return;
+  }
+
+  record_word(recorder, opcode);
+  for(n = 0; info->operands[n]; ++n)
+  {
+    switch(info->operands[n])
+    {
+      case 'V': record_value_operand(recorder, ops[n].value); break;
+      case 'L': record_label_operand(recorder, ops[n].label); break;
+      case 'N': record_word(recorder, ops[n].nint); break;
+      case 'T': record_type_operand(recorder, ops[n].type); break;
+    }
+  }
+
+  if(info->returns_value)
+  {
+    record_new_value(recorder, result);
+  }
+}
+
+static void record_return(jit_function_t function, jit_value_t value)
+{
+  struct Recorder * recorder = get_recorder(function);
+  if(!recorder)
+  {
+    return;
+  }
+  record_word(recorder, PROGRAM_OP_RETURN);
+  if(value)
+  {
+    record_value_operand(recorder, value);
+  }
+  else
+  {
+    record_word(recorder, -1);
+  }
+}
+
+static void record_jump_table(
+    jit_function_t function,
+    jit_value_t value,
+    jit_label_t * * labels,
+    long num_labels)
+{
+  struct Recorder * recorder = get_recorder(function);
+  long j;
+
+  if(!recorder)
+  {
+    return;
+  }
+
+  record_word(recorder, PROGRAM_OP_JUMP_TABLE);
+  record_value_operand(recorder, value);
+  record_word(recorder, num_labels);
+  for(j = 0; j < num_labels; ++j)
+  {
+    record_label_operand(recorder, labels[j]);
+  }
+}
+
+static void record_unsupported(jit_function_t function)
+{
+  struct Recorder * recorder = get_recorder(function);
+  if(recorder)
+  {
+    recorder->failed = 1;
+  }
+}
+
+static void free_recorder(void * recorder)
+{
+  xfree(recorder);
+}
+
+/* Remember a function's recipe, so it can be migrated to another
+ * context */
+static void set_recipe(jit_function_t function, VALUE recipe)
+{
+  if(!jit_function_set_meta(function, RJT_RECIPE, (void *)recipe, 0, 0))
+  {
+    rb_raise(rb_eNoMemError, "Out of memory");
+  }
+}
+
+/* Called before compiling a function in a context that keeps recipes
+ * (see Context#keep_recipes=) */
+static void keep_recipe(jit_function_t function)
+{
+  struct Recorder * recorder = (struct Recorder *)jit_function_get_meta(
+      function, RJT_RECORDER);
+  VALUE context_v = (VALUE)jit_function_get_meta(function, RJT_CONTEXT);
+  jit_context_t context;
+
+  Get_Data(context_v, context, struct _jit_context, context);
+  if(!recorder || !jit_context_get_meta(context, RJT_KEEP_RECIPES))
+  {
+    return;
+  }
+
+  if(!recorder->failed)
+  {
+    set_recipe(function, recorder->words);
+  }
+  jit_function_free_meta(function, RJT_RECORDER);
+}
+
+/*
+ * call-seq:
+ *   function.start_recording
+ *
+ * Start recording the instructions emitted into this function as a
+ * recipe (see finish_recording).  Call this before emitting any
+ * instructions.
+ */
+static VALUE function_start_recording(VALUE self)
+{
+  jit_function_t function;
+  struct Recorder * recorder;
+
+  Get_Function(self, function);
+
+  recorder = ALLOC(struct Recorder);
+  recorder->words = rb_str_new(RECIPE_MAGIC, RECIPE_MAGIC_SIZE);
+  recorder->values = rb_hash_new();
+  recorder->labels = rb_hash_new();
+  recorder->num_values = 0;
+  recorder->num_labels = 0;
+  recorder->failed = 0;
+
+  if(!jit_function_set_meta(function, RJT_RECORDER, recorder, free_recorder, 0))
+  {
+    xfree(recorder);
+    rb_raise(rb_eNoMemError, "Out of memory");
+  }
+
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   recipe = function.finish_recording
+ *
+ * Stop recording and return the recipe, a String that can be saved
+ * and later passed to replay_recipe or replay_recipe_file to rebuild
+ * the function without running the code that built it.  Returns nil
+ * if the function used something that cannot be recorded: calls to
+ * other functions, emit_program, or constants that are pointers or
+ * ruby objects, or types other than those in Function::PROGRAM_TYPES.
+ */
+static VALUE function_finish_recording(VALUE self)
+{
+  jit_function_t function;
+  struct Recorder * recorder;
+  VALUE recipe = Qnil;
+
+  Get_Function(self, function);
+  recorder = (struct Recorder *)jit_function_get_meta(function, RJT_RECORDER);
+
+  if(recorder)
+  {
+    if(!recorder->failed)
+    {
+      recipe = recorder->words;
+      set_recipe(function, recipe);
+    }
+    jit_function_free_meta(function, RJT_RECORDER);
+  }
+
+  return recipe;
+}
+
+struct Recipe
+{
+  jit_function_t function;
+  char const * data;
+  long size;
+};
+
+/* If a recipe was replayed into a function that had only just started
+ * recording, the function's recipe is the replayed one, and recording
+ * can carry on from there; otherwise the recording cannot be
+ * completed */
+static void record_replay(struct Program * program, struct Recipe * recipe)
+{
+  struct Recorder * recorder = get_recorder(program->function);
+  struct Handle_Table * table;
+  long j;
+
+  if(!recorder)
+  {
+    return;
+  }
+
+  if(RSTRING_LEN(recorder->words) != RECIPE_MAGIC_SIZE
+      || recorder->num_values != 0
+      || recorder->num_labels != 0)
+  {
+    recorder->failed = 1;
+    return;
+  }
+
+  rb_str_buf_cat(
+      recorder->words,
+      recipe->data + RECIPE_MAGIC_SIZE,
+      recipe->size - RECIPE_MAGIC_SIZE);
+
+  table = get_handle_table(program->function);
+  for(j = program->value_base; j < table->num_values; ++j)
+  {
+    record_new_value(recorder, table->values[j]);
+  }
+  for(j = program->label_base; j < table->num_labels; ++j)
+  {
+    rb_hash_aset(
+        recorder->labels,
+        ULONG2NUM((unsigned long)table->labels[j]),
+        LONG2NUM(recorder->num_labels++));
+  }
+}
+
+static VALUE replay_recipe(VALUE recipe_ptr)
+{
+  struct Recipe * recipe = (struct Recipe *)recipe_ptr;
+  struct Program program;
+  struct Handle_Table * table;
+
+  if(recipe->size < RECIPE_MAGIC_SIZE
+      || memcmp(recipe->data, RECIPE_MAGIC, RECIPE_MAGIC_SIZE) != 0
+      || (recipe->size - RECIPE_MAGIC_SIZE) % sizeof(int64_t) != 0)
+  {
+    rb_raise(rb_eArgError, "Invalid recipe");
+  }
+
+  MEMZERO(&program, struct Program, 1);
+  program.function = recipe->function;
+  table = get_handle_table(program.function);
+  program.value_base = table->num_values;
+  program.label_base = table->num_labels;
+  program.words = (int64_t const *)(recipe->data + RECIPE_MAGIC_SIZE);
+  program.num_words = (recipe->size - RECIPE_MAGIC_SIZE) / sizeof(int64_t);
+
+  while(!program_done(&program))
+  {
+    emit_program_insn(&program, program_next_insn(&program));
+  }
+  optimizer_forget(program.function);
+
+  record_replay(&program, recipe);
+
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   function.replay_recipe(recipe)
+ *
+ * Emit the instructions recorded in a recipe (see finish_recording).
+ */
+static VALUE function_replay_recipe(VALUE self, VALUE recipe_v)
+{
+  struct Recipe recipe;
+  StringValue(recipe_v);
+  Get_Function(self, recipe.function);
+  recipe.data = RSTRING_PTR(recipe_v);
+  recipe.size = RSTRING_LEN(recipe_v);
+  replay_recipe((VALUE)&recipe);
+  return self;
+}
+
+#ifdef HAVE_MMAP
+static VALUE unmap_recipe(VALUE recipe_ptr)
+{
+  struct Recipe * recipe = (struct Recipe *)recipe_ptr;
+  munmap((void *)recipe->data, recipe->size);
+  return Qnil;
+}
+#endif
+
+/*
+ * call-seq:
+ *   function.replay_recipe_file(filename)
+ *
+ * Emit the instructions recorded in a recipe that was saved to a file.
+ * The file is mapped into memory rather than read, where possible.
+ */
+static VALUE function_replay_recipe_file(VALUE self, VALUE filename)
+{
+#ifdef HAVE_MMAP
+  struct Recipe recipe;
+  struct stat st;
+  void * data;
+  int fd;
+
+  Get_Function(self, recipe.function);
+
+  fd = open(StringValuePtr(filename), O_RDONLY);
+  if(fd < 0)
+  {
+    rb_sys_fail(StringValuePtr(filename));
+  }
+
+  if(fstat(fd, &st) != 0)
+  {
+    close(fd);
+    rb_sys_fail(StringValuePtr(filename));
+  }
+
+  if(st.st_size == 0)
+  {
+    close(fd);
+    rb_raise(rb_eArgError, "Invalid recipe");
+  }
+
+  data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED)
+  {
+    rb_sys_fail(StringValuePtr(filename));
+  }
+
+  recipe.data = (char const *)data;
+  recipe.size = st.st_size;
+
+#ifdef HAVE_RB_ENSURE
+  rb_ensure(replay_recipe, (VALUE)&recipe, unmap_recipe, (VALUE)&recipe);
+#else
+  /* Rubinius does not yet have rb_ensure */
+  replay_recipe((VALUE)&recipe);
+  unmap_recipe((VALUE)&recipe);
+#endif
+
+  return self;
+#else
+  VALUE recipe = rb_funcall(
+      rb_cFile, rb_intern("open"), 2, filename, rb_str_new2("rb"));
+  VALUE data = rb_funcall(recipe, rb_intern("read"), 0);
+  rb_funcall(recipe, rb_intern("close"), 0);
+  return function_replay_recipe(self, data);
+#endif
+}
+
+/* ---------------------------------------------------------------------------
+ * Optimizer
+ * ---------------------------------------------------------------------------
+ */
+
+/* When optimizations are turned on for a function (see
+ * Function#optimizations=), the instructions emitted through the
+ * insn_* methods (and so through the JIT::Value operators) go through
+ * optimize_insn, which may fold them, reuse an earlier result, rewrite
+ * them, or hoist them out of a loop, instead of emitting them as they
+ * are.  What is emitted is what is recorded, so recipes still work.
+ *
+ * A value is "stable" if it is a constant, a parameter, or the result
+ * of an instruction, and has not been assigned to; only instructions
+ * on stable values are reused or hoisted.  Each stable value has the
+ * sequence number of the instruction that defined it (0 for constants
+ * and parameters), so a value defined before a loop started is known
+ * to be invariant in it. */
+
+enum
+{
+  OPT_FOLD = 1,
+  OPT_CSE = 2,
+  OPT_STRENGTH = 4,
+  OPT_LICM = 8,
+  OPT_ALL = 15
+};
+
+static struct
+{
+  char const * name;
+  int flag;
+} const optimization_names[] = {
+  { "fold", OPT_FOLD },
+  { "cse", OPT_CSE },
+  { "strength", OPT_STRENGTH },
+  { "licm", OPT_LICM },
+};
+
+#define NUM_OPTIMIZATIONS \
+  (int)(sizeof(optimization_names) / sizeof(optimization_names[0]))
+
+/* An instruction hoisted into a loop's preheader.  Its result is a
+ * variable, which the preheader assigns. */
+struct Hoist
+{
+  int opcode;
+  union Program_Operand ops[2];
+  jit_value_t result;
+  int loop;
+};
+
+struct Loop_Info
+{
+  long seq;
+  jit_label_t entry_label;
+  jit_label_t preheader_label;
+  VALUE hoisted;  /* expression key -> result */
+};
+
+struct Optimizer
+{
+  int passes;
+  jit_block_t block;
+  VALUE exprs;    /* expression key -> result, in the current block */
+  VALUE loads;    /* the same for loads, until memory is written */
+  VALUE seqs;     /* value -> sequence number, or -1 once assigned */
+  long seq;
+  struct Loop_Info * loops;
+  int num_loops;
+  int loops_capacity;
+  struct Hoist * hoists;
+  long num_hoists;
+  long hoists_capacity;
+};
+
+static void mark_optimizer(struct Optimizer * opt)
+{
+  int j;
+  rb_gc_mark(opt->exprs);
+  rb_gc_mark(opt->loads);
+  rb_gc_mark(opt->seqs);
+  for(j = 0; j < opt->num_loops; ++j)
+  {
+    rb_gc_mark(opt->loops[j].hoisted);
+  }
+}
+
+static void free_optimizer(void * opt_ptr)
+{
+  struct Optimizer * opt = (struct Optimizer *)opt_ptr;
+  xfree(opt->loops);
+  xfree(opt->hoists);
+  xfree(opt);
+}
+
+static struct Optimizer * get_optimizer(jit_function_t function)
+{
+  return (struct Optimizer *)jit_function_get_meta(function, RJT_OPTIMIZER);
+}
+
+static jit_value_t emit_recorded(
+    jit_function_t function, int opcode, union Program_Operand const * ops)
+{
+  jit_value_t result = emit_insn(function, opcode, ops);
+  if(insn_info[opcode].returns_value)
+  {
+    raise_memory_error_if_zero(result);
+  }
+  record_insn(function, opcode, ops, result);
+  return result;
+}
+
+static void emit_recorded_branch(jit_function_t function, int opcode, jit_label_t * label)
+{
+  union Program_Operand ops[1];
+  ops[0].label = label;
+  emit_recorded(function, opcode, ops);
+}
+
+static void emit_recorded_store(jit_function_t function, jit_value_t dest, jit_value_t value)
+{
+  union Program_Operand ops[2];
+  ops[0].value = dest;
+  ops[1].value = value;
+  emit_recorded(function, INSN_STORE, ops);
+}
+
+static VALUE value_key(jit_value_t value)
+{
+  return ULONG2NUM((unsigned long)value);
+}
+
+/* Forget the expressions computed so far; they may no longer hold */
+static void optimizer_forget_exprs(struct Optimizer * opt)
+{
+  int j;
+  opt->exprs = rb_hash_new();
+  opt->loads = rb_hash_new();
+  for(j = 0; j < opt->num_loops; ++j)
+  {
+    opt->loops[j].hoisted = rb_hash_new();
+  }
+}
+
+/* Expressions are only reused within a block */
+static void optimizer_sync_block(jit_function_t function, struct Optimizer * opt)
+{
+  jit_block_t block = jit_function_get_current(function);
+  if(block != opt->block)
+  {
+    opt->block = block;
+    opt->exprs = rb_hash_new();
+    opt->loads = rb_hash_new();
+  }
+}
+
+static long value_seq(struct Optimizer * opt, jit_value_t value)
+{
+  VALUE seq = rb_hash_aref(opt->seqs, value_key(value));
+  if(!NIL_P(seq))
+  {
+    return NUM2LONG(seq);
+  }
+  if(jit_value_is_constant(value) || jit_value_is_parameter(value))
+  {
+    return 0;
+  }
+  return -1;
+}
+
+static void define_value(struct Optimizer * opt, jit_value_t value, long seq)
+{
+  rb_hash_aset(opt->seqs, value_key(value), LONG2NUM(seq));
+}
+
+/* Give an instruction's result the next sequence number.  libjit may
+ * return an existing value (such as one of the operands) instead of a
+ * new temporary, which keeps the number it had. */
+static void define_result(struct Optimizer * opt, jit_value_t result)
+{
+  if(result
+      && jit_value_is_temporary(result)
+      && NIL_P(rb_hash_aref(opt->seqs, value_key(result))))
+  {
+    define_value(opt, result, ++opt->seq);
+  }
+}
+
+/* Get the highest sequence number of an instruction's value operands,
+ * or -1 if any of them is not stable */
+static long operands_seq(
+    struct Optimizer * opt, int opcode, union Program_Operand const * ops)
+{
+  char const * operands = insn_info[opcode].operands;
+  long max_seq = 0;
+  int n;
+
+  for(n = 0; operands[n]; ++n)
+  {
+    if(operands[n] == 'V')
+    {
+      long seq = value_seq(opt, ops[n].value);
+      if(seq < 0)
+      {
+        return -1;
+      }
+      if(seq > max_seq)
+      {
+        max_seq = seq;
+      }
+    }
+  }
+
+  return max_seq;
+}
+
+static int is_commutative(int opcode)
+{
+  switch(opcode)
+  {
+    case INSN_ADD:
+    case INSN_MUL:
+    case INSN_AND:
+    case INSN_OR:
+    case INSN_XOR:
+    case INSN_EQ:
+    case INSN_NE:
+    case INSN_MIN:
+    case INSN_MAX:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+static VALUE expr_key(int opcode, union Program_Operand const * ops)
+{
+  char const * operands = insn_info[opcode].operands;
+  jit_nint words[5];
+  int n;
+
+  words[0] = opcode;
+  for(n = 0; operands[n]; ++n)
+  {
+    switch(operands[n])
+    {
+      case 'V': words[n + 1] = (jit_nint)ops[n].value; break;
+      case 'N': words[n + 1] = ops[n].nint; break;
+      case 'T': words[n + 1] = (jit_nint)ops[n].type; break;
+      default: words[n + 1] = 0; break;
+    }
+  }
+
+  if(is_commutative(opcode) && words[1] > words[2])
+  {
+    jit_nint tmp = words[1];
+    words[1] = words[2];
+    words[2] = tmp;
+  }
+
+  return rb_str_new((char const *)words, (n + 1) * sizeof(jit_nint));
+}
+
+static jit_value_t lookup_expr(VALUE table, VALUE key)
+{
+  VALUE value = rb_hash_aref(table, key);
+  return NIL_P(value) ? 0 : (jit_value_t)NUM2ULONG(value);
+}
+
+/* Constant folding, for INT and UINT constants of the same type */
+static jit_value_t fold_insn(
+    jit_function_t function, int opcode, union Program_Operand const * ops)
+{
+  char const * operands = insn_info[opcode].operands;
+  int binary = strcmp(operands, "VV") == 0;
+  jit_type_t type;
+  jit_uint x;
+  jit_uint y = 0;
+  jit_uint r;
+  int is_signed;
+  int cond;
+
+  if(!binary && strcmp(operands, "V") != 0)
+  {
+    return 0;
+  }
+
+  if(!jit_value_is_constant(ops[0].value))
+  {
+    return 0;
+  }
+
+  type = jit_value_get_type(ops[0].value);
+  if(type != jit_type_int && type != jit_type_uint)
+  {
+    return 0;
+  }
+  is_signed = (type == jit_type_int);
+  x = (jit_uint)jit_value_get_nint_constant(ops[0].value);
+
+  if(binary)
+  {
+    if(!jit_value_is_constant(ops[1].value)
+        || jit_value_get_type(ops[1].value) != type)
+    {
+      return 0;
+    }
+    y = (jit_uint)jit_value_get_nint_constant(ops[1].value);
+  }
+
+  switch(opcode)
+  {
+    case INSN_ADD: r = x + y; break;
+    case INSN_SUB: r = x - y; break;
+    case INSN_MUL: r = x * y; break;
+    case INSN_AND: r = x & y; break;
+    case INSN_OR: r = x | y; break;
+    case INSN_XOR: r = x ^ y; break;
+    case INSN_NEG: if(!is_signed) return 0; r = 0 - x; break;
+    case INSN_NOT: r = ~x; break;
+
+    case INSN_DIV:
+    case INSN_REM:
+      /* Leave division by zero (and overflow) to fault at runtime */
+      if(y == 0 || (is_signed && (jit_int)y == -1))
+      {
+        return 0;
+      }
+      if(opcode == INSN_DIV)
+      {
+        r = is_signed ? (jit_uint)((jit_int)x / (jit_int)y) : x / y;
+      }
+      else
+      {
+        r = is_signed ? (jit_uint)((jit_int)x % (jit_int)y) : x % y;
+      }
+      break;
+
+    case INSN_SHL:
+    case INSN_SHR:
+    case INSN_USHR:
+    case INSN_SSHR:
+      if(y >= 32)
+      {
+        return 0;
+      }
+      if(opcode == INSN_SHL)
+      {
+        r = x << y;
+      }
+      else if(opcode == INSN_USHR || (opcode == INSN_SHR && !is_signed))
+      {
+        r = x >> y;
+      }
+      else
+      {
+        r = (jit_uint)((jit_int)x >> y);
+      }
+      break;
+
+    case INSN_EQ: cond = x == y; goto comparison;
+    case INSN_NE: cond = x != y; goto comparison;
+    case INSN_LT: cond = is_signed ? (jit_int)x < (jit_int)y : x < y; goto comparison;
+    case INSN_LE: cond = is_signed ? (jit_int)x <= (jit_int)y : x <= y; goto comparison;
+    case INSN_GT: cond = is_signed ? (jit_int)x > (jit_int)y : x > y; goto comparison;
+    case INSN_GE: cond = is_signed ? (jit_int)x >= (jit_int)y : x >= y; goto comparison;
+    comparison:
+      return create_const(function, jit_type_int, INT2NUM(cond));
+
+    default:
+      return 0;
+  }
+
+  return create_const(
+      function, type, is_signed ? INT2NUM((jit_int)r) : UINT2NUM(r));
+}
+
+/* If value is a constant power of two (greater than 1) of the given
+ * type, get its log */
+static int constant_log2(jit_value_t value, jit_type_t type)
+{
+  jit_uint x;
+  int k = 0;
+
+  if(!jit_value_is_constant(value) || jit_value_get_type(value) != type)
+  {
+    return 0;
+  }
+
+  x = (jit_uint)jit_value_get_nint_constant(value);
+  if(x < 2 || (x & (x - 1)) != 0 || (type == jit_type_int && (jit_int)x < 0))
+  {
+    return 0;
+  }
+
+  while(x > 1)
+  {
+    x >>= 1;
+    ++k;
+  }
+  return k;
+}
+
+static jit_value_t optimize_insn(
+    jit_function_t function, int opcode, union Program_Operand const * ops);
+
+static jit_value_t optimize_binary(
+    jit_function_t function, int opcode, jit_value_t lhs, jit_value_t rhs)
+{
+  union Program_Operand ops[2];
+  ops[0].value = lhs;
+  ops[1].value = rhs;
+  return optimize_insn(function, opcode, ops);
+}
+
+/* Strength reduction of INT and UINT multiplication, division and
+ * remainder by powers of two to shifts and masks */
+static jit_value_t reduce_strength(
+    jit_function_t function, int opcode, union Program_Operand const * ops)
+{
+  jit_value_t x = ops[0].value;
+  jit_type_t type = jit_value_get_type(x);
+  int k;
+
+  if(type != jit_type_int && type != jit_type_uint)
+  {
+    return 0;
+  }
+
+  switch(opcode)
+  {
+    case INSN_MUL:
+      if((k = constant_log2(ops[1].value, type)))
+      {
+        return optimize_binary(
+            function, INSN_SHL, x, create_const(function, type, INT2NUM(k)));
+      }
+      if(jit_value_get_type(ops[1].value) == type
+          && (k = constant_log2(x, type)))
+      {
+        return optimize_binary(
+            function, INSN_SHL, ops[1].value,
+            create_const(function, type, INT2NUM(k)));
+      }
+      return 0;
+
+    case INSN_DIV:
+      if(!(k = constant_log2(ops[1].value, type)))
+      {
+        return 0;
+      }
+      if(type == jit_type_uint)
+      {
+        return optimize_binary(
+            function, INSN_SHR, x, create_const(function, type, INT2NUM(k)));
+      }
+      else
+      {
+        /* Round towards zero: add 2**k - 1 to negative dividends */
+        jit_value_t sign = optimize_binary(
+            function, INSN_SSHR, x, create_const(function, type, INT2NUM(31)));
+        jit_value_t bias = optimize_binary(
+            function, INSN_USHR, sign, create_const(function, type, INT2NUM(32 - k)));
+        jit_value_t biased = optimize_binary(function, INSN_ADD, x, bias);
+        return optimize_binary(
+            function, INSN_SSHR, biased, create_const(function, type, INT2NUM(k)));
+      }
+
+    case INSN_REM:
+      if(type != jit_type_uint || !(k = constant_log2(ops[1].value, type)))
+      {
+        return 0;
+      }
+      return optimize_binary(
+          function, INSN_AND, x,
+          create_const(function, type, UINT2NUM(((jit_uint)1 << k) - 1)));
+
+    default:
+      return 0;
+  }
+}
+
+/* The type of the result of an instruction that may be hoisted, or 0
+ * if it may not be.  Only instructions that cannot fault, on INT, UINT,
+ * FLOAT32 or FLOAT64 operands of the same type, are hoisted, so the
+ * result type is known before the instruction is emitted. */
+static jit_type_t hoist_type(int opcode, union Program_Operand const * ops)
+{
+  jit_type_t type = jit_value_get_type(ops[0].value);
+  int is_int = (type == jit_type_int || type == jit_type_uint);
+  int is_float = (type == jit_type_float32 || type == jit_type_float64);
+  int same = strcmp(insn_info[opcode].operands, "VV") == 0
+    && jit_value_get_type(ops[1].value) == type;
+
+  if(!is_int && !is_float)
+  {
+    return 0;
+  }
+
+  switch(opcode)
+  {
+    case INSN_NEG:
+      return type == jit_type_uint ? 0 : type;
+
+    case INSN_NOT:
+      return is_int ? type : 0;
+
+    case INSN_ADD:
+    case INSN_SUB:
+    case INSN_MUL:
+      return same ? type : 0;
+
+    case INSN_AND:
+    case INSN_OR:
+    case INSN_XOR:
+    case INSN_SHL:
+    case INSN_SHR:
+      return same && is_int ? type : 0;
+
+    case INSN_EQ:
+    case INSN_NE:
+    case INSN_LT:
+    case INSN_LE:
+    case INSN_GT:
+    case INSN_GE:
+      return same ? jit_type_int : 0;
+
+    default:
+      return 0;
+  }
+}
+
+/* Hoist an instruction on values that are invariant in one or more
+ * of the enclosing loops into the outermost such loop's preheader,
+ * returning its result, or 0 if it cannot be hoisted */
+static jit_value_t hoist_insn(
+    jit_function_t function,
+    struct Optimizer * opt,
+    int opcode,
+    union Program_Operand const * ops,
+    long seq,
+    VALUE key)
+{
+  struct Hoist * hoist;
+  jit_type_t type;
+  jit_value_t result;
+  int loop;
+  int j;
+
+  for(loop = 0; loop < opt->num_loops; ++loop)
+  {
+    if(opt->loops[loop].seq >= seq)
+    {
+      break;
+    }
+  }
+
+  if(loop == opt->num_loops || !(type = hoist_type(opcode, ops)))
+  {
+    return 0;
+  }
+
+  for(j = 0; j < opt->num_loops; ++j)
+  {
+    if((result = lookup_expr(opt->loops[j].hoisted, key)))
+    {
+      return result;
+    }
+  }
+
+  result = jit_value_create(function, type);
+  raise_memory_error_if_zero(result);
+  record_value(function, type, result);
+
+  if(opt->num_hoists == opt->hoists_capacity)
+  {
+    opt->hoists_capacity = opt->hoists_capacity ? 2 * opt->hoists_capacity : 8;
+    REALLOC_N(opt->hoists, struct Hoist, opt->hoists_capacity);
+  }
+
+  hoist = &opt->hoists[opt->num_hoists++];
+  hoist->opcode = opcode;
+  hoist->ops[0] = ops[0];
+  hoist->ops[1] = ops[1];
+  hoist->result = result;
+  hoist->loop = loop;
+
+  define_value(opt, result, opt->loops[loop].seq);
+  rb_hash_aset(opt->loops[loop].hoisted, key, value_key(result));
+  return result;
+}
+
+/* A hoisted instruction is computed once, before the loop, so neither
+ * its operands nor its result may change while the loop is open */
+static void check_not_hoisted(
+    struct Optimizer * opt, jit_value_t value, char const * action)
+{
+  long j;
+  int n;
+
+  for(j = 0; j < opt->num_hoists; ++j)
+  {
+    struct Hoist const * hoist = &opt->hoists[j];
+    char const * operands = insn_info[hoist->opcode].operands;
+    int uses = (hoist->result == value);
+    for(n = 0; operands[n]; ++n)
+    {
+      uses = uses || (operands[n] == 'V' && hoist->ops[n].value == value);
+    }
+    if(uses)
+    {
+      rb_raise(
+          rb_eRuntimeError,
+          "Cannot %s a value used by code hoisted out of a loop (see Function#optimizations=)",
+          action);
+    }
+  }
+}
+
+/* Called before emitting anything that may write to memory other than
+ * through the insn_* methods (such as a call) */
+static void optimizer_barrier(jit_function_t function)
+{
+  struct Optimizer * opt = get_optimizer(function);
+  if(opt)
+  {
+    opt->loads = rb_hash_new();
+  }
+}
+
+/* A value that is assigned to or has its address taken is no longer
+ * stable */
+static void make_unstable(struct Optimizer * opt, jit_value_t value, char const * action)
+{
+  if(value_seq(opt, value) >= 0)
+  {
+    check_not_hoisted(opt, value, action);
+    optimizer_forget_exprs(opt);
+  }
+  define_value(opt, value, -1);
+}
+
+/* Called after emitting code other than through optimize_insn (with
+ * emit_program, replay_recipe, insn_check_bounds or insn_jump_table),
+ * which the optimizer has not seen: it may have stored to memory or to
+ * any value, so nothing computed before it can be reused */
+static void optimizer_forget(jit_function_t function)
+{
+  struct Optimizer * opt = get_optimizer(function);
+  if(opt)
+  {
+    optimizer_forget_exprs(opt);
+  }
+}
+
+/* Called for each instruction that a program emits, so that a value
+ * it assigns to or takes the address of is no longer stable (and
+ * cannot have been hoisted out of a loop) */
+static void optimizer_note_insn(
+    jit_function_t function, int opcode, union Program_Operand const * ops)
+{
+  struct Optimizer * opt = get_optimizer(function);
+  if(!opt)
+  {
+    return;
+  }
+  if(opcode == INSN_STORE)
+  {
+    make_unstable(opt, ops[0].value, "assign to");
+  }
+  else if(opcode == INSN_ADDRESS_OF)
+  {
+    make_unstable(opt, ops[0].value, "take the address of");
+  }
+}
+
+/* Emit an instruction (through one of the insn_* methods) for a
+ * function with optimizations turned on */
+static jit_value_t optimize_insn(
+    jit_function_t function, int opcode, union Program_Operand const * ops)
+{
+  struct Optimizer * opt = get_optimizer(function);
+  VALUE table;
+  VALUE key = Qnil;
+  jit_value_t result;
+  long seq;
+  int pure = 0;
+
+  optimizer_sync_block(function, opt);
+
+  switch(opcode)
+  {
+    case INSN_ADD: case INSN_SUB: case INSN_MUL: case INSN_NEG:
+    case INSN_AND: case INSN_OR: case INSN_XOR: case INSN_NOT:
+    case INSN_SHL: case INSN_SHR: case INSN_USHR: case INSN_SSHR:
+    case INSN_EQ: case INSN_NE: case INSN_LT: case INSN_LE:
+    case INSN_GT: case INSN_GE: case INSN_CMPL: case INSN_CMPG:
+    case INSN_TO_BOOL: case INSN_TO_NOT_BOOL:
+    case INSN_ABS: case INSN_MIN: case INSN_MAX: case INSN_SIGN:
+    case INSN_ADD_RELATIVE:
+      pure = 1;
+      /* fall through */
+
+    case INSN_ADD_OVF: case INSN_SUB_OVF: case INSN_MUL_OVF:
+    case INSN_DIV: case INSN_REM: case INSN_REM_IEEE:
+      if((opt->passes & OPT_FOLD) && (result = fold_insn(function, opcode, ops)))
+      {
+        return result;
+      }
+      if((opt->passes & OPT_STRENGTH)
+          && (result = reduce_strength(function, opcode, ops)))
+      {
+        return result;
+      }
+      table = opt->exprs;
+      break;
+
+    case INSN_LOAD_RELATIVE:
+    case INSN_LOAD_ELEM:
+      table = opt->loads;
+      break;
+
+    case INSN_STORE:
+      make_unstable(opt, ops[0].value, "assign to");
+      emit_recorded(function, opcode, ops);
+      opt->loads = rb_hash_new();
+      return 0;
+
+    case INSN_ADDRESS_OF:
+      make_unstable(opt, ops[0].value, "take the address of");
+      result = emit_recorded(function, opcode, ops);
+      define_result(opt, result);
+      return result;
+
+    case INSN_STORE_RELATIVE:
+    case INSN_STORE_ELEM:
+    case INSN_MEMCPY:
+    case INSN_MEMMOVE:
+    case INSN_MEMSET:
+      emit_recorded(function, opcode, ops);
+      opt->loads = rb_hash_new();
+      return 0;
+
+    case INSN_MOVE_BLOCKS_TO_END:
+    case INSN_MOVE_BLOCKS_TO_START:
+      emit_recorded(function, opcode, ops);
+      optimizer_forget_exprs(opt);
+      return 0;
+
+    default:
+      result = emit_recorded(function, opcode, ops);
+      define_result(opt, result);
+      return result;
+  }
+
+  if((seq = operands_seq(opt, opcode, ops)) >= 0)
+  {
+    key = expr_key(opcode, ops);
+    if((opt->passes & OPT_CSE) && (result = lookup_expr(table, key)))
+    {
+      return result;
+    }
+    if(pure
+        && (opt->passes & OPT_LICM)
+        && (result = hoist_insn(function, opt, opcode, ops, seq, key)))
+    {
+      return result;
+    }
+  }
+
+  result = emit_recorded(function, opcode, ops);
+  define_result(opt, result);
+  if(!NIL_P(key) && (opt->passes & OPT_CSE))
+  {
+    rb_hash_aset(table, key, value_key(result));
+  }
+  return result;
+}
+
+/*
+ * call-seq:
+ *   function.optimizations = [ :fold, :cse, :strength, :licm ]
+ *   function.optimizations = true
+ *   function.optimizations = false
+ *
+ * Choose the optimizations applied, as the function is built, to the
+ * instructions emitted through the insn_* methods (and so through the
+ * JIT::Value operators), in addition to libjit's own:
+ *
+ * <tt>:fold</tt>::     Compute operations on INT and UINT constants.
+ * <tt>:cse</tt>::      Reuse the result of an identical operation (or
+ *                      load, if memory has not since been written)
+ *                      earlier in the same block.
+ * <tt>:strength</tt>:: Turn INT and UINT multiplications, divisions and
+ *                      (UINT) remainders by powers of two into shifts
+ *                      and masks.
+ * <tt>:licm</tt>::     Hoist operations on values that do not change in
+ *                      a loop built with while or until (or the helpers
+ *                      built on them) into the loop's preheader.
+ *
+ * Operations are only reused or hoisted if their operands are
+ * constants, parameters or results of other operations that have not
+ * been assigned to.  Code emitted in other ways (with emit_program,
+ * replay_recipe, insn_check_bounds or insn_jump_table) is not
+ * optimized, and nothing computed before it is reused after it.  Set
+ * this at the start of the function's builder.
+ */
+static VALUE function_set_optimizations(VALUE self, VALUE passes_v)
+{
+  jit_function_t function;
+  struct Optimizer * opt;
+  int passes = 0;
+  int j;
+  int k;
+
+  Get_Function(self, function);
+
+  if(passes_v == Qtrue)
+  {
+    passes = OPT_ALL;
+  }
+  else if(RTEST(passes_v))
+  {
+    Check_Type(passes_v, T_ARRAY);
+    for(j = 0; j < RARRAY_LEN(passes_v); ++j)
+    {
+      VALUE name_v = RARRAY_PTR(passes_v)[j];
+      for(k = 0; k < NUM_OPTIMIZATIONS; ++k)
+      {
+        if(SYMBOL_P(name_v)
+            && strcmp(rb_id2name(SYM2ID(name_v)), optimization_names[k].name) == 0)
+        {
+          passes |= optimization_names[k].flag;
+          break;
+        }
+      }
+      if(k == NUM_OPTIMIZATIONS)
+      {
+        rb_raise(
+            rb_eArgError, "Unknown optimization %s",
+            RSTRING_PTR(rb_inspect(name_v)));
+      }
+    }
+  }
+
+  if(!passes)
+  {
+    jit_function_free_meta(function, RJT_OPTIMIZER);
+    return passes_v;
+  }
+
+  if(!(opt = get_optimizer(function)))
+  {
+    opt = ALLOC(struct Optimizer);
+    MEMZERO(opt, struct Optimizer, 1);
+    opt->exprs = rb_hash_new();
+    opt->loads = rb_hash_new();
+    opt->seqs = rb_hash_new();
+    if(!jit_function_set_meta(function, RJT_OPTIMIZER, opt, free_optimizer, 0))
+    {
+      xfree(opt);
+      rb_raise(rb_eNoMemError, "Out of memory");
+    }
+  }
+
+  opt->passes = passes;
+  return passes_v;
+}
+
+/*
+ * call-seq:
+ *   passes = function.optimizations
+ *
+ * Get the optimizations turned on for this function (see
+ * optimizations=).
+ */
+static VALUE function_optimizations(VALUE self)
+{
+  jit_function_t function;
+  struct Optimizer * opt;
+  VALUE passes = rb_ary_new();
+  int k;
+
+  Get_Function(self, function);
+  opt = get_optimizer(function);
+
+  for(k = 0; opt && k < NUM_OPTIMIZATIONS; ++k)
+  {
+    if(opt->passes & optimization_names[k].flag)
+    {
+      rb_ary_push(passes, ID2SYM(rb_intern(optimization_names[k].name)));
+    }
+  }
+
+  return passes;
+}
+
+/*
+ * call-seq:
+ *   is_tracked = function.begin_loop
+ *
+ * Tell the optimizer that a loop starts here (see optimizations=).
+ * If loop-invariant code motion is on, this emits a branch to the
+ * loop's preheader, and returns true; end_loop must then be called
+ * where the loop ends.  Function#while and Function#until call this.
+ */
+static VALUE function_begin_loop(VALUE self)
+{
+  jit_function_t function;
+  struct Optimizer * opt;
+  struct Loop_Info * loop;
+
+  Get_Function(self, function);
+  opt = get_optimizer(function);
+  if(!opt || !(opt->passes & OPT_LICM))
+  {
+    return Qfalse;
+  }
+
+  if(opt->num_loops == opt->loops_capacity)
+  {
+    opt->loops_capacity = opt->loops_capacity ? 2 * opt->loops_capacity : 4;
+    REALLOC_N(opt->loops, struct Loop_Info, opt->loops_capacity);
+  }
+
+  loop = &opt->loops[opt->num_loops++];
+  loop->seq = ++opt->seq;
+  loop->entry_label = jit_label_undefined;
+  loop->preheader_label = jit_label_undefined;
+  loop->hoisted = rb_hash_new();
+
+  emit_recorded_branch(function, INSN_BRANCH, &loop->preheader_label);
+  emit_recorded_branch(function, INSN_LABEL, &loop->entry_label);
+  return Qtrue;
+}
+
+/*
+ * call-seq:
+ *   function.end_loop
+ *
+ * Tell the optimizer that the innermost loop started with begin_loop
+ * ends here, and emit the loop's preheader.
+ */
+static VALUE function_end_loop(VALUE self)
+{
+  jit_function_t function;
+  struct Optimizer * opt;
+  jit_label_t exit_label = jit_label_undefined;
+  jit_label_t entry_label;
+  int loop;
+  long j;
+  long k;
+
+  Get_Function(self, function);
+  opt = get_optimizer(function);
+  if(!opt || opt->num_loops == 0)
+  {
+    rb_raise(rb_eRuntimeError, "No loop to end");
+  }
+
+  loop = opt->num_loops - 1;
+
+  /* The preheader goes after the loop, where it is branched around */
+  emit_recorded_branch(function, INSN_BRANCH, &exit_label);
+  emit_recorded_branch(function, INSN_LABEL, &opt->loops[loop].preheader_label);
+
+  for(j = 0, k = 0; j < opt->num_hoists; ++j)
+  {
+    struct Hoist * hoist = &opt->hoists[j];
+    if(hoist->loop == loop)
+    {
+      emit_recorded_store(
+          function, hoist->result, emit_recorded(function, hoist->opcode, hoist->ops));
+    }
+    else
+    {
+      opt->hoists[k++] = *hoist;
+    }
   }
+  opt->num_hoists = k;
+
+  entry_label = opt->loops[loop].entry_label;
+  --opt->num_loops;
+
+  emit_recorded_branch(function, INSN_BRANCH, &entry_label);
+  emit_recorded_branch(function, INSN_LABEL, &exit_label);
   return Qnil;
 }
 
+/* ---------------------------------------------------------------------------
+ * Releasing and migrating functions
+ * ---------------------------------------------------------------------------
+ */
+
+static VALUE module_define_jit_method(VALUE klass, VALUE name_v, VALUE function_v);
+
+/* libjit only frees a function's code when the whole context is
+ * destroyed.  Releasing a function detaches it from its JIT::Function
+ * and from the context's list of functions; the objects its code may
+ * still use are handed to the context, and closures, jit methods and
+ * calling functions keep the context (and so the code) alive.  The
+ * apply plan and the cache entry are left with the function, to be
+ * freed with the context, since a call that is running without the GVL
+ * may still be using them (see function_apply). */
+static void detach_function(jit_function_t function, VALUE function_v)
+{
+  VALUE context_v = (VALUE)jit_function_get_meta(function, RJT_CONTEXT);
+  VALUE builder = (VALUE)jit_function_get_meta(function, RJT_BUILDER);
+  jit_context_t context;
+  VALUE retained;
+
+  Get_Data(context_v, context, struct _jit_context, context);
+
+  retained = (VALUE)jit_context_get_meta(context, RJT_RETAINED_OBJECTS);
+  rb_ary_push(retained, (VALUE)jit_function_get_meta(function, RJT_VALUE_OBJECTS));
+  if(builder)
+  {
+    rb_ary_push(retained, builder);
+  }
+
+  cache_remove(function);
+  jit_function_free_meta(function, RJT_HANDLES);
+  jit_function_free_meta(function, RJT_CONSTANTS);
+  jit_function_free_meta(function, RJT_RECORDER);
+  jit_function_free_meta(function, RJT_OPTIMIZER);
+  jit_function_free_meta(function, RJT_RECIPE);
+  jit_function_free_meta(function, RJT_METHODS);
+  jit_function_free_meta(function, RJT_SELF);
+
+  rb_ary_delete((VALUE)jit_context_get_meta(context, RJT_FUNCTIONS), function_v);
+  DATA_PTR(function_v) = 0;
+}
+
 /*
  * call-seq:
- *   function = Function.new(context, signature, [parent]) { |function| ... }
+ *   function.release
  *
- * Create a new function, begin compiling it, and pass the function to
- * the block.
+ * Release the memory used to build this function.  The function can
+ * no longer be used through this object, but closures and jit methods
+ * created from it, and functions that call it, continue to work.  Its
+ * code is freed along with its context, once the context is no longer
+ * referenced (see Context#compact).
  */
-static VALUE function_s_compile(int argc, VALUE * argv, VALUE klass)
+static VALUE function_release(VALUE self)
 {
-  VALUE function = create_function(argc, argv, klass);
-  rb_yield(function);
-  function_compile(function);
-#ifdef HAVE_RB_ENSURE
-  rb_ensure(
-      function_compile,
-      function,
-      function_abandon_if_exception,
-      function);
-#else
-  /* Rubinius does not yet have rb_ensure */
-  function_compile(function);
-  function_abandon_if_exception(function);
-#endif
-  return function;
+  jit_function_t function;
+  Get_Data(self, function, struct _jit_function, function);
+  if(function)
+  {
+    detach_function(function, self);
+  }
+  return Qnil;
 }
 
 /*
- * Get the value that corresponds to a specified function parameter.
+ * call-seq:
+ *   is_released = function.released?
  *
+ * Determine whether a function has been released.
+ */
+static VALUE function_is_released(VALUE self)
+{
+  return DATA_PTR(self) ? Qfalse : Qtrue;
+}
+
+/*
  * call-seq:
- *   value = function.get_param(index)
+ *   recipe = function.recipe
+ *
+ * Get the recipe the function was built from, or nil if it was not
+ * recorded (see finish_recording and Context#keep_recipes=).
  */
-static VALUE function_get_param(VALUE self, VALUE idx)
+static VALUE function_recipe(VALUE self)
 {
   jit_function_t function;
-  jit_value_t value;
-  Data_Get_Struct(self, struct _jit_function, function);
-  value = jit_value_get_param(function, NUM2INT(idx));
-  raise_memory_error_if_zero(value);
-  return Data_Wrap_Struct(rb_cValue, 0, 0, value);
+  VALUE recipe;
+  Get_Function(self, function);
+  recipe = (VALUE)jit_function_get_meta(function, RJT_RECIPE);
+  return recipe ? recipe : Qnil;
 }
 
-#include "insns.inc"
+static int function_can_migrate(VALUE function_v)
+{
+  jit_function_t function;
+  Get_Data(function_v, function, struct _jit_function, function);
+  return function
+    && jit_function_is_compiled(function)
+    && jit_function_get_meta(function, RJT_RECIPE)
+    && !jit_function_get_meta(function, RJT_TIER_STATE)
+    && !jit_function_get_nested_parent(function);
+}
 
-static VALUE function_value_klass(VALUE self, VALUE type_v, VALUE klass)
+/* Make function_v refer to the function in new_function_v (which was
+ * just created in another context) and detach the function it referred
+ * to, moving any jit methods defined from the old function to the new
+ * one */
+static void replace_function(VALUE function_v, VALUE new_function_v)
 {
   jit_function_t function;
-  jit_type_t type;
-  jit_value_t value;
+  jit_function_t new_function;
+  jit_context_t context;
+  VALUE context_v;
+  VALUE methods;
+  VALUE functions;
+  long j;
 
-  Data_Get_Struct(self, struct _jit_function, function);
+  Get_Function(function_v, function);
+  Get_Function(new_function_v, new_function);
 
-  type_v = lookup_const(rb_cType, type_v);
-  check_type("type", rb_cType, type_v);
-  Data_Get_Struct(type_v, struct _jit_type, type);
+  methods = (VALUE)jit_function_get_meta(function, RJT_METHODS);
+  detach_function(function, function_v);
 
-  /* TODO: When we wrap a value, we should inject a reference to the
-   * function in the object, so the function stays around as long as the
-   * value does */
-  value = jit_value_create(function, type);
-  return Data_Wrap_Struct(klass, 0, 0, value);
+  DATA_PTR(new_function_v) = 0;
+  DATA_PTR(function_v) = new_function;
+  if(!jit_function_set_meta(new_function, RJT_SELF, (void *)function_v, 0, 0))
+  {
+    rb_raise(rb_eNoMemError, "Out of memory");
+  }
+
+  context_v = (VALUE)jit_function_get_meta(new_function, RJT_CONTEXT);
+  Get_Data(context_v, context, struct _jit_context, context);
+  functions = (VALUE)jit_context_get_meta(context, RJT_FUNCTIONS);
+  rb_ary_delete(functions, new_function_v);
+  rb_ary_push(functions, function_v);
+
+  if(methods)
+  {
+    for(j = 0; j < RARRAY_LEN(methods); ++j)
+    {
+      VALUE key = RARRAY_PTR(methods)[j];
+      module_define_jit_method(
+          RARRAY_PTR(key)[0], RARRAY_PTR(key)[1], function_v);
+    }
+  }
 }
 
-static VALUE coerce_to_jit(VALUE function, VALUE type_v, VALUE value_v);
+static VALUE migrate_build(VALUE recipe_ptr)
+{
+  struct Recipe * recipe = (struct Recipe *)recipe_ptr;
+  replay_recipe(recipe_ptr);
+  compile_function(recipe->function);
+  return Qnil;
+}
 
 /*
  * call-seq:
- *   value = function.value(type)
- *   value = function.value(type, initial_value)
+ *   function.migrate(context)
  *
- * Create a value (placeholder/variable) with the given type.
+ * Rebuild the function in another context from its recipe, and make
+ * this object, and any jit methods defined from it, use the new code.
+ * Closures already taken from the function and functions that call it
+ * continue to use the old code, and keep the old context alive.
+ *
+ * Only compiled functions with a recipe (see Context#keep_recipes=)
+ * can be migrated; tiered and nested functions cannot.  The new
+ * context must not be locked for building by the calling thread.
  */
-static VALUE function_value(int argc, VALUE * argv, VALUE self)
+static VALUE function_migrate(VALUE self, VALUE context_v)
 {
-  VALUE type_v = Qnil;
-  VALUE initial_value_v = Qnil;
+  jit_function_t function;
+  jit_function_t new_function;
+  jit_context_t context;
+  VALUE args[2];
+  VALUE new_function_v;
+  VALUE recipe_v;
+  struct Recipe recipe;
+  char const * name;
+  int release_gvl;
 
-  VALUE new_value = Qnil;
+  Get_Function(self, function);
+  check_type("context", rb_cContext, context_v);
 
-  rb_scan_args(argc, argv, "11", &type_v, &initial_value_v);
+  if(context_v == (VALUE)jit_function_get_meta(function, RJT_CONTEXT))
+  {
+    return self;
+  }
 
-  new_value = function_value_klass(self, type_v, rb_cValue);
+  if(!function_can_migrate(self))
+  {
+    rb_raise(
+        rb_eRuntimeError,
+        "Only compiled functions with a recipe can be migrated");
+  }
 
-  if(argc > 1)
+  recipe_v = (VALUE)jit_function_get_meta(function, RJT_RECIPE);
+  release_gvl = get_apply_plan(function)->release_gvl;
+
+  args[0] = context_v;
+  args[1] = (VALUE)jit_function_get_meta(function, RJT_SIGNATURE);
+  new_function_v = create_function(2, args, rb_cFunction);
+  Get_Function(new_function_v, new_function);
+
+  name = (char const *)jit_function_get_meta(function, RJT_NAME);
+  if(name)
   {
-    function_insn_store(
-        self,
-        new_value,
-        coerce_to_jit(self, type_v, initial_value_v));
+    set_function_meta_string(new_function, RJT_NAME, name);
   }
 
-  return new_value;
+  recipe.function = new_function;
+  recipe.data = RSTRING_PTR(recipe_v);
+  recipe.size = RSTRING_LEN(recipe_v);
+
+  Get_Data(context_v, context, struct _jit_context, context);
+  with_build_lock(context, migrate_build, (VALUE)&recipe);
+
+  set_recipe(new_function, recipe_v);
+  get_apply_plan(new_function)->release_gvl = release_gvl;
+
+  replace_function(self, new_function_v);
+
+  return self;
 }
 
-static jit_value_t create_const(jit_function_t function, jit_type_t type, VALUE constant)
+/* ---------------------------------------------------------------------------
+ * Code cache
+ * ---------------------------------------------------------------------------
+ */
+
+/* Evictable functions (see Function#evictable=) are kept on a list in
+ * roughly least recently used order, using the clock algorithm: each
+ * function's code sets its used flag when it is entered, and a function
+ * that has been used since it was last considered for eviction is
+ * moved to the back of the list rather than evicted.  An entry lives as
+ * long as its function, since the function's code refers to it. */
+struct Cache_Entry
 {
-  jit_constant_t c;
-  int kind = jit_type_get_kind(type);
+  struct Cache_Entry * prev;
+  struct Cache_Entry * next;
+  jit_function_t function;
+  unsigned long code_size;
+  jit_nint used;
+  int disabled;
+  int evicted;      /* replaces an evicted function, not yet rebuilt */
+  int release_gvl;  /* the evicted function's release_gvl */
+};
 
-  switch(kind)
+static struct Cache_Entry cache_list = { &cache_list, &cache_list };
+static unsigned long cache_num_entries = 0;
+static unsigned long cache_code_size = 0;
+static unsigned long code_budget = 0;
+
+static struct Cache_Entry * get_cache_entry(jit_function_t function)
+{
+  return (struct Cache_Entry *)jit_function_get_meta(function, RJT_CACHE_ENTRY);
+}
+
+static void cache_unlink(struct Cache_Entry * entry)
+{
+  if(entry->next == entry)
   {
-    case JIT_TYPE_INT:
-    {
-      c.type = type;
-      c.un.int_value = NUM2INT(constant);
-      break;
-    }
+    return;
+  }
+  entry->prev->next = entry->next;
+  entry->next->prev = entry->prev;
+  entry->prev = entry->next = entry;
+  cache_code_size -= entry->code_size;
+  --cache_num_entries;
+}
 
-    case JIT_TYPE_UINT:
-    {
-      c.type = type;
-      c.un.int_value = NUM2UINT(constant);
-      break;
-    }
+static void cache_append(struct Cache_Entry * entry)
+{
+  entry->prev = cache_list.prev;
+  entry->next = &cache_list;
+  cache_list.prev->next = entry;
+  cache_list.prev = entry;
+  cache_code_size += entry->code_size;
+  ++cache_num_entries;
+}
 
-    case JIT_TYPE_FLOAT32:
-    {
-      c.type = type;
-      c.un.float32_value = NUM2DBL(constant);
-      break;
-    }
+static void free_cache_entry(void * entry)
+{
+  cache_unlink((struct Cache_Entry *)entry);
+  xfree(entry);
+}
 
-    case JIT_TYPE_FLOAT64:
+static struct Cache_Entry * create_cache_entry(jit_function_t function)
+{
+  struct Cache_Entry * entry = ALLOC(struct Cache_Entry);
+  MEMZERO(entry, struct Cache_Entry, 1);
+  entry->prev = entry->next = entry;
+  entry->function = function;
+  if(!jit_function_set_meta(function, RJT_CACHE_ENTRY, entry, free_cache_entry, 0))
+  {
+    xfree(entry);
+    rb_raise(rb_eNoMemError, "Out of memory");
+  }
+  return entry;
+}
+
+static void cache_remove(jit_function_t function)
+{
+  struct Cache_Entry * entry = get_cache_entry(function);
+  if(entry)
+  {
+    cache_unlink(entry);
+  }
+}
+
+/* Emit code to set the function's used flag each time it is entered */
+static void emit_cache_prologue(jit_function_t function, struct Cache_Entry * entry)
+{
+  jit_value_t entry_ptr = jit_value_create_nint_constant(
+      function, jit_type_void_ptr, (jit_nint)entry);
+  jit_insn_store_relative(
+      function, entry_ptr, offsetof(struct Cache_Entry, used),
+      jit_value_create_nint_constant(function, jit_type_nint, 1));
+}
+
+/* Replace an evictable function with a new lazy function in a new
+ * context, which will run the same builder when it is next used.  The
+ * old function is detached (see detach_function), so its code is freed
+ * along with its context once nothing else refers to it.  A call that
+ * is running without the GVL in another thread keeps the old context
+ * alive until it returns (see function_apply). */
+static void evict_function(struct Cache_Entry * entry)
+{
+  jit_function_t function = entry->function;
+  jit_function_t new_function;
+  struct Cache_Entry * new_entry;
+  struct Apply_Plan * plan;
+  struct Stats * stats;
+  struct Stats * new_stats;
+  struct Stats delta = { 0 };
+  char const * str;
+  VALUE function_v = (VALUE)jit_function_get_meta(function, RJT_SELF);
+  VALUE new_function_v;
+  VALUE args[2];
+
+  if(!function_v || DATA_PTR(function_v) != function)
+  {
+    cache_unlink(entry);
+    return;
+  }
+
+  args[0] = context_s_new(rb_cContext);
+  args[1] = (VALUE)jit_function_get_meta(function, RJT_SIGNATURE);
+  new_function_v = create_function(2, args, rb_cFunction);
+  Get_Function(new_function_v, new_function);
+
+  if(!jit_function_set_meta(
+      new_function, RJT_BUILDER,
+      jit_function_get_meta(function, RJT_REBUILDER), 0, 0))
+  {
+    rb_raise(rb_eNoMemError, "Out of memory");
+  }
+  jit_function_set_on_demand_compiler(new_function, function_on_demand_compiler);
+
+  if((str = (char const *)jit_function_get_meta(function, RJT_NAME)))
+  {
+    set_function_meta_string(new_function, RJT_NAME, str);
+  }
+  if((str = (char const *)jit_function_get_meta(function, RJT_SOURCE_LOCATION)))
+  {
+    set_function_meta_string(new_function, RJT_SOURCE_LOCATION, str);
+  }
+
+  plan = (struct Apply_Plan *)jit_function_get_meta(function, RJT_APPLY_PLAN);
+  new_entry = create_cache_entry(new_function);
+  new_entry->evicted = 1;
+  new_entry->release_gvl = plan ? plan->release_gvl : 0;
+
+  delta.evictions = 1;
+  add_stats(function, &delta);
+
+  /* The function's own counters carry over to its replacement */
+  stats = get_function_stats(function);
+  new_stats = get_function_stats(new_function);
+  new_stats->evictions = stats->evictions;
+  new_stats->rebuilds = stats->rebuilds;
+
+  replace_function(function_v, new_function_v);
+}
+
+/* Evict functions from the front of the list until the code of the
+ * evictable functions fits within the budget again.  Each entry is
+ * looked at no more than twice, so if every function is in use (or is
+ * the one to keep), the budget is exceeded rather than looping. */
+static void enforce_code_budget(struct Cache_Entry * keep)
+{
+  unsigned long checks = 2 * cache_num_entries;
+
+  while(code_budget && cache_code_size > code_budget && checks-- > 0)
+  {
+    struct Cache_Entry * entry = cache_list.next;
+    if(entry == keep || entry->used)
     {
-      c.type = type;
-      c.un.float64_value = NUM2DBL(constant);
-      break;
+      entry->used = 0;
+      cache_unlink(entry);
+      cache_append(entry);
     }
-
-    case JIT_TYPE_PTR:
+    else
     {
-      c.type = type;
-      c.un.ptr_value = (void *)NUM2ULONG(constant);
-      break;
+      evict_function(entry);
     }
+  }
+}
 
-    case JIT_TYPE_FIRST_TAGGED + RJT_OBJECT:
-    {
-      VALUE value_objects = (VALUE)jit_function_get_meta(function, RJT_VALUE_OBJECTS);
+/* Called once an evictable function has been compiled, to add it to the
+ * back of the list and evict other functions if the budget is
+ * exceeded */
+static void cache_insert(jit_function_t function)
+{
+  struct Cache_Entry * entry = get_cache_entry(function);
+  struct Stats * stats = get_function_stats(function);
+  struct Stats delta = { 0 };
 
-      c.type = type;
-      SET_CONSTANT_VALUE(c, constant);
+  if(!entry || entry->disabled)
+  {
+    return;
+  }
 
-      /* Make sure the object gets marked as long as the function is
-       * around */
-      rb_ary_push(value_objects, constant);
-      break;
-    }
+  if(entry->evicted)
+  {
+    entry->evicted = 0;
+    get_apply_plan(function)->release_gvl = entry->release_gvl;
+    delta.rebuilds = 1;
+    add_stats(function, &delta);
+  }
 
-    case JIT_TYPE_FIRST_TAGGED + RJT_ID:
-    {
-      c.type = type;
-      SET_CONSTANT_ID(c, SYM2ID(constant));
-      break;
-    }
+  cache_unlink(entry);
+  entry->code_size = stats ? stats->code_size : 0;
+  entry->used = 1;
+  cache_append(entry);
 
-    case JIT_TYPE_FIRST_TAGGED + RJT_FUNCTION_PTR:
+  enforce_code_budget(entry);
+}
+
+/*
+ * call-seq:
+ *   function.evictable = true
+ *
+ * Allow the function's code to be evicted to keep within JIT.code_budget.
+ * The function must have been created with Function.compile_lazy and
+ * not yet compiled; its builder block is kept, and run again to rebuild
+ * the function the next time it is used after being evicted.
+ *
+ * A call made with apply, apply_into or apply_many keeps the evicted
+ * code alive until it returns, so the function may be evicted by
+ * another thread while it runs without the GVL.  Calls made through a
+ * jit method or from another function are not protected this way, so
+ * do not make a function evictable if it is called like that and
+ * another evictable function may be compiled while it is running (for
+ * example, if it calls a lazy function or calls back into ruby).
+ */
+static VALUE function_set_evictable(VALUE self, VALUE evictable)
+{
+  jit_function_t function;
+  struct Cache_Entry * entry;
+
+  Get_Function(self, function);
+  entry = get_cache_entry(function);
+
+  if(!RTEST(evictable))
+  {
+    if(entry)
     {
-      c.type = type;
-      SET_FUNCTION_POINTER_VALUE(
-          c,
-          (Void_Function_Ptr)NUM2ULONG(rb_to_int(constant)));
-      break;
+      entry->disabled = 1;
+      cache_unlink(entry);
+    }
+    return evictable;
+  }
+
+  if(entry)
+  {
+    entry->disabled = 0;
+    if(jit_function_is_compiled(function))
+    {
+      cache_insert(function);
     }
+    return evictable;
+  }
 
-    default:
-      rb_raise(rb_eTypeError, "Unsupported type");
+  if(jit_function_is_compiled(function)
+      || !jit_function_get_meta(function, RJT_BUILDER))
+  {
+    rb_raise(
+        rb_eRuntimeError,
+        "Only lazy functions that have not been compiled can be made evictable");
   }
 
-  return jit_value_create_constant(function, &c);
+  create_cache_entry(function);
+  return evictable;
 }
 
 /*
  * call-seq:
- *   value = function.const(type, constant_value)
+ *   evictable = function.evictable?
  *
- * Create a constant value with the given type.
+ * Determine whether the function's code may be evicted (see
+ * evictable=).
  */
-static VALUE function_const(VALUE self, VALUE type_v, VALUE constant)
+static VALUE function_is_evictable(VALUE self)
 {
   jit_function_t function;
-  jit_type_t type;
-  jit_value_t value;
+  struct Cache_Entry * entry;
+  Get_Function(self, function);
+  entry = get_cache_entry(function);
+  return (entry && !entry->disabled) ? Qtrue : Qfalse;
+}
 
-  Data_Get_Struct(self, struct _jit_function, function);
+/*
+ * call-seq:
+ *   JIT.code_budget = bytes
+ *
+ * Limit the total size of the native code of the evictable functions
+ * (see Function#evictable=), or remove the limit if bytes is nil.
+ * Whenever an evictable function is compiled and the limit is exceeded,
+ * the least recently used evictable functions are evicted.
+ */
+static VALUE jit_s_set_code_budget(VALUE self, VALUE budget)
+{
+  code_budget = NIL_P(budget) ? 0 : NUM2ULONG(budget);
+  enforce_code_budget(0);
+  return budget;
+}
 
-  type_v = lookup_const(rb_cType, type_v);
-  check_type("type", rb_cType, type_v);
-  Data_Get_Struct(type_v, struct _jit_type, type);
+/*
+ * call-seq:
+ *   bytes = JIT.code_budget
+ *
+ * Get the limit set with code_budget=, or nil if there is none.
+ */
+static VALUE jit_s_code_budget(VALUE self)
+{
+  return code_budget ? ULONG2NUM(code_budget) : Qnil;
+}
 
-  value = create_const(function, type, constant);
-  return Data_Wrap_Struct(rb_cValue, 0, 0, value);
+/*
+ * call-seq:
+ *   bytes = JIT.code_cache_size
+ *
+ * Get the total size of the native code of the evictable functions
+ * that are compiled and have not been evicted.
+ */
+static VALUE jit_s_code_cache_size(VALUE self)
+{
+  return ULONG2NUM(cache_code_size);
 }
 
 static VALUE coerce_to_jit(VALUE function, VALUE type_v, VALUE value_v)
@@ -586,14 +5858,18 @@ static VALUE coerce_to_jit(VALUE function, VALUE type_v, VALUE value_v)
   }
 }
 
-static void convert_call_args(jit_function_t function, jit_value_t * args, VALUE args_v, jit_type_t signature)
+/* Convert the arguments of a call, each of which is a JIT::Value, a
+ * value handle (see param_handle) or a constant of the type the
+ * signature gives, and note in flags which kinds were seen */
+static void convert_call_args(
+    jit_function_t function, jit_value_t * args, VALUE args_v,
+    jit_type_t signature, int * flags)
 {
   int j;
 
   for(j = 0; j < RARRAY_LEN(args_v); ++j)
   {
     VALUE value = RARRAY_PTR(args_v)[j];
-    jit_value_t arg;
 
     jit_type_t type = jit_type_get_param(signature, j);
     if(!type)
@@ -601,18 +5877,20 @@ static void convert_call_args(jit_function_t function, jit_value_t * args, VALUE
       rb_raise(rb_eArgError, "Type missing for param %d", j);
     }
 
-    if(rb_obj_is_kind_of(value, rb_cValue))
+    if(FIXNUM_P(value)
+        || rb_obj_is_kind_of(value, rb_cValue)
+        || rb_obj_is_kind_of(value, rb_cHandle))
     {
-      Data_Get_Struct(value, struct _jit_value, arg);
-      if(!arg)
+      args[j] = get_jit_value(function, "argument", value, flags);
+      if(!args[j])
       {
         rb_raise(rb_eArgError, "Argument %d is invalid", j);
       }
-      args[j] = arg;
     }
     else
     {
       args[j] = create_const(function, type, value);
+      raise_memory_error_if_zero(args[j]);
     }
   }
 }
@@ -622,6 +5900,12 @@ static void convert_call_args(jit_function_t function, jit_value_t * args, VALUE
  *   value = function.call(name, called_function, flags, [arg1 [, ... ]])
  *
  * Generate an instruction to call the specified function.
+ *
+ * Each argument is a JIT::Value, a value handle (see param_handle), or
+ * a constant of the type called_function takes (so an Integer
+ * constant must be given with const or const_handle, since a Fixnum
+ * is taken to be a handle).  If every argument is a handle, the
+ * result is a handle.
  */
 static VALUE function_insn_call(int argc, VALUE * argv, VALUE self)
 {
@@ -638,35 +5922,59 @@ static VALUE function_insn_call(int argc, VALUE * argv, VALUE self)
   jit_value_t * args;
   jit_value_t retval;
   int flags;
+  int arg_flags = 0;
   size_t num_args;
 
   rb_scan_args(argc, argv, "3*", &name_v, &called_function_v, &flags_v, &args_v);
 
-  Data_Get_Struct(self, struct _jit_function, function);
+  Get_Function(self, function);
 
   name = StringValuePtr(name_v);
 
   check_type("called function", rb_cFunction, called_function_v);
-  Data_Get_Struct(called_function_v, struct _jit_function, called_function);
+  Get_Function(called_function_v, called_function);
+
+  if(!jit_function_get_meta(called_function, RJT_NAME))
+  {
+    set_function_name(called_function, name);
+  }
+
+  /* The caller's code points into the callee's context, so keep that
+   * context alive for as long as the caller is (once, however many
+   * calls there are) */
+  retain_object(function, (VALUE)jit_function_get_meta(called_function, RJT_CONTEXT));
 
   num_args = RARRAY_LEN(args_v);
   args = ALLOCA_N(jit_value_t, num_args);
 
-  signature = jit_function_get_signature(function);
-  convert_call_args(function, args, args_v, signature);
+  signature = jit_function_get_signature(called_function);
+  if(num_args != jit_type_num_params(signature))
+  {
+    rb_raise(
+        rb_eArgError,
+        "Wrong number of arguments passed for %s (expecting %d but got %ld)",
+        name,
+        jit_type_num_params(signature),
+        (long)num_args);
+  }
+
+  convert_call_args(function, args, args_v, signature, &arg_flags);
 
   flags = NUM2INT(flags_v);
 
+  optimizer_barrier(function);
+  record_unsupported(function);
   retval = jit_insn_call(
       function, name, called_function, 0, args, num_args, flags);
-  return Data_Wrap_Struct(rb_cValue, 0, 0, retval);
+  return wrap_insn_result(function, retval, arg_flags);
 }
 
 /*
  * call-seq:
  *   value = function.call(name, flags, [arg1 [, ... ]])
  *
- * Generate an instruction to call a native function.
+ * Generate an instruction to call a native function.  The arguments
+ * are given as for insn_call.
  */
 static VALUE function_insn_call_native(int argc, VALUE * argv, VALUE self)
 {
@@ -684,11 +5992,12 @@ static VALUE function_insn_call_native(int argc, VALUE * argv, VALUE self)
   void * function_ptr;
   jit_type_t signature;
   int flags;
+  int arg_flags = 0;
   size_t num_args;
 
   rb_scan_args(argc, argv, "4*", &name_v, &function_ptr_v, &signature_v, &flags_v, &args_v);
 
-  Data_Get_Struct(self, struct _jit_function, function);
+  Get_Function(self, function);
   
   if(SYMBOL_P(name_v))
   {
@@ -701,7 +6010,7 @@ static VALUE function_insn_call_native(int argc, VALUE * argv, VALUE self)
 
   function_ptr = (void *)NUM2ULONG(function_ptr_v);
 
-  Data_Get_Struct(signature_v, struct _jit_type, signature);
+  Get_Data(signature_v, type, struct _jit_type, signature);
 
   num_args = RARRAY_LEN(args_v);
   args = ALLOCA_N(jit_value_t, num_args);
@@ -716,13 +6025,77 @@ static VALUE function_insn_call_native(int argc, VALUE * argv, VALUE self)
         num_args);
   }
 
-  convert_call_args(function, args, args_v, signature);
+  convert_call_args(function, args, args_v, signature, &arg_flags);
 
   flags = NUM2INT(flags_v);
 
+  optimizer_barrier(function);
+  record_unsupported(function);
   retval = jit_insn_call_native(
       function, name, function_ptr, signature, args, num_args, flags);
-  return Data_Wrap_Struct(rb_cValue, 0, 0, retval);
+  return wrap_insn_result(function, retval, arg_flags);
+}
+
+/*
+ * call-seq:
+ *   function.insn_check_bounds(index, length)
+ *
+ * Emit a check that 0 <= index < length, which throws libjit's builtin
+ * out-of-bounds exception if it fails.  Function#apply (and the other
+ * ways of calling the function from ruby) raise that as IndexError.
+ */
+static VALUE function_insn_check_bounds(
+    VALUE self, VALUE index_v, VALUE length_v)
+{
+  jit_function_t function;
+  union Program_Operand ops[2];
+  int flags = 0;
+
+  Get_Function(self, function);
+  ops[0].value = get_jit_value(function, "index", index_v, &flags);
+  ops[1].value = get_jit_value(function, "length", length_v, &flags);
+
+  emit_check_bounds(function, ops[0].value, ops[1].value);
+  optimizer_forget(function);
+  record_insn(function, PROGRAM_OP_CHECK_BOUNDS, ops, 0);
+
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   function.insn_jump_table(value, labels)
+ *
+ * Emit an instruction to branch to labels[value], or to fall through
+ * to the next instruction if value (converted to NINT) is not in
+ * 0...labels.length.  The labels may be JIT::Labels or label handles,
+ * and may repeat.
+ */
+static VALUE function_insn_jump_table(VALUE self, VALUE value_v, VALUE labels_v)
+{
+  jit_function_t function;
+  jit_value_t value;
+  jit_label_t * * labels;
+  long num_labels;
+  long j;
+  int flags = 0;
+
+  Get_Function(self, function);
+  value = get_jit_value(function, "value", value_v, &flags);
+
+  Check_Type(labels_v, T_ARRAY);
+  num_labels = RARRAY_LEN(labels_v);
+  labels = ALLOCA_N(jit_label_t *, num_labels);
+  for(j = 0; j < num_labels; ++j)
+  {
+    labels[j] = get_jit_label(function, "label", RARRAY_PTR(labels_v)[j]);
+  }
+
+  emit_jump_table(function, value, labels, num_labels);
+  optimizer_forget(function);
+  record_jump_table(function, value, labels, num_labels);
+
+  return Qnil;
 }
 
 /*
@@ -739,19 +6112,140 @@ static VALUE function_insn_return(int argc, VALUE * argv, VALUE self)
   jit_value_t value = 0;
   VALUE value_v = Qnil;
 
+  int flags = 0;
+
   rb_scan_args(argc, argv, "01", &value_v);
 
+  Get_Function(self, function);
+
   if(value_v != Qnil)
   {
-    Data_Get_Struct(value_v, struct _jit_value, value);
+    value = get_jit_value(function, "value", value_v, &flags);
   }
 
-  Data_Get_Struct(self, struct _jit_function, function);
   jit_insn_return(function, value);
+  record_return(function, value);
 
   return Qnil;
 }
 
+static VALUE apply_function(
+    jit_function_t function,
+    struct Apply_Plan * plan,
+    int argc,
+    VALUE * argv,
+    int release_gvl)
+{
+  int j, n;
+  void * * args;
+
+  n = plan->num_args;
+
+  if(plan->kind == APPLY_PLAN_RUBY_VARARG)
+  {
+    jit_VALUE result;
+    int f_argc = argc - 1;
+    VALUE f_self = *(VALUE *)argv;
+    VALUE * f_argv = ((VALUE *)argv) + 1;
+    void * f_args[3];
+    f_args[0] = &f_argc;
+    f_args[1] = &f_argv;
+    f_args[2] = &f_self;
+    if(!apply_catching(function, f_args, &result))
+    {
+      raise_jit_exception();
+    }
+    return result;
+  }
+
+  if(argc != n)
+  {
+    rb_raise(
+        rb_eArgError,
+        "Wrong number of arguments (expected %d but got %d)",
+        n,
+        argc);
+  }
+
+  /* void pointers to each of the arguments */
+  args = ALLOCA_N(void *, n);
+
+  switch(apply_fast_paths ? plan->kind : APPLY_PLAN_GENERIC)
+  {
+    case APPLY_PLAN_ALL_INT:
+    {
+      jit_int * arg_data = ALLOCA_N(jit_int, n);
+      jit_int result;
+      for(j = 0; j < n; ++j)
+      {
+        arg_data[j] = NUM2INT(argv[j]);
+        args[j] = &arg_data[j];
+      }
+      call_function(function, args, &result, release_gvl);
+      return INT2NUM(result);
+    }
+
+    case APPLY_PLAN_ALL_OBJECT:
+    {
+      /* The arguments are already VALUEs, so they can be passed in
+       * without copying */
+      jit_VALUE result;
+      for(j = 0; j < n; ++j)
+      {
+        args[j] = &argv[j];
+      }
+      if(!apply_catching(function, args, &result))
+      {
+        raise_jit_exception();
+      }
+      return result;
+    }
+
+    default:
+    {
+      char * arg_data;
+      void * result;
+
+      check_apply_plan_supported(plan);
+
+      arg_data = ALLOCA_N(char, plan->arg_data_size);
+      convert_apply_args(plan, argv, args, arg_data);
+
+      result = ALLOCA_N(char, plan->return_size);
+      call_function(function, args, result, release_gvl);
+      return plan->convert_return(result, plan->packed_return_size);
+    }
+  }
+}
+
+/*
+ * call-seq:
+ *   JIT.apply_fast_paths = enabled
+ *
+ * Turn the specialized code that Function#apply uses for all-INT and
+ * all-OBJECT signatures on or off (it is on by default).  When it is
+ * off, every call converts its arguments through the generic plan;
+ * this is only useful for measuring what the fast paths save (see
+ * sample/apply_benchmark.rb).
+ */
+static VALUE jit_s_set_apply_fast_paths(VALUE self, VALUE enabled)
+{
+  apply_fast_paths = RTEST(enabled);
+  return enabled;
+}
+
+/*
+ * call-seq:
+ *   enabled = JIT.apply_fast_paths?
+ *
+ * Determine whether Function#apply uses its fast paths (see
+ * apply_fast_paths=).
+ */
+static VALUE jit_s_apply_fast_paths(VALUE self)
+{
+  return apply_fast_paths ? Qtrue : Qfalse;
+}
+
 /*
  * call-seq:
  *   function.apply(arg1 [, arg2 [, ... ]])
@@ -765,148 +6259,433 @@ static VALUE function_insn_return(int argc, VALUE * argv, VALUE self)
  * containing the second through the last argument, and the third
  * parameter the explicit self (that is, the first argument passed to
  * apply).
+ *
+ * If release_gvl has been set for the function, the call is made
+ * without holding the GVL, as with apply_nogvl.
  */
 static VALUE function_apply(int argc, VALUE * argv, VALUE self)
 {
   jit_function_t function;
-  jit_type_t signature;
-  int j, n;
+  struct Apply_Plan * plan;
+  VALUE context_v;
+  VALUE result;
+
+  Get_Function(self, function);
+  plan = get_apply_plan(function);
+
+  /* Another thread may evict the function while it runs without the
+   * GVL, leaving nothing else to keep its context alive; the context
+   * owns the function's code and its apply plan, which are used until
+   * the call returns */
+  context_v = (VALUE)jit_function_get_meta(function, RJT_CONTEXT);
+  result = apply_function(function, plan, argc, argv, plan->release_gvl);
+  RB_GC_GUARD(context_v);
+  return result;
+}
+
+/*
+ * call-seq:
+ *   function.apply_nogvl(arg1 [, arg2 [, ... ]])
+ *
+ * Call a compiled function as with apply, but without holding the GVL
+ * while the function runs, so other ruby threads (including threads
+ * running other jit functions) can run in parallel.
+ *
+ * The function must not touch any ruby objects; its params and return
+ * type must not be OBJECT or ID, and it must not call back into ruby.
+ * Arguments are converted before the GVL is released, but a String
+ * passed as a pointer must not be modified by another thread while the
+ * call is in progress.  The call cannot be interrupted (e.g. by
+ * Thread#raise) until the function returns.
+ */
+static VALUE function_apply_nogvl(int argc, VALUE * argv, VALUE self)
+{
+  jit_function_t function;
+  struct Apply_Plan * plan;
+  VALUE context_v;
+  VALUE result;
+
+  Get_Function(self, function);
+  plan = get_apply_plan(function);
+  check_apply_plan_gvl_free(function, plan);
+
+  /* See function_apply */
+  context_v = (VALUE)jit_function_get_meta(function, RJT_CONTEXT);
+  result = apply_function(function, plan, argc, argv, 1);
+  RB_GC_GUARD(context_v);
+  return result;
+}
+
+/*
+ * call-seq:
+ *   release_gvl = function.release_gvl
+ *
+ * Determine whether apply, apply_into and apply_many release the GVL
+ * while calling the function.
+ */
+static VALUE function_release_gvl(VALUE self)
+{
+  jit_function_t function;
+  Get_Function(self, function);
+  return get_apply_plan(function)->release_gvl ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   function.release_gvl = true
+ *
+ * Mark a function as safe to call without the GVL (see apply_nogvl), so
+ * that apply, apply_into and apply_many release the GVL while calling
+ * it.  Raises TypeError if the function's signature uses OBJECT or ID.
+ */
+static VALUE function_set_release_gvl(VALUE self, VALUE release_gvl)
+{
+  jit_function_t function;
+  struct Apply_Plan * plan;
+  Get_Function(self, function);
+  plan = get_apply_plan(function);
+  if(RTEST(release_gvl))
+  {
+    check_apply_plan_gvl_free(function, plan);
+  }
+  plan->release_gvl = RTEST(release_gvl);
+  return release_gvl;
+}
+
+/*
+ * call-seq:
+ *   buffer = function.apply_into(buffer, arg1 [, arg2 [, ... ]])
+ *
+ * Call a compiled function as with apply, but write the raw result
+ * into +buffer+ (a String at least as large as the return type)
+ * instead of converting it to a new Ruby object.  This is useful for
+ * functions that return floats or structs (such as those described by
+ * a JIT::Struct) when called in a tight loop, since the same buffer can
+ * be reused for every call.
+ *
+ * Returns +buffer+.
+ */
+static VALUE function_apply_into(int argc, VALUE * argv, VALUE self)
+{
+  jit_function_t function;
+  struct Apply_Plan * plan;
+  VALUE context_v;
+  VALUE buffer_v;
   void * * args;
   char * arg_data;
-  int signature_tag;
+  void * result;
 
-  Data_Get_Struct(self, struct _jit_function, function);
-  signature = jit_function_get_signature(function);
-  n = jit_type_num_params(signature);
+  if(argc < 1)
+  {
+    rb_raise(rb_eArgError, "Wrong number of arguments (expected a buffer)");
+  }
 
-  /* void pointers to each of the arguments */
-  args = ALLOCA_N(void *, n);
+  buffer_v = argv[0];
+  ++argv;
+  --argc;
+
+  Get_Function(self, function);
+  plan = get_apply_plan(function);
+
+  if(plan->kind == APPLY_PLAN_RUBY_VARARG)
+  {
+    rb_raise(rb_eTypeError, "apply_into does not support RUBY_VARARG_SIGNATURE");
+  }
+
+  if(argc != plan->num_args)
+  {
+    rb_raise(
+        rb_eArgError,
+        "Wrong number of arguments (expected %d but got %d)",
+        plan->num_args,
+        argc);
+  }
+
+  check_apply_plan_supported(plan);
+
+  if(plan->return_kind == JIT_TYPE_FIRST_TAGGED + RJT_OBJECT)
+  {
+    rb_raise(rb_eTypeError, "Cannot write an OBJECT result into a buffer");
+  }
+
+  Check_Type(buffer_v, T_STRING);
+  rb_str_modify(buffer_v);
+  if((size_t)RSTRING_LEN(buffer_v) < plan->packed_return_size)
+  {
+    rb_raise(
+        rb_eArgError,
+        "Buffer too small (need %ld bytes but got %ld)",
+        (long)plan->packed_return_size,
+        (long)RSTRING_LEN(buffer_v));
+  }
+
+  args = ALLOCA_N(void *, plan->num_args);
+  arg_data = ALLOCA_N(char, plan->arg_data_size);
+  result = ALLOCA_N(char, plan->return_size);
+
+  /* See function_apply */
+  context_v = (VALUE)jit_function_get_meta(function, RJT_CONTEXT);
+  convert_apply_args(plan, argv, args, arg_data);
+  call_function(function, args, result, plan->release_gvl);
+  memcpy(RSTRING_PTR(buffer_v), result, plan->packed_return_size);
+  RB_GC_GUARD(context_v);
+
+  return buffer_v;
+}
+
+struct Packed_Batch
+{
+  jit_function_t function;
+  struct Apply_Plan * plan;
+  char * rows;
+  char * output;
+  long num_rows;
+  void * * args;
+  void * result;
+  int ok;  /* cleared if a row throws an exception */
+};
+
+static void * apply_packed_batch(void * batch_ptr)
+{
+  struct Packed_Batch * batch = (struct Packed_Batch *)batch_ptr;
+  struct Apply_Plan * plan = batch->plan;
+  long j;
+  int k;
+
+  for(j = 0; j < batch->num_rows; ++j)
+  {
+    char * row = batch->rows + j * plan->packed_row_size;
+    for(k = 0; k < plan->num_args; ++k)
+    {
+      batch->args[k] = row + plan->args[k].packed_offset;
+    }
+
+    if(!apply_catching(batch->function, batch->args, batch->result))
+    {
+      batch->ok = 0;
+      break;
+    }
+
+    memcpy(
+        batch->output + j * plan->packed_return_size,
+        batch->result,
+        plan->packed_return_size);
+  }
+
+  return 0;
+}
+
+/*
+ * call-seq:
+ *   results = function.apply_many(array_of_arg_arrays)
+ *   results = function.apply_many(array_of_arg_arrays, output)
+ *   results = function.apply_many(packed_string)
+ *   results = function.apply_many(packed_string, output)
+ *
+ * Call a compiled function once for each row of arguments, looping in
+ * C rather than in Ruby.
+ *
+ * The rows may be given either as an Array of argument Arrays (each
+ * converted as by apply) or as a packed binary String, in which each
+ * row is laid out like a C struct whose fields are the function's
+ * parameters.
+ *
+ * Results are written into +output+, which may be an Array (one
+ * element per row) or a String (one packed return value per row, which
+ * must be large enough to hold all the results).  If +output+ is not
+ * given, a new Array is returned for Array input and a new String for
+ * packed input.
+ *
+ * Functions that take or return OBJECT cannot be used with packed
+ * strings.
+ *
+ * If release_gvl has been set for the function and both the rows and
+ * the output are packed strings, the whole batch runs without the GVL;
+ * neither string may be modified by another thread in the meantime.
+ */
+static VALUE function_apply_many(int argc, VALUE * argv, VALUE self)
+{
+  VALUE rows_v;
+  VALUE output_v = Qnil;
+
+  jit_function_t function;
+  struct Apply_Plan * plan;
+  VALUE context_v;
+  int n;
+  long j, num_rows;
+  int packed_input;
+  int packed_output;
+  void * * args;
+  char * arg_data;
+  void * result;
+  VALUE * row_args;
+
+  rb_scan_args(argc, argv, "11", &rows_v, &output_v);
+
+  Get_Function(self, function);
+  plan = get_apply_plan(function);
+  n = plan->num_args;
+
+  if(plan->kind == APPLY_PLAN_RUBY_VARARG)
+  {
+    rb_raise(rb_eTypeError, "apply_many does not support RUBY_VARARG_SIGNATURE");
+  }
 
-  /* the actual data */
-  /* TODO: we need to allocate the proper size (but 8 bytes per arg
-   * should be sufficient for now) */
-  arg_data = (char *)ALLOCA_N(char, 8 * n);
+  check_apply_plan_supported(plan);
 
-  signature_tag = (int)jit_function_get_meta(function, RJT_TAG_FOR_SIGNATURE);
-  if(signature_tag == JIT_TYPE_FIRST_TAGGED + RJT_RUBY_VARARG_SIGNATURE)
+  if(TYPE(rows_v) == T_STRING)
   {
-    jit_VALUE result;
-    int f_argc = argc - 1;
-    VALUE f_self = *(VALUE *)argv;
-    VALUE * f_argv = ((VALUE *)argv) + 1;
-    void * f_args[3];
-    f_args[0] = &f_argc;
-    f_args[1] = &f_argv;
-    f_args[2] = &f_self;
-    jit_function_apply(function, f_args, &result);
-    return result;
+    packed_input = 1;
+    if(plan->packed_row_size == 0)
+    {
+      rb_raise(rb_eArgError, "Cannot use a packed string for a function with no parameters");
+    }
+    if(RSTRING_LEN(rows_v) % plan->packed_row_size != 0)
+    {
+      rb_raise(
+          rb_eArgError,
+          "Packed string length %ld is not a multiple of the row size %ld",
+          (long)RSTRING_LEN(rows_v),
+          (long)plan->packed_row_size);
+    }
+    num_rows = RSTRING_LEN(rows_v) / plan->packed_row_size;
+  }
+  else
+  {
+    Check_Type(rows_v, T_ARRAY);
+    packed_input = 0;
+    num_rows = RARRAY_LEN(rows_v);
   }
 
-  if(argc != n)
+  if(NIL_P(output_v))
   {
-    rb_raise(
-        rb_eArgError,
-        "Wrong number of arguments (expected %d but got %d)",
-        n,
-        argc);
+    output_v = packed_input
+      ? rb_str_new(0, num_rows * plan->packed_return_size)
+      : rb_ary_new2(num_rows);
   }
 
-  for(j = 0; j < n; ++j)
+  if(TYPE(output_v) == T_STRING)
   {
-    jit_type_t arg_type = jit_type_get_param(signature, j);
-    int kind = jit_type_get_kind(arg_type);
-    switch(kind)
+    packed_output = 1;
+    rb_str_modify(output_v);
+    if((size_t)RSTRING_LEN(output_v) < num_rows * plan->packed_return_size)
     {
-      case JIT_TYPE_INT:
-      {
-        *(int *)arg_data = NUM2INT(argv[j]);
-        args[j] = (int *)arg_data;
-        arg_data += sizeof(int);
-        break;
-      }
-
-      case JIT_TYPE_UINT:
-      {
-        *(int *)arg_data = NUM2UINT(argv[j]);
-        args[j] = (int *)arg_data;
-        arg_data += sizeof(int);
-        break;
-      }
+      rb_raise(
+          rb_eArgError,
+          "Output string too small (need %ld bytes but got %ld)",
+          (long)(num_rows * plan->packed_return_size),
+          (long)RSTRING_LEN(output_v));
+    }
+  }
+  else
+  {
+    Check_Type(output_v, T_ARRAY);
+    packed_output = 0;
+  }
 
-      case JIT_TYPE_FIRST_TAGGED + RJT_OBJECT:
-      {
-        *(VALUE *)arg_data = argv[j];
-        args[j] = (VALUE *)arg_data;
-        arg_data += sizeof(VALUE);
-        break;
-      }
+  if((packed_input || packed_output) && !plan->packable)
+  {
+    rb_raise(rb_eTypeError, "Cannot pack OBJECT arguments or results into a string");
+  }
 
-      case JIT_TYPE_FIRST_TAGGED + RJT_ID:
-      {
-        *(ID *)arg_data = SYM2ID(argv[j]);
-        args[j] = (ID *)arg_data;
-        arg_data += sizeof(ID);
-        break;
-      }
+  args = ALLOCA_N(void *, n);
+  arg_data = ALLOCA_N(char, plan->arg_data_size);
+  result = ALLOCA_N(char, plan->return_size);
+  row_args = ALLOCA_N(VALUE, n);
 
-      case JIT_TYPE_FIRST_TAGGED + RJT_FUNCTION_PTR:
-      {
-        *(Void_Function_Ptr *)arg_data =
-          (Void_Function_Ptr)NUM2ULONG(rb_to_int(argv[j]));
-        args[j] = (Void_Function_Ptr *)(arg_data);
-        arg_data += sizeof(Void_Function_Ptr);
-        break;
-      }
+  /* See function_apply */
+  context_v = (VALUE)jit_function_get_meta(function, RJT_CONTEXT);
 
-      default:
-        rb_raise(rb_eTypeError, "Unsupported type %d", kind);
+  if(packed_input && packed_output && plan->release_gvl)
+  {
+    /* Nothing in the loop touches a ruby object, so run the whole
+     * batch without the GVL */
+    struct Packed_Batch batch;
+    batch.function = function;
+    batch.plan = plan;
+    batch.rows = RSTRING_PTR(rows_v);
+    batch.output = RSTRING_PTR(output_v);
+    batch.num_rows = num_rows;
+    batch.args = args;
+    batch.result = result;
+    batch.ok = 1;
+    call_without_gvl(apply_packed_batch, &batch);
+    RB_GC_GUARD(context_v);
+    if(!batch.ok)
+    {
+      raise_jit_exception();
     }
+    return output_v;
   }
 
+  for(j = 0; j < num_rows; ++j)
   {
-    jit_type_t return_type = jit_type_get_return(signature);
-    int return_kind = jit_type_get_kind(return_type);
-    switch(return_kind)
+    int k;
+
+    /* Earlier calls run ruby code (converting results, and whatever
+     * the function calls), which may have modified the rows or the
+     * output, so check them again and look up their buffers again for
+     * each row */
+    if(packed_input)
     {
-      case JIT_TYPE_INT:
+      char * row;
+      if((size_t)RSTRING_LEN(rows_v) < (j + 1) * plan->packed_row_size)
       {
-        jit_int result;
-        jit_function_apply(function, args, &result);
-        return INT2NUM(result);
+        rb_raise(rb_eRuntimeError, "Rows string was modified during apply_many");
       }
-
-      case JIT_TYPE_FLOAT32:
+      row = RSTRING_PTR(rows_v) + j * plan->packed_row_size;
+      for(k = 0; k < n; ++k)
       {
-        jit_float32 result;
-        jit_function_apply(function, args, &result);
-        return rb_float_new(result);
+        args[k] = row + plan->args[k].packed_offset;
       }
-
-      case JIT_TYPE_FLOAT64:
+    }
+    else
+    {
+      VALUE row_v;
+      if(j >= RARRAY_LEN(rows_v))
       {
-        jit_float64 result;
-        jit_function_apply(function, args, &result);
-        return rb_float_new(result);
+        rb_raise(rb_eRuntimeError, "Rows array was modified during apply_many");
       }
-
-      case JIT_TYPE_FIRST_TAGGED + RJT_OBJECT:
+      row_v = rb_ary_entry(rows_v, j);
+      Check_Type(row_v, T_ARRAY);
+      if(RARRAY_LEN(row_v) != n)
       {
-        jit_VALUE result;
-        jit_function_apply(function, args, &result);
-        return result;
+        rb_raise(
+            rb_eArgError,
+            "Wrong number of arguments in row %ld (expected %d but got %ld)",
+            j,
+            n,
+            (long)RARRAY_LEN(row_v));
       }
-
-      case JIT_TYPE_FIRST_TAGGED + RJT_ID:
+      /* Copy the row, since converting an argument may run ruby code */
+      for(k = 0; k < n; ++k)
       {
-        jit_ID result;
-        jit_function_apply(function, args, &result);
-        return ID2SYM(result);
+        row_args[k] = rb_ary_entry(row_v, k);
       }
+      convert_apply_args(plan, row_args, args, arg_data);
+    }
+
+    call_function(function, args, result, plan->release_gvl);
 
-      default:
-        rb_raise(rb_eTypeError, "Unsupported return type %d", return_kind);
+    if(packed_output)
+    {
+      if((size_t)RSTRING_LEN(output_v) < (j + 1) * plan->packed_return_size)
+      {
+        rb_raise(rb_eRuntimeError, "Output string was modified during apply_many");
+      }
+      memcpy(
+          RSTRING_PTR(output_v) + j * plan->packed_return_size,
+          result,
+          plan->packed_return_size);
+    }
+    else
+    {
+      rb_ary_store(output_v, j, plan->convert_return(result, plan->packed_return_size));
     }
   }
+
+  RB_GC_GUARD(context_v);
+  return output_v;
 }
 
 /*
@@ -918,7 +6697,7 @@ static VALUE function_apply(int argc, VALUE * argv, VALUE self)
 static VALUE function_optimization_level(VALUE self)
 {
   jit_function_t function;
-  Data_Get_Struct(self, struct _jit_function, function);
+  Get_Function(self, function);
   return INT2NUM(jit_function_get_optimization_level(function));
 }
 
@@ -931,7 +6710,7 @@ static VALUE function_optimization_level(VALUE self)
 static VALUE function_set_optimization_level(VALUE self, VALUE level)
 {
   jit_function_t function;
-  Data_Get_Struct(self, struct _jit_function, function);
+  Get_Function(self, function);
   jit_function_set_optimization_level(function, NUM2INT(level));
   return level;
 }
@@ -960,7 +6739,7 @@ static VALUE function_dump(VALUE self)
   jit_function_t function;
   char buf[16*1024]; /* TODO: big enough? */
   FILE * fp = fmemopen(buf, sizeof(buf), "w");
-  Data_Get_Struct(self, struct _jit_function, function);
+  Get_Function(self, function);
   jit_dump_function(fp, function, 0);
   fclose(fp);
   return rb_str_new2(buf);
@@ -980,10 +6759,13 @@ static VALUE function_to_closure(VALUE self)
 {
   jit_function_t function;
   struct Closure * closure;
-  VALUE closure_v = Data_Make_Struct(
-      rb_cClosure, struct Closure, mark_closure, free, closure);
-  Data_Get_Struct(self, struct _jit_function, function);
-  closure->function = self;
+  VALUE closure_v = Make_Data(
+      rb_cClosure, struct Closure, closure, closure);
+  Get_Function(self, function);
+  RB_OBJ_WRITE(closure_v, &closure->function, self);
+  RB_OBJ_WRITE(
+      closure_v, &closure->context,
+      (VALUE)jit_function_get_meta(function, RJT_CONTEXT));
   closure->function_ptr =
     (Void_Function_Ptr)jit_function_to_closure(function);
   return closure_v;
@@ -998,7 +6780,7 @@ static VALUE function_to_closure(VALUE self)
 static VALUE function_get_context(VALUE self)
 {
   jit_function_t function;
-  Data_Get_Struct(self, struct _jit_function, function);
+  Get_Function(self, function);
   return (VALUE)jit_function_get_meta(function, RJT_CONTEXT);
 }
 
@@ -1006,12 +6788,13 @@ static VALUE function_get_context(VALUE self)
  * call-seq:
  *   is_compiled = function.compiled?
  *
- * Determine whether a function is compiled.
+ * Determine whether a function is compiled.  A function created with
+ * Function.compile_lazy is not compiled until it is first used.
  */
 static VALUE function_is_compiled(VALUE self)
 {
   jit_function_t function;
-  Data_Get_Struct(self, struct _jit_function, function);
+  Get_Function(self, function);
   return jit_function_is_compiled(function) ? Qtrue : Qfalse;
 }
 
@@ -1025,7 +6808,7 @@ static VALUE function_is_compiled(VALUE self)
  * wrapped object will take ownership. */
 static VALUE wrap_type_with_klass(jit_type_t type, VALUE klass)
 {
-  return Data_Wrap_Struct(klass, 0, jit_type_free, type);
+  return Wrap_Data(klass, type, type);
 }
 
 static VALUE wrap_type(jit_type_t type)
@@ -1033,6 +6816,92 @@ static VALUE wrap_type(jit_type_t type)
   return wrap_type_with_klass(type, rb_cType);
 }
 
+/* Get the interned (or predefined) type object for a libjit type, or
+ * nil if there is none */
+static VALUE find_type_by_pointer(jit_type_t type)
+{
+  VALUE key = ULONG2NUM((unsigned long)type);
+#ifdef TYPES_BY_POINTER_ARE_WEAK
+  return rb_funcall(types_by_pointer, rb_intern("[]"), 1, key);
+#else
+  return rb_hash_aref(types_by_pointer, key);
+#endif
+}
+
+static void add_type_by_pointer(jit_type_t type, VALUE type_v)
+{
+  VALUE key = ULONG2NUM((unsigned long)type);
+#ifdef TYPES_BY_POINTER_ARE_WEAK
+  rb_funcall(types_by_pointer, rb_intern("[]="), 2, key, type_v);
+#else
+  rb_hash_aset(types_by_pointer, key, type_v);
+#endif
+}
+
+/* Signature, pointer and struct types are interned: creating a type
+ * that is the same as one created before returns the same object, so
+ * types can be compared and hashed by identity.  A type is the same if
+ * it was created the same way from the same (interned) types.
+ *
+ * An interned type is filed in a hash kept by the last type in its key
+ * that is not predefined, so that it can be freed along with that type
+ * (its entry keeps the other types in the key alive until then).  A
+ * type made only from predefined types is filed in interned_types and
+ * is never freed. */
+static VALUE interned_types_for_key(VALUE key, int create)
+{
+  long j;
+
+  for(j = RARRAY_LEN(key) - 1; j >= 0; --j)
+  {
+    VALUE part = RARRAY_PTR(key)[j];
+    VALUE table;
+
+    if(!rb_obj_is_kind_of(part, rb_cType)
+        || RTEST(rb_hash_aref(predefined_types, part)))
+    {
+      continue;
+    }
+
+    table = rb_ivar_defined(part, id_interned_types)
+      ? rb_ivar_get(part, id_interned_types)
+      : Qnil;
+    if(NIL_P(table) && create)
+    {
+      table = rb_hash_new();
+      rb_ivar_set(part, id_interned_types, table);
+    }
+    return table;
+  }
+
+  return interned_types;
+}
+
+static VALUE find_interned_type(VALUE key)
+{
+  VALUE table = interned_types_for_key(key, 0);
+  return NIL_P(table) ? Qnil : rb_hash_aref(table, key);
+}
+
+/* Takes ownership of type, like wrap_type_with_klass */
+static VALUE intern_type(VALUE key, jit_type_t type, VALUE klass)
+{
+  VALUE type_v = wrap_type_with_klass(type, klass);
+  rb_hash_aset(interned_types_for_key(key, 1), key, type_v);
+  add_type_by_pointer(type, type_v);
+  return type_v;
+}
+
+/* Wrap one of the predefined types, so values of that type report it
+ * as their type (see Value#type) */
+static VALUE wrap_type_const(jit_type_t type)
+{
+  VALUE type_v = wrap_type(type);
+  rb_hash_aset(predefined_types, type_v, Qtrue);
+  add_type_by_pointer(type, type_v);
+  return type_v;
+}
+
 /*
  * call-seq:
  *   type = Type._create_signature(abi, return_type, array_of_param_types)
@@ -1046,45 +6915,65 @@ static VALUE type_s_create_signature(
   jit_type_t return_type;
   jit_type_t * params;
   jit_type_t signature;
+  VALUE key;
+  VALUE signature_v;
   int j;
   int len;
 
   return_type_v = lookup_const(rb_cType, return_type_v);
   check_type("return type", rb_cType, return_type_v);
-  Data_Get_Struct(return_type_v, struct _jit_type, return_type);
+  Get_Data(return_type_v, type, struct _jit_type, return_type);
+
+  abi_v = lookup_const(rb_mABI, abi_v);
+  abi = NUM2INT(abi_v);
 
   Check_Type(params_v, T_ARRAY);
   len = RARRAY_LEN(params_v);
   params = ALLOCA_N(jit_type_t, len);
+  key = rb_ary_new2(len + 3);
+  rb_ary_push(key, ID2SYM(rb_intern("signature")));
+  rb_ary_push(key, INT2NUM(abi));
+  rb_ary_push(key, return_type_v);
   for(j = 0; j < len; ++j)
   {
     VALUE param = RARRAY_PTR(params_v)[j];
     param = lookup_const(rb_cType, param);
     check_type("param", rb_cType, param);
-    Data_Get_Struct(param, struct _jit_type, params[j]);
+    Get_Data(param, type, struct _jit_type, params[j]);
+    rb_ary_push(key, param);
   }
 
-  abi_v = lookup_const(rb_mABI, abi_v);
-  abi = NUM2INT(abi_v);
+  if(!NIL_P(signature_v = find_interned_type(key)))
+  {
+    return signature_v;
+  }
 
   signature = jit_type_create_signature(abi, return_type, params, len, 1);
-  return wrap_type(signature);
+  return intern_type(key, signature, rb_cType);
 }
 
 /*
  * call-seq:
  *   type = Type.create_struct(array_of_field_types)
+ *   type = Type.create_struct(array_of_field_types, intern)
  *
- * Create a new struct type.
+ * Create a new struct type.  Unless intern is false, the type is
+ * interned (so the same fields give the same type), and its layout
+ * cannot be changed with set_offset.
  */
-static VALUE type_s_create_struct(
-    VALUE klass, VALUE fields_v)
+static VALUE type_s_create_struct(int argc, VALUE * argv, VALUE klass)
 {
+  VALUE fields_v;
+  VALUE intern_v;
+  VALUE key = Qnil;
+  VALUE struct_type_v;
   jit_type_t * fields;
   jit_type_t struct_type;
   int len;
   int j;
 
+  rb_scan_args(argc, argv, "11", &fields_v, &intern_v);
+
   Check_Type(fields_v, T_ARRAY);
   len = RARRAY_LEN(fields_v);
   fields = ALLOCA_N(jit_type_t, len);
@@ -1092,11 +6981,28 @@ static VALUE type_s_create_struct(
   {
     VALUE field = RARRAY_PTR(fields_v)[j];
     check_type("field", rb_cType, field);
-    Data_Get_Struct(field, struct _jit_type, fields[j]);
+    Get_Data(field, type, struct _jit_type, fields[j]);
+  }
+
+  if(argc < 2 || RTEST(intern_v))
+  {
+    key = rb_ary_new2(len + 2);
+    rb_ary_push(key, ID2SYM(rb_intern("struct")));
+    rb_ary_push(key, klass);
+    rb_ary_concat(key, fields_v);
+
+    if(!NIL_P(struct_type_v = find_interned_type(key)))
+    {
+      return struct_type_v;
+    }
   }
 
   struct_type = jit_type_create_struct(fields, len, 1);
-  return wrap_type_with_klass(struct_type, klass);
+  if(NIL_P(key))
+  {
+    return wrap_type_with_klass(struct_type, klass);
+  }
+  return intern_type(key, struct_type, klass);
 }
 
 /*
@@ -1110,9 +7016,75 @@ static VALUE type_s_create_pointer(
 {
   jit_type_t type;
   jit_type_t pointer_type;
-  Data_Get_Struct(type_v, struct _jit_type, type);
+  VALUE key;
+  VALUE pointer_type_v;
+
+  type_v = lookup_const(rb_cType, type_v);
+  check_type("type", rb_cType, type_v);
+  Get_Data(type_v, type, struct _jit_type, type);
+
+  key = rb_ary_new3(3, ID2SYM(rb_intern("pointer")), klass, type_v);
+  if(!NIL_P(pointer_type_v = find_interned_type(key)))
+  {
+    return pointer_type_v;
+  }
+
   pointer_type = jit_type_create_pointer(type, 1);
-  return wrap_type_with_klass(pointer_type, klass);
+  return intern_type(key, pointer_type, klass);
+}
+
+/*
+ * call-seq:
+ *   type = Type.create_array(element_type, length)
+ *
+ * Create a new fixed-length array type.  The type is a struct with a
+ * single field, the first element, whose size is that of length
+ * elements, so the type description is the same size however long
+ * the array is.  The element at index i is at offset i * stride, where
+ * stride is the size of the element type.
+ */
+static VALUE type_s_create_array(
+    VALUE klass, VALUE type_v, VALUE length_v)
+{
+  jit_type_t type;
+  jit_type_t array_type;
+  jit_nuint stride;
+  long length = NUM2LONG(length_v);
+  VALUE key;
+  VALUE array_type_v;
+
+  type_v = lookup_const(rb_cType, type_v);
+  check_type("element type", rb_cType, type_v);
+  Get_Data(type_v, type, struct _jit_type, type);
+
+  if(length < 0)
+  {
+    rb_raise(rb_eArgError, "negative array length");
+  }
+
+  stride = jit_type_get_size(type);
+  if(stride != 0 && (jit_nuint)length > (jit_nuint)LONG_MAX / stride)
+  {
+    rb_raise(rb_eArgError, "array too large");
+  }
+
+  key = rb_ary_new3(
+      4, ID2SYM(rb_intern("array")), klass, type_v, LONG2NUM(length));
+  if(!NIL_P(array_type_v = find_interned_type(key)))
+  {
+    return array_type_v;
+  }
+
+  array_type = jit_type_create_struct(&type, 1, 1);
+  if(!array_type)
+  {
+    rb_raise(rb_eNoMemError, "Out of memory");
+  }
+  jit_type_set_size_and_alignment(
+      array_type,
+      (jit_nint)(stride * length),
+      (jit_nint)jit_type_get_alignment(type));
+  return intern_type(key, array_type, klass);
 }
 
 /*
@@ -1125,7 +7097,7 @@ static VALUE type_get_offset(VALUE self, VALUE field_index_v)
 {
   int field_index = NUM2INT(field_index_v);
   jit_type_t type;
-  Data_Get_Struct(self, struct _jit_type, type);
+  Get_Data(self, type, struct _jit_type, type);
   return INT2NUM(jit_type_get_offset(type, field_index));
 }
 
@@ -1140,7 +7112,13 @@ static VALUE type_set_offset(VALUE self, VALUE field_index_v, VALUE offset_v)
   int field_index = NUM2INT(field_index_v);
   int offset = NUM2UINT(offset_v);
   jit_type_t type;
-  Data_Get_Struct(self, struct _jit_type, type);
+  Get_Data(self, type, struct _jit_type, type);
+  if(!NIL_P(find_type_by_pointer(type)))
+  {
+    rb_raise(
+        rb_eTypeError,
+        "Cannot change the layout of an interned type (see Type.create_struct)");
+  }
   jit_type_set_offset(type, field_index, offset);
   return Qnil;
 }
@@ -1154,7 +7132,7 @@ static VALUE type_set_offset(VALUE self, VALUE field_index_v, VALUE offset_v)
 static VALUE type_size(VALUE self)
 {
   jit_type_t type;
-  Data_Get_Struct(self, struct _jit_type, type);
+  Get_Data(self, type, struct _jit_type, type);
   return INT2NUM(jit_type_get_size(type));
 }
 
@@ -1181,7 +7159,7 @@ static VALUE value_to_s(VALUE self)
   FILE * fp = fmemopen(buf, sizeof(buf), "w");
   jit_value_t value;
   jit_function_t function;
-  Data_Get_Struct(self, struct _jit_value, value);
+  Get_Data(self, value, struct _jit_value, value);
   function = jit_value_get_function(value);
   jit_dump_value(fp, function, value, 0);
   fclose(fp);
@@ -1204,7 +7182,7 @@ static VALUE value_inspect(VALUE self)
   jit_type_t type;
   char const * cname = rb_obj_classname(self);
   VALUE args[6];
-  Data_Get_Struct(self, struct _jit_value, value);
+  Get_Data(self, value, struct _jit_value, value);
   type = jit_value_get_type(value);
   args[0] = rb_str_new2("#<%s:0x%x %s ptr=0x%x type=0x%x>");
   args[1] = rb_str_new2(cname);
@@ -1224,7 +7202,7 @@ static VALUE value_inspect(VALUE self)
 static VALUE value_is_valid(VALUE self)
 {
   jit_value_t value;
-  Data_Get_Struct(self, struct _jit_value, value);
+  Get_Data(self, value, struct _jit_value, value);
   return (value != 0) ? Qtrue : Qfalse;
 }
 
@@ -1237,7 +7215,7 @@ static VALUE value_is_valid(VALUE self)
 static VALUE value_is_temporary(VALUE self)
 {
   jit_value_t value;
-  Data_Get_Struct(self, struct _jit_value, value);
+  Get_Data(self, value, struct _jit_value, value);
   return jit_value_is_temporary(value) ? Qtrue : Qfalse;
 }
 
@@ -1250,7 +7228,7 @@ static VALUE value_is_temporary(VALUE self)
 static VALUE value_is_local(VALUE self)
 {
   jit_value_t value;
-  Data_Get_Struct(self, struct _jit_value, value);
+  Get_Data(self, value, struct _jit_value, value);
   return jit_value_is_local(value) ? Qtrue : Qfalse;
 }
 
@@ -1263,10 +7241,57 @@ static VALUE value_is_local(VALUE self)
 static VALUE value_is_constant(VALUE self)
 {
   jit_value_t value;
-  Data_Get_Struct(self, struct _jit_value, value);
+  Get_Data(self, value, struct _jit_value, value);
   return jit_value_is_constant(value) ? Qtrue : Qfalse;
 }
 
+/*
+ * call-seq:
+ *   c = value.constant_value
+ *
+ * Get the value of a constant of an integer or floating point type, or
+ * nil if the value is not such a constant.
+ */
+static VALUE value_constant_value(VALUE self)
+{
+  jit_value_t value;
+  Get_Data(self, value, struct _jit_value, value);
+
+  if(!jit_value_is_constant(value))
+  {
+    return Qnil;
+  }
+
+  switch(jit_type_get_kind(jit_value_get_type(value)))
+  {
+    case JIT_TYPE_SBYTE:
+    case JIT_TYPE_UBYTE:
+    case JIT_TYPE_SHORT:
+    case JIT_TYPE_USHORT:
+    case JIT_TYPE_INT:
+    case JIT_TYPE_NINT:
+      return LONG2NUM(jit_value_get_nint_constant(value));
+
+    case JIT_TYPE_UINT:
+    case JIT_TYPE_NUINT:
+      return ULONG2NUM((jit_nuint)jit_value_get_nint_constant(value));
+
+    case JIT_TYPE_LONG:
+      return LL2NUM(jit_value_get_long_constant(value));
+
+    case JIT_TYPE_ULONG:
+      return ULL2NUM((jit_ulong)jit_value_get_long_constant(value));
+
+    case JIT_TYPE_FLOAT32:
+    case JIT_TYPE_FLOAT64:
+    case JIT_TYPE_NFLOAT:
+      return rb_float_new(jit_value_get_float64_constant(value));
+
+    default:
+      return Qnil;
+  }
+}
+
 /*
  * call-seq:
  *   is_volatile = value.volatile?
@@ -1277,7 +7302,7 @@ static VALUE value_is_constant(VALUE self)
 static VALUE value_is_volatile(VALUE self)
 {
   jit_value_t value;
-  Data_Get_Struct(self, struct _jit_value, value);
+  Get_Data(self, value, struct _jit_value, value);
   return jit_value_is_volatile(value) ? Qtrue : Qfalse;
 }
 
@@ -1291,7 +7316,7 @@ static VALUE value_is_volatile(VALUE self)
 static VALUE value_set_volatile(VALUE self)
 {
   jit_value_t value;
-  Data_Get_Struct(self, struct _jit_value, value);
+  Get_Data(self, value, struct _jit_value, value);
   jit_value_set_volatile(value);
   return Qnil;
 }
@@ -1305,7 +7330,7 @@ static VALUE value_set_volatile(VALUE self)
 static VALUE value_is_addressable(VALUE self)
 {
   jit_value_t value;
-  Data_Get_Struct(self, struct _jit_value, value);
+  Get_Data(self, value, struct _jit_value, value);
   return jit_value_is_addressable(value) ? Qtrue : Qfalse;
 }
 
@@ -1318,7 +7343,7 @@ static VALUE value_is_addressable(VALUE self)
 static VALUE value_set_addressable(VALUE self)
 {
   jit_value_t value;
-  Data_Get_Struct(self, struct _jit_value, value);
+  Get_Data(self, value, struct _jit_value, value);
   jit_value_set_addressable(value);
   return Qnil;
 }
@@ -1333,9 +7358,9 @@ static VALUE value_function(VALUE self)
 {
   jit_value_t value;
   jit_function_t function;
-  Data_Get_Struct(self, struct _jit_value, value);
+  Get_Data(self, value, struct _jit_value, value);
   function = jit_value_get_function(value);
-  return Data_Wrap_Struct(rb_cFunction, mark_function, 0, function);
+  return function_object(function);
 }
 
 /*
@@ -1348,8 +7373,17 @@ static VALUE value_type(VALUE self)
 {
   jit_value_t value;
   jit_type_t type;
-  Data_Get_Struct(self, struct _jit_value, value);
+  VALUE type_v;
+  Get_Data(self, value, struct _jit_value, value);
   type = jit_value_get_type(value);
+
+  /* Return the interned type, if this is one */
+  type_v = find_type_by_pointer(type);
+  if(!NIL_P(type_v))
+  {
+    return type_v;
+  }
+
   type = jit_type_copy(type);
   return wrap_type(type);
 }
@@ -1386,7 +7420,7 @@ static VALUE value_coerce(VALUE self, VALUE value)
 static VALUE label_s_new(VALUE klass)
 {
   jit_label_t * label;
-  VALUE labelval = Data_Make_Struct(rb_cLabel, jit_label_t, 0, xfree, label);
+  VALUE labelval = Make_Data(rb_cLabel, jit_label_t, label, label);
   *label = jit_label_undefined;
   return labelval;
 }
@@ -1396,6 +7430,37 @@ static VALUE label_s_new(VALUE klass)
  * ---------------------------------------------------------------------------
  */
 
+/* Forget the closure for a jit method, so it (and, once nothing else
+ * refers to it, its function's context) can be reclaimed */
+static void forget_jit_method(VALUE key)
+{
+  VALUE closure_v = rb_hash_delete(jit_methods, key);
+  struct Closure * closure;
+  jit_function_t function;
+  VALUE methods;
+
+  if(NIL_P(closure_v))
+  {
+    return;
+  }
+
+  Get_Data(closure_v, closure, struct Closure, closure);
+  Get_Data(closure->function, function, struct _jit_function, function);
+  if(function)
+  {
+    methods = (VALUE)jit_function_get_meta(function, RJT_METHODS);
+    if(methods)
+    {
+      rb_ary_delete(methods, key);
+    }
+  }
+}
+
+static VALUE jit_method_key(VALUE klass, char const * name)
+{
+  return rb_assoc_new(klass, ID2SYM(rb_intern(name)));
+}
+
 /*
  * call-seq:
  *   module.define_jit_method(name, function)
@@ -1407,6 +7472,15 @@ static VALUE label_s_new(VALUE klass)
  *   represents the self parameter and the rest of the parameters, or
  *
  * * The function's signature should be Type::RUBY_VARARG_SIGNATURE.
+ *
+ * Defining another jit method with the same name, or removing the
+ * method with remove_jit_method, lets the closure for the old method
+ * (and, once nothing else refers to it, the function's code) be freed.
+ * Aliases of the method and Method objects for it call the old code
+ * directly, and do not keep it alive, so they must not be called after
+ * that unless the code is kept alive another way: by keeping the
+ * Function (even if it has been released), or a closure from
+ * Function#to_closure.
  */
 static VALUE module_define_jit_method(VALUE klass, VALUE name_v, VALUE function_v)
 {
@@ -1416,7 +7490,10 @@ static VALUE module_define_jit_method(VALUE klass, VALUE name_v, VALUE function_
   int signature_tag;
   int arity;
   VALUE closure_v;
+  VALUE key;
+  VALUE methods;
   struct Closure * closure;
+  char method_name[1024];
 
   if(SYMBOL_P(name_v))
   {
@@ -1427,7 +7504,10 @@ static VALUE module_define_jit_method(VALUE klass, VALUE name_v, VALUE function_
     name = StringValuePtr(name_v);
   }
 
-  Data_Get_Struct(function_v, struct _jit_function, function);
+  Get_Function(function_v, function);
+
+  snprintf(method_name, sizeof(method_name), "%s#%s", rb_class2name(klass), name);
+  set_function_name(function, method_name);
 
   signature = jit_function_get_signature(function);
   signature_tag = (int)jit_function_get_meta(function, RJT_TAG_FOR_SIGNATURE);
@@ -1442,19 +7522,59 @@ static VALUE module_define_jit_method(VALUE klass, VALUE name_v, VALUE function_
   }
 
   closure_v = function_to_closure(function_v);
-  Data_Get_Struct(closure_v, struct Closure, closure);
+  Get_Data(closure_v, closure, struct Closure, closure);
+
+  /* Replace the closure for any jit method previously defined with
+   * this name, and remember the method on the function so it can be
+   * redefined if the function is migrated */
+  key = jit_method_key(klass, name);
+  forget_jit_method(key);
+  rb_hash_aset(jit_methods, key, closure_v);
+
+  methods = (VALUE)jit_function_get_meta(function, RJT_METHODS);
+  if(!methods)
+  {
+    methods = rb_ary_new();
+    if(!jit_function_set_meta(function, RJT_METHODS, (void *)methods, 0, 0))
+    {
+      rb_raise(rb_eNoMemError, "Out of memory");
+    }
+  }
+  rb_ary_push(methods, key);
 
-  /* TODO: This will leak the closure if the method is ever redefined.
-   * I had a solution to this problem, but it became too convoluted to
-   * maintain.
-   */
-  rb_ary_push(closures, closure_v);
   rb_define_method(
       klass, name, RUBY_METHOD_FUNC(closure->function_ptr), arity);
 
   return Qnil;
 }
 
+/*
+ * call-seq:
+ *   module.remove_jit_method(name)
+ *
+ * Remove an instance method defined with define_jit_method, and
+ * release its closure (see define_jit_method for what that means for
+ * aliases of the method).
+ */
+static VALUE module_remove_jit_method(VALUE klass, VALUE name_v)
+{
+  char const * name;
+
+  if(SYMBOL_P(name_v))
+  {
+    name = rb_id2name(SYM2ID(name_v));
+  }
+  else
+  {
+    name = StringValuePtr(name_v);
+  }
+
+  rb_remove_method(klass, name);
+  forget_jit_method(jit_method_key(klass, name));
+
+  return Qnil;
+}
+
 /* ---------------------------------------------------------------------------
  * Init
  * ---------------------------------------------------------------------------
@@ -1464,16 +7584,56 @@ void Init_jit_ext()
 {
   jit_init();
 
-  closures = rb_ary_new();
-  rb_gc_register_address(&closures);
+  rb_require("monitor");
+  build_lock_class = rb_const_get(rb_cObject, rb_intern("Monitor"));
+  rb_gc_register_address(&build_lock_class);
+
+  jit_methods = rb_hash_new();
+  rb_gc_register_address(&jit_methods);
+
+  interned_types = rb_hash_new();
+  rb_gc_register_address(&interned_types);
+  predefined_types = rb_hash_new();
+  rb_gc_register_address(&predefined_types);
+#ifdef TYPES_BY_POINTER_ARE_WEAK
+  types_by_pointer = rb_class_new_instance(
+      0, 0, rb_path2class("ObjectSpace::WeakMap"));
+#else
+  types_by_pointer = rb_hash_new();
+#endif
+  rb_gc_register_address(&types_by_pointer);
+  id_interned_types = rb_intern("__interned_types__");
 
   rb_mJIT = rb_define_module("JIT");
+  rb_define_module_function(rb_mJIT, "enable_perf_map", jit_s_enable_perf_map, -1);
+  rb_define_module_function(rb_mJIT, "disable_perf_map", jit_s_disable_perf_map, 0);
+  rb_define_module_function(rb_mJIT, "perf_map_path", jit_s_perf_map_path, 0);
+  rb_define_module_function(rb_mJIT, "perf_map_enabled?", jit_s_is_perf_map_enabled, 0);
+  rb_define_module_function(rb_mJIT, "code_budget=", jit_s_set_code_budget, 1);
+  rb_define_module_function(rb_mJIT, "code_budget", jit_s_code_budget, 0);
+  rb_define_module_function(rb_mJIT, "code_cache_size", jit_s_code_cache_size, 0);
+  rb_define_module_function(rb_mJIT, "memory_stats", jit_s_memory_stats, 0);
+  rb_define_module_function(rb_mJIT, "apply_fast_paths=", jit_s_set_apply_fast_paths, 1);
+  rb_define_module_function(rb_mJIT, "apply_fast_paths?", jit_s_apply_fast_paths, 0);
+
+  if(getenv("RUBY_LIBJIT_PERF_MAP"))
+  {
+    open_perf_map(0);
+  }
 
   rb_cContext = rb_define_class_under(rb_mJIT, "Context", rb_cObject);
   rb_define_singleton_method(rb_cContext, "new", context_s_new, 0);
   rb_define_method(rb_cContext, "build", context_build, 0);
   rb_define_method(rb_cContext, "compile_function", context_compile_function, 1);
   rb_define_singleton_method(rb_cContext, "build", context_s_build, 0);
+  rb_define_method(rb_cContext, "stats", context_stats, 0);
+  rb_define_method(rb_cContext, "functions", context_functions, 0);
+  rb_define_method(rb_cContext, "keep_recipes=", context_set_keep_recipes, 1);
+  rb_define_method(rb_cContext, "keep_recipes?", context_keeps_recipes, 0);
+  rb_define_method(rb_cContext, "compact", context_compact, -1);
+
+  rb_mStats = rb_define_module_under(rb_mJIT, "Stats");
+  rb_define_module_function(rb_mStats, "totals", stats_s_totals, 0);
 
   rb_cClosure = rb_define_class_under(rb_mJIT, "Closure", rb_cObject);
   rb_define_method(rb_cClosure, "to_int", closure_to_int, 0);
@@ -1484,13 +7644,24 @@ void Init_jit_ext()
   rb_define_singleton_method(rb_cFunction, "new", function_s_new, -1);
   rb_define_method(rb_cFunction, "compile", function_compile, 0);
   rb_define_singleton_method(rb_cFunction, "compile", function_s_compile, -1);
+  rb_define_singleton_method(rb_cFunction, "compile_lazy", function_s_compile_lazy, -1);
+  rb_define_singleton_method(rb_cFunction, "compile_tiered", function_s_compile_tiered, -1);
+  rb_define_singleton_method(rb_cFunction, "default_tier_up_threshold", function_s_default_tier_up_threshold, 0);
+  rb_define_singleton_method(rb_cFunction, "default_tier_up_threshold=", function_s_set_default_tier_up_threshold, 1);
   rb_define_method(rb_cFunction, "get_param", function_get_param, 1);
   init_insns();
   rb_define_method(rb_cFunction, "insn_call", function_insn_call, -1);
   rb_define_method(rb_cFunction, "insn_call_native", function_insn_call_native, -1);
+  rb_define_method(rb_cFunction, "insn_check_bounds", function_insn_check_bounds, 2);
+  rb_define_method(rb_cFunction, "insn_jump_table", function_insn_jump_table, 2);
   rb_define_method(rb_cFunction, "insn_return", function_insn_return, -1);
   rb_define_method(rb_cFunction, "apply", function_apply, -1);
   rb_define_alias(rb_cFunction, "call", "apply");
+  rb_define_method(rb_cFunction, "apply_many", function_apply_many, -1);
+  rb_define_method(rb_cFunction, "apply_into", function_apply_into, -1);
+  rb_define_method(rb_cFunction, "apply_nogvl", function_apply_nogvl, -1);
+  rb_define_method(rb_cFunction, "release_gvl", function_release_gvl, 0);
+  rb_define_method(rb_cFunction, "release_gvl=", function_set_release_gvl, 1);
   rb_define_method(rb_cFunction, "value", function_value, -1);
   rb_define_method(rb_cFunction, "const", function_const, 2);
   rb_define_method(rb_cFunction, "optimization_level", function_optimization_level, 0);
@@ -1500,38 +7671,68 @@ void Init_jit_ext()
   rb_define_method(rb_cFunction, "to_closure", function_to_closure, 0);
   rb_define_method(rb_cFunction, "context", function_get_context, 0);
   rb_define_method(rb_cFunction, "compiled?", function_is_compiled, 0);
+  rb_define_method(rb_cFunction, "release", function_release, 0);
+  rb_define_method(rb_cFunction, "released?", function_is_released, 0);
+  rb_define_method(rb_cFunction, "migrate", function_migrate, 1);
+  rb_define_method(rb_cFunction, "recipe", function_recipe, 0);
+  rb_define_method(rb_cFunction, "evictable=", function_set_evictable, 1);
+  rb_define_method(rb_cFunction, "evictable?", function_is_evictable, 0);
+  rb_define_method(rb_cFunction, "tier", function_tier, 0);
+  rb_define_method(rb_cFunction, "call_count", function_call_count, 0);
+  rb_define_method(rb_cFunction, "tier_up_error", function_tier_up_error, 0);
+  rb_define_method(rb_cFunction, "tier_up_threshold", function_tier_up_threshold, 0);
+  rb_define_method(rb_cFunction, "tier_up_threshold=", function_set_tier_up_threshold, 1);
+  rb_define_method(rb_cFunction, "name", function_name, 0);
+  rb_define_method(rb_cFunction, "stats", function_stats, 0);
+  rb_define_method(rb_cFunction, "param_handle", function_param_handle, 1);
+  rb_define_method(rb_cFunction, "value_handle", function_value_handle, 1);
+  rb_define_method(rb_cFunction, "const_handle", function_const_handle, 2);
+  rb_define_method(rb_cFunction, "label_handle", function_label_handle, 0);
+  rb_define_method(rb_cFunction, "handle_to_value", function_handle_to_value, 1);
+  rb_define_method(rb_cFunction, "value_to_handle", function_value_to_handle, 1);
+  rb_define_method(rb_cFunction, "emit_program", function_emit_program, 1);
+  rb_define_method(rb_cFunction, "start_recording", function_start_recording, 0);
+  rb_define_method(rb_cFunction, "finish_recording", function_finish_recording, 0);
+  rb_define_method(rb_cFunction, "replay_recipe", function_replay_recipe, 1);
+  rb_define_method(rb_cFunction, "replay_recipe_file", function_replay_recipe_file, 1);
+  rb_define_method(rb_cFunction, "optimizations=", function_set_optimizations, 1);
+  rb_define_method(rb_cFunction, "optimizations", function_optimizations, 0);
+  rb_define_method(rb_cFunction, "begin_loop", function_begin_loop, 0);
+  rb_define_method(rb_cFunction, "end_loop", function_end_loop, 0);
+  rb_define_method(rb_cFunction, "name=", function_set_name, 1);
 
   rb_cType = rb_define_class_under(rb_mJIT, "Type", rb_cObject);
   rb_define_singleton_method(rb_cType, "_create_signature", type_s_create_signature, 3);
-  rb_define_singleton_method(rb_cType, "create_struct", type_s_create_struct, 1);
+  rb_define_singleton_method(rb_cType, "create_struct", type_s_create_struct, -1);
   rb_define_singleton_method(rb_cType, "create_pointer", type_s_create_pointer, 1);
+  rb_define_singleton_method(rb_cType, "create_array", type_s_create_array, 2);
   rb_define_method(rb_cType, "get_offset", type_get_offset, 1);
   rb_define_method(rb_cType, "set_offset", type_set_offset, 2);
   rb_define_method(rb_cType, "size", type_size, 0);
-  rb_define_const(rb_cType, "VOID", wrap_type(jit_type_void));
-  rb_define_const(rb_cType, "SBYTE", wrap_type(jit_type_sbyte));
-  rb_define_const(rb_cType, "UBYTE", wrap_type(jit_type_ubyte));
-  rb_define_const(rb_cType, "SHORT", wrap_type(jit_type_short));
-  rb_define_const(rb_cType, "USHORT", wrap_type(jit_type_ushort));
-  rb_define_const(rb_cType, "INT", wrap_type(jit_type_int));
-  rb_define_const(rb_cType, "UINT", wrap_type(jit_type_uint));
-  rb_define_const(rb_cType, "NINT", wrap_type(jit_type_nint));
-  rb_define_const(rb_cType, "NUINT", wrap_type(jit_type_nuint));
-  rb_define_const(rb_cType, "LONG", wrap_type(jit_type_long));
-  rb_define_const(rb_cType, "ULONG", wrap_type(jit_type_ulong));
-  rb_define_const(rb_cType, "FLOAT32", wrap_type(jit_type_float32));
-  rb_define_const(rb_cType, "FLOAT64", wrap_type(jit_type_float64));
-  rb_define_const(rb_cType, "NFLOAT", wrap_type(jit_type_nfloat));
-  rb_define_const(rb_cType, "VOID_PTR", wrap_type(jit_type_void_ptr));
+  rb_define_const(rb_cType, "VOID", wrap_type_const(jit_type_void));
+  rb_define_const(rb_cType, "SBYTE", wrap_type_const(jit_type_sbyte));
+  rb_define_const(rb_cType, "UBYTE", wrap_type_const(jit_type_ubyte));
+  rb_define_const(rb_cType, "SHORT", wrap_type_const(jit_type_short));
+  rb_define_const(rb_cType, "USHORT", wrap_type_const(jit_type_ushort));
+  rb_define_const(rb_cType, "INT", wrap_type_const(jit_type_int));
+  rb_define_const(rb_cType, "UINT", wrap_type_const(jit_type_uint));
+  rb_define_const(rb_cType, "NINT", wrap_type_const(jit_type_nint));
+  rb_define_const(rb_cType, "NUINT", wrap_type_const(jit_type_nuint));
+  rb_define_const(rb_cType, "LONG", wrap_type_const(jit_type_long));
+  rb_define_const(rb_cType, "ULONG", wrap_type_const(jit_type_ulong));
+  rb_define_const(rb_cType, "FLOAT32", wrap_type_const(jit_type_float32));
+  rb_define_const(rb_cType, "FLOAT64", wrap_type_const(jit_type_float64));
+  rb_define_const(rb_cType, "NFLOAT", wrap_type_const(jit_type_nfloat));
+  rb_define_const(rb_cType, "VOID_PTR", wrap_type_const(jit_type_void_ptr));
 
   jit_type_VALUE = jit_type_create_tagged(jit_underlying_type_VALUE, RJT_OBJECT, 0, 0, 1);
-  rb_define_const(rb_cType, "OBJECT", wrap_type(jit_type_VALUE));
+  rb_define_const(rb_cType, "OBJECT", wrap_type_const(jit_type_VALUE));
 
   jit_type_ID = jit_type_create_tagged(jit_underlying_type_ID, RJT_ID, 0, 0, 1);
-  rb_define_const(rb_cType, "ID", wrap_type(jit_type_ID));
+  rb_define_const(rb_cType, "ID", wrap_type_const(jit_type_ID));
 
   jit_type_Function_Ptr = jit_type_create_tagged(jit_underlying_type_ID, RJT_FUNCTION_PTR, 0, 0, 1);
-  rb_define_const(rb_cType, "FUNCTION_PTR", wrap_type(jit_type_Function_Ptr));
+  rb_define_const(rb_cType, "FUNCTION_PTR", wrap_type_const(jit_type_Function_Ptr));
 
   {
     jit_type_t ruby_vararg_param_types[3];
@@ -1547,7 +7748,29 @@ void Init_jit_ext()
           1);
     ruby_vararg_signature = jit_type_create_tagged(ruby_vararg_signature_untagged, RJT_RUBY_VARARG_SIGNATURE, 0, 0, 1);
   }
-  rb_define_const(rb_cType, "RUBY_VARARG_SIGNATURE", wrap_type(ruby_vararg_signature));
+  rb_define_const(rb_cType, "RUBY_VARARG_SIGNATURE", wrap_type_const(ruby_vararg_signature));
+
+  {
+    jit_type_t tier_up_param_types[1];
+    tier_up_param_types[0] = jit_type_void_ptr;
+    tier_up_signature = jit_type_create_signature(
+          jit_abi_cdecl,
+          jit_type_void,
+          tier_up_param_types,
+          1,
+          1);
+  }
+
+  {
+    jit_type_t exception_builtin_param_types[1];
+    exception_builtin_param_types[0] = jit_type_int;
+    exception_builtin_signature = jit_type_create_signature(
+          jit_abi_cdecl,
+          jit_type_void,
+          exception_builtin_param_types,
+          1,
+          1);
+  }
 
   rb_mABI = rb_define_module_under(rb_mJIT, "ABI");
   rb_define_const(rb_mABI, "CDECL", INT2NUM(jit_abi_cdecl));
@@ -1555,6 +7778,33 @@ void Init_jit_ext()
   rb_define_const(rb_mABI, "STDCALL", INT2NUM(jit_abi_stdcall));
   rb_define_const(rb_mABI, "FASTCALL", INT2NUM(jit_abi_fastcall));
 
+  {
+    VALUE opcodes = rb_ary_new();
+    VALUE types = rb_ary_new();
+    int j;
+
+    program_opcodes = rb_hash_new();
+    rb_gc_register_address(&program_opcodes);
+
+    for(j = 0; j < NUM_PROGRAM_OPS; ++j)
+    {
+      VALUE name = ID2SYM(rb_intern(program_op(j)->name));
+      rb_ary_push(opcodes, name);
+      rb_hash_aset(program_opcodes, name, INT2FIX(j));
+    }
+
+    for(j = 0; j < NUM_PROGRAM_TYPES; ++j)
+    {
+      VALUE type_v = rb_const_get(rb_cType, rb_intern(program_type_names[j]));
+      Get_Data(type_v, type, struct _jit_type, program_types[j]);
+      rb_ary_push(types, ID2SYM(rb_intern(program_type_names[j])));
+    }
+
+    rb_define_const(rb_cFunction, "OPCODES", rb_obj_freeze(opcodes));
+    rb_define_const(rb_cFunction, "PROGRAM_TYPES", rb_obj_freeze(types));
+    rb_define_const(rb_mJIT, "RECIPE_VERSION", recipe_version());
+  }
+
   rb_cValue = rb_define_class_under(rb_mJIT, "Value", rb_cObject);
   rb_define_singleton_method(rb_cValue, "new_value", value_s_new_value, 2);
   rb_define_method(rb_cValue, "to_s", value_to_s, 0);
@@ -1563,6 +7813,7 @@ void Init_jit_ext()
   rb_define_method(rb_cValue, "temporary?", value_is_temporary, 0);
   rb_define_method(rb_cValue, "local?", value_is_local, 0);
   rb_define_method(rb_cValue, "constant?", value_is_constant, 0);
+  rb_define_method(rb_cValue, "constant_value", value_constant_value, 0);
   rb_define_method(rb_cValue, "volatile?", value_is_volatile, 0);
   rb_define_method(rb_cValue, "set_volatile", value_set_volatile, 1);
   rb_define_method(rb_cValue, "volatile=", value_set_volatile, 1);
@@ -1575,6 +7826,9 @@ void Init_jit_ext()
   rb_cLabel = rb_define_class_under(rb_mJIT, "Label", rb_cObject);
   rb_define_singleton_method(rb_cLabel, "new", label_s_new, 0);
 
+  /* The methods are defined in lib/jit/handle.rb */
+  rb_cHandle = rb_define_class_under(rb_mJIT, "Handle", rb_cObject);
+
   rb_mCall = rb_define_module_under(rb_mJIT, "Call");
   rb_define_const(rb_mCall, "NOTHROW", INT2NUM(JIT_CALL_NOTHROW));
   rb_define_const(rb_mCall, "NORETURN", INT2NUM(JIT_CALL_NORETURN));
@@ -1582,5 +7836,6 @@ void Init_jit_ext()
 
   /* VALUE rb_cModule = rb_define_module(); */
   rb_define_method(rb_cModule, "define_jit_method", module_define_jit_method, 2);
+  rb_define_method(rb_cModule, "remove_jit_method", module_remove_jit_method, 1);
 }
 
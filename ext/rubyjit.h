@@ -10,7 +10,26 @@ enum Ruby_Libjit_Tag
   RJT_VALUE_OBJECTS,
   RJT_FUNCTIONS,
   RJT_CONTEXT,
-  RJT_TAG_FOR_SIGNATURE
+  RJT_TAG_FOR_SIGNATURE,
+  RJT_APPLY_PLAN,
+  RJT_BUILDER,
+  RJT_TIER_STATE,
+  RJT_NAME,
+  RJT_SOURCE_LOCATION,
+  RJT_STATS,
+  RJT_HANDLES,
+  RJT_RECORDER,
+  RJT_SELF,
+  RJT_SIGNATURE,
+  RJT_METHODS,
+  RJT_RECIPE,
+  RJT_RETAINED_OBJECTS,
+  RJT_KEEP_RECIPES,
+  RJT_CACHE_ENTRY,
+  RJT_REBUILDER,
+  RJT_CONSTANTS,
+  RJT_OPTIMIZER,
+  RJT_BUILD_LOCK
 };
 
 extern jit_type_t jit_type_VALUE;
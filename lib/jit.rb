@@ -1,6 +1,11 @@
 require 'jit_ext'
 require 'jit/array'
+require 'jit/compiler'
+require 'jit/context_pool'
 require 'jit/function'
+require 'jit/handle'
+require 'jit/recipe_cache'
+require 'jit/stats'
 require 'jit/struct'
 require 'jit/value'
 require 'jit/type'
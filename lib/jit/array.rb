@@ -3,7 +3,10 @@ require 'jit/value'
 
 module JIT
 
-  # An abstraction for a fixed-length array type.
+  # An abstraction for a fixed-length array type.  The type is
+  # described by its element type, length and stride (see
+  # Type.create_array), so it takes the same memory however long the
+  # array is, and an instance is a single block of storage.
   #
   # Example usage:
   #
@@ -24,6 +27,7 @@ module JIT
   class Array < JIT::Type
     attr_reader :type
     attr_reader :length
+    attr_reader :stride
 
     # Create a new JIT array type.
     #
@@ -31,30 +35,35 @@ module JIT
     # +length+:: The number of elements in the array.
     #
     def self.new(type, length)
-      array = self.create_struct([ type ] * length)
+      array = self.create_array(type, length)
       array.instance_eval do
         @type = type
         @length = length
+        @stride = type.size
       end
       return array
     end
 
     # Wrap an existing array.
     #
-    # +ptr+:: A pointer to the first element in the array.
+    # +ptr+::          A pointer to the first element in the array.
+    # +check_bounds+:: Whether to check indexes against the length (see
+    #                  Function#check_index).
     #
-    def wrap(ptr)
-      return Instance.wrap(self, ptr)
+    def wrap(ptr, check_bounds = false)
+      return Instance.wrap(self, ptr, check_bounds)
     end
 
     # Create a new array.
     #
-    # +function+:: The JIT::Function this array will be used in.
+    # +function+::     The JIT::Function this array will be used in.
+    # +check_bounds+:: Whether to check indexes against the length (see
+    #                  Function#check_index).
     #
-    def create(function)
+    def create(function, check_bounds = false)
       instance = function.value(self)
       ptr = function.insn_address_of(instance)
-      return wrap(ptr)
+      return wrap(ptr, check_bounds)
     end
 
     # Return the offset (in bytes) of the element at the given +index+.
@@ -62,7 +71,7 @@ module JIT
     # +index+:: The index of the desired element.
     #
     def offset_of(index)
-      return self.get_offset(index)
+      return index * @stride
     end
 
     # Return the type of the element at the given +index+.
@@ -89,10 +98,11 @@ module JIT
 
       # Wrap an existing array.
       #
-      # +array_type+:: The JIT::Array type to wrap.
-      # +ptr+::        A pointer to the first element in the array.
+      # +array_type+::   The JIT::Array type to wrap.
+      # +ptr+::          A pointer to the first element in the array.
+      # +check_bounds+:: Whether to check indexes against the length.
       #
-      def self.wrap(array_type, ptr)
+      def self.wrap(array_type, ptr, check_bounds = false)
         pointer_type = JIT::Type.create_pointer(array_type)
         value = self.new_value(ptr.function, pointer_type)
         value.store(ptr)
@@ -101,16 +111,21 @@ module JIT
           @type = array_type.type
           @function = ptr.function
           @ptr = ptr
+          @check_bounds = check_bounds
         end
         return value
       end
 
       # Generate JIT code to retrieve the element at the given +index+.
       #
-      # +index+:: The index of the desired element.  The value of the
-      #           index must be known at compile-time.
+      # +index+:: The index of the desired element, either an Integer
+      #           or a JIT::Value computed at runtime.
       #
       def [](index)
+        check_index(index)
+        if index.is_a?(JIT::Value) then
+          return @function.insn_load_elem(@ptr, index, @type)
+        end
         @function.insn_load_relative(
             @ptr,
             @array_type.offset_of(index),
@@ -119,16 +134,24 @@ module JIT
 
       # Generate JIT code to assign to the element at the given +index+.
       #
-      # +index+:: The index of the desired element.  The value of the
-      #           index must be known at compile-time.
+      # +index+:: The index of the desired element, either an Integer
+      #           or a JIT::Value computed at runtime.
       # +value+:: The JIT::Value to assign to the element.
       #
       def []=(index, value)
+        check_index(index)
+        if index.is_a?(JIT::Value) then
+          return @function.insn_store_elem(@ptr, index, value)
+        end
         @function.insn_store_relative(
             @ptr,
             @array_type.offset_of(index),
             value)
       end
+
+      def check_index(index) # :nodoc:
+        @function.check_index(index, @array_type.length) if @check_bounds
+      end
     end
   end
 end
@@ -0,0 +1,68 @@
+require 'jit'
+require 'thread'
+
+module JIT
+
+  # Utilities for compiling many functions at once.
+  #
+  # Example usage:
+  #
+  #   functions = kernels.map do |kernel|
+  #     JIT::Function.build_lazy(kernel.signature) do |f|
+  #       kernel.generate(f)
+  #     end
+  #   end
+  #
+  #   JIT::Compiler.compile_all(functions, :threads => 8)
+  #
+  module Compiler
+
+    # Compile each of the given functions that is not yet compiled,
+    # using up to the given number of threads.
+    #
+    # Function#compile does not hold the global VM lock while libjit
+    # compiles, so the threads compile in parallel.  Libjit serializes
+    # compilation within a single JIT::Context, so functions that share
+    # a context are compiled one after another on the same thread; to
+    # get the most parallelism, build independent functions in
+    # separate contexts (as Function.build and Function.build_lazy do).
+    #
+    # Builder blocks of lazy functions are ordinary ruby code, and so
+    # still run one at a time.
+    #
+    # +functions+:: An array of JIT::Function objects.
+    # +options+::   A hash of options; :threads is the maximum number of
+    #               threads to use (default 1).
+    #
+    def self.compile_all(functions, options = {})
+      num_threads = options[:threads] || 1
+
+      groups = {}
+      functions.each do |function|
+        next if function.compiled?
+        (groups[function.context] ||= []) << function
+      end
+
+      queue = Queue.new
+      groups.each_value { |group| queue << group }
+
+      num_threads = [ num_threads, groups.size ].min
+      threads = (0...num_threads).map do
+        Thread.new do
+          loop do
+            group = begin
+              queue.pop(true)
+            rescue ThreadError
+              break
+            end
+            group.each { |function| function.compile }
+          end
+        end
+      end
+
+      threads.each { |thread| thread.join }
+
+      return functions
+    end
+  end
+end
@@ -0,0 +1,91 @@
+require 'jit'
+require 'thread'
+
+module JIT
+
+  # A bounded set of contexts shared by many functions, so that
+  # building lots of small functions does not create a context (and a
+  # separate block of code memory) for each one.
+  #
+  # Example usage:
+  #
+  #   pool = JIT::ContextPool.new(4)
+  #   function = pool.build([:INT] => :INT) do |f|
+  #     f.return(f.param(0) * 2)
+  #   end
+  #
+  # Libjit allows only one function at a time to be built in a
+  # context, so threads building functions at the same time will wait
+  # for each other if they are given the same context; a larger pool
+  # allows more builds to proceed at once.
+  #
+  # Since a context's code memory is only freed with the context, a
+  # context most of whose functions have been released is retired from
+  # the pool (and replaced by a new one when needed), so that it can be
+  # reclaimed once the rest of its functions are released too.
+  class ContextPool
+    attr_reader :size
+
+    # A context is retired once it has built at least this many
+    # functions, and fewer than one in RETIRE_RATIO of them are still
+    # live.
+    RETIRE_MIN_FUNCTIONS = 64
+    RETIRE_RATIO = 4
+
+    # Create a new pool that holds at most +size+ contexts.
+    def initialize(size = 4)
+      raise ArgumentError, "size must be at least 1" if size < 1
+      @size = size
+      @contexts = []
+      @lock = Mutex.new
+    end
+
+    @default = nil
+    @default_lock = Mutex.new
+
+    # The pool used by Function.build_memoized.
+    def self.default
+      @default_lock.synchronize do
+        @default ||= self.new
+        return @default
+      end
+    end
+
+    # Get a context from the pool: a new context if the pool is not yet
+    # full, otherwise the context holding the fewest live functions.
+    def context
+      @lock.synchronize do
+        @contexts.reject! { |c| retire?(c) }
+        if @contexts.size < @size then
+          context = JIT::Context.new
+          @contexts << context
+          return context
+        end
+        return @contexts.min_by { |c| c.functions.size }
+      end
+    end
+
+    # Get the contexts in the pool.
+    def contexts
+      @lock.synchronize { return @contexts.dup }
+    end
+
+    # Compile a new function in one of the pool's contexts.
+    def build(*args, &block)
+      context = self.context
+      return context.build do
+        JIT::Function.compile(context, *args, &block)
+      end
+    end
+
+    private
+
+    # Determine whether a context has built enough functions, and has
+    # released enough of them, that it should no longer be used.
+    def retire?(context)
+      built = context.stats[:functions]
+      return built >= RETIRE_MIN_FUNCTIONS &&
+        context.functions.size * RETIRE_RATIO < built
+    end
+  end
+end
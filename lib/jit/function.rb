@@ -1,4 +1,6 @@
 require 'jit'
+require 'jit/context_pool'
+require 'thread'
 
 module JIT
   class Function
@@ -14,11 +16,13 @@ module JIT
     #     # condition1 and condition2 are false
     #   } .end
     #
+    # The condition may be a JIT::Value or a Condition (see and_then).
+    #
     # Caution: if you omit end, then the generated code will have
     # undefined behavior, but there will be no warning generated.
     def if(cond, end_label = Label.new, &block)
       false_label = Label.new
-      insn_branch_if_not(cond, false_label)
+      branch_if_not(cond, false_label)
       block.call
       insn_branch(end_label)
       insn_label(false_label)
@@ -37,11 +41,13 @@ module JIT
     #     # condition1 and condition2 are true
     #   } .end
     #
+    # The condition may be a JIT::Value or a Condition (see and_then).
+    #
     # Caution: if you omit end, then the generated code will have
     # undefined behavior, but there will be no warning generated.
     def unless(cond, end_label = Label.new, &block)
       true_label = Label.new
-      insn_branch_if(cond, true_label)
+      branch_if(cond, true_label)
       block.call
       insn_branch(end_label)
       insn_label(true_label)
@@ -85,34 +91,160 @@ module JIT
     #     # all other cases fell through
     #   } .end
     #
-    # Caution: if you omit end, then the generated code will have
-    # undefined behavior, but there will be no warning generated.
+    # The arms are emitted when end is called.  If every arm's value is
+    # an Integer (or an integer constant) and value1 is of an integer
+    # type, the lowering is chosen from the arm values: a jump table if
+    # they are dense, a binary search if they are sparse, and a chain of
+    # compares if there are only a few of them (see Case#lowering).
+    # Otherwise the arms are tested in order with a chain of compares.
+    #
+    # Caution: if you omit end, then no code will be generated for the
+    # case, but there will be no warning generated.
     def case(value)
       return Case.new(self, value)
     end
 
     class Case # :nodoc:
+      # Cases with fewer distinct arm values than this are always
+      # lowered to a chain of compares
+      MIN_SWITCH_ARMS = 4
+
+      # The smallest fraction of a jump table's entries that must lead
+      # to an arm (rather than to else)
+      MIN_JUMP_TABLE_DENSITY = 0.5
+
+      # How the case was lowered (:chain, :jump_table or
+      # :binary_search), once end has been called
+      attr_reader :lowering
+
+      INTEGER_TYPES = [
+        :SBYTE, :UBYTE, :SHORT, :USHORT, :INT, :UINT, :NINT, :NUINT,
+        :LONG, :ULONG ].map { |name| JIT::Type.const_get(name) }
+
       def initialize(function, value)
         @function = function
         @value = value
-        @if = nil
+        @arms = []
+        @else = nil
+        @lowering = nil
       end
 
       def when(value, &block)
-        if not @if then
-          @if = @function.if(value == @value, &block)
-        else
-          @if.elsif(value == @value, &block)
-        end
+        @arms << [ value, block ]
         return self
       end
 
       def else(&block)
-        @if.else(&block)
+        @else = block
+        return self
       end
 
       def end
-        @if.end if @if
+        keys = arm_keys()
+        if not keys then
+          emit_chain()
+          return self
+        end
+
+        # The first arm with a given value wins, as in a chain
+        arm_for_key = {}
+        keys.each_with_index do |key, index|
+          arm_for_key[key] = index if not arm_for_key.include?(key)
+        end
+        sorted_keys = arm_for_key.keys.sort
+
+        if sorted_keys.length < MIN_SWITCH_ARMS then
+          emit_chain()
+          return self
+        end
+
+        arm_labels = @arms.map { JIT::Label.new }
+        else_label = JIT::Label.new
+        sorted_labels = sorted_keys.map { |key| arm_labels[arm_for_key[key]] }
+
+        span = sorted_keys.last - sorted_keys.first + 1
+        if sorted_keys.length >= span * MIN_JUMP_TABLE_DENSITY then
+          @lowering = :jump_table
+          emit_jump_table(sorted_keys, sorted_labels, span, else_label)
+        else
+          @lowering = :binary_search
+          emit_search(sorted_keys, sorted_labels, 0, sorted_keys.length, else_label)
+        end
+
+        emit_arms(arm_labels, else_label)
+        return self
+      end
+
+      private
+
+      # The arms' values as Integers, or nil if they are not all known
+      # integers
+      def arm_keys
+        return nil if not INTEGER_TYPES.include?(@value.type)
+        keys = @arms.map do |value, block|
+          value = value.constant_value if value.is_a?(JIT::Value)
+          return nil if not value.is_a?(Integer)
+          value
+        end
+        return keys
+      end
+
+      def emit_chain
+        @lowering = :chain
+        if_ = nil
+        @arms.each do |value, block|
+          if not if_ then
+            if_ = @function.if(@value == value, &block)
+          else
+            if_.elsif(@value == value, &block)
+          end
+        end
+        if not if_ then
+          @else.call if @else
+        else
+          if_.else(&@else) if @else
+          if_.end
+        end
+      end
+
+      def emit_jump_table(keys, labels, span, else_label)
+        table = Array.new(span) { else_label }
+        keys.each_with_index do |key, j|
+          table[key - keys.first] = labels[j]
+        end
+        index = keys.first == 0 ? @value : @value - keys.first
+        @function.insn_jump_table(index, table)
+        @function.insn_branch(else_label)
+      end
+
+      # Emit compares that branch to the label for keys[lo...hi] equal
+      # to the value, or to else_label if there is none
+      def emit_search(keys, labels, lo, hi, else_label)
+        if hi - lo < MIN_SWITCH_ARMS then
+          (lo...hi).each do |j|
+            @function.insn_branch_if(@value == keys[j], labels[j])
+          end
+          @function.insn_branch(else_label)
+        else
+          mid = (lo + hi) / 2
+          upper_label = JIT::Label.new
+          @function.insn_branch_if(@value >= keys[mid], upper_label)
+          emit_search(keys, labels, lo, mid, else_label)
+          @function.insn_label(upper_label)
+          emit_search(keys, labels, mid, hi, else_label)
+        end
+      end
+
+      def emit_arms(arm_labels, else_label)
+        end_label = JIT::Label.new
+        @arms.each_with_index do |(value, block), j|
+          @function.insn_label(arm_labels[j])
+          block.call
+          @function.insn_branch(end_label)
+        end
+        @function.insn_label(else_label)
+        @else.call if @else
+        @function.insn_label(end_label)
       end
     end
 
@@ -122,12 +254,15 @@ module JIT
     #     # loop body
     #   } .end
     #
+    # The condition may be a JIT::Value or a Condition (see and_then).
+    #
     def until(&block)
+      hoisting = begin_loop
       start_label = Label.new
       done_label = Label.new
       insn_label(start_label)
-      insn_branch_if(block.call, done_label)
-      loop = Loop.new(self, start_label, done_label)
+      branch_if(block.call, done_label)
+      loop = Loop.new(self, start_label, done_label, hoisting)
       return loop
     end
 
@@ -137,21 +272,27 @@ module JIT
     #     # loop body
     #   } .end
     #
+    # The condition may be a JIT::Value or a Condition (see and_then).
+    #
     def while(&block)
+      hoisting = begin_loop
       start_label = Label.new
       done_label = Label.new
       insn_label(start_label)
-      insn_branch_if_not(block.call, done_label)
-      loop = Loop.new(self, start_label, done_label)
+      branch_if_not(block.call, done_label)
+      loop = Loop.new(self, start_label, done_label, hoisting)
       return loop
     end
 
     class Loop # :nodoc:
-      def initialize(function, start_label, done_label)
+      # +hoisting+ is true if the function's optimizer is tracking the
+      # loop (see Function#begin_loop)
+      def initialize(function, start_label, done_label, hoisting = false)
         @function = function
         @start_label = start_label
         @redo_label = start_label
         @done_label = done_label
+        @hoisting = hoisting
       end
 
       def do(&block)
@@ -162,6 +303,7 @@ module JIT
       def end
         @function.insn_branch(@start_label)
         @function.insn_label(@done_label)
+        @function.end_loop if @hoisting
       end
 
       def break
@@ -178,6 +320,379 @@ module JIT
       end
     end
 
+    # A short-circuit "and" of two conditions, for use with if, unless,
+    # while and until.  Rather than computing both sides and combining
+    # them, it emits branches, so the block is only run (at runtime) if
+    # +lhs+ is true.  Either side may itself be a Condition.
+    #
+    # Example usage:
+    #
+    #   function.if(function.and_then(ptr.neq(0)) { ptr_instance[0] > 5 }) {
+    #     # ptr is not null and ptr_instance[0] > 5
+    #   } .end
+    #
+    # +lhs+:: A JIT::Value or Condition.  The block gives the right-hand
+    #         side, and is called when the condition is emitted.
+    #
+    def and_then(lhs, &rhs)
+      return Condition.new(self, lhs).and_then(&rhs)
+    end
+
+    # A short-circuit "or" of two conditions, whose block is only run
+    # (at runtime) if +lhs+ is false (see and_then).
+    def or_else(lhs, &rhs)
+      return Condition.new(self, lhs).or_else(&rhs)
+    end
+
+    # A condition that is emitted as branches (see and_then).  The
+    # value of a leaf condition is given either directly or by a block,
+    # which is not called until the condition is emitted, so the code
+    # it generates is only run when it is needed.
+    class Condition
+      # Create a leaf condition.
+      #
+      # +function+:: The JIT::Function the condition will be used in.
+      # +value+::    A JIT::Value or Condition, or nil to use the block.
+      #
+      def initialize(function, value = nil, &block)
+        @function = function
+        @value = value
+        @block = block
+      end
+
+      # A condition that is true if this one and the block's are.
+      def and_then(&block)
+        return And.new(@function, self, Condition.new(@function, &block))
+      end
+
+      # A condition that is true if this one or the block's is.
+      def or_else(&block)
+        return Or.new(@function, self, Condition.new(@function, &block))
+      end
+
+      # A condition that is true if this one is false.
+      def not
+        return Not.new(@function, self)
+      end
+
+      # Emit code to branch to +label+ if the condition is true.
+      def branch_if(label)
+        value = @value || @block.call
+        @function.branch_if(value, label)
+      end
+
+      # Emit code to branch to +label+ if the condition is false.
+      def branch_if_not(label)
+        value = @value || @block.call
+        @function.branch_if_not(value, label)
+      end
+
+      class And < Condition # :nodoc:
+        def initialize(function, lhs, rhs)
+          @function = function
+          @lhs = lhs
+          @rhs = rhs
+        end
+
+        def branch_if(label)
+          done_label = JIT::Label.new
+          @lhs.branch_if_not(done_label)
+          @rhs.branch_if(label)
+          @function.insn_label(done_label)
+        end
+
+        def branch_if_not(label)
+          @lhs.branch_if_not(label)
+          @rhs.branch_if_not(label)
+        end
+      end
+
+      class Or < Condition # :nodoc:
+        def initialize(function, lhs, rhs)
+          @function = function
+          @lhs = lhs
+          @rhs = rhs
+        end
+
+        def branch_if(label)
+          @lhs.branch_if(label)
+          @rhs.branch_if(label)
+        end
+
+        def branch_if_not(label)
+          done_label = JIT::Label.new
+          @lhs.branch_if(done_label)
+          @rhs.branch_if_not(label)
+          @function.insn_label(done_label)
+        end
+      end
+
+      class Not < Condition # :nodoc:
+        def initialize(function, cond)
+          @function = function
+          @cond = cond
+        end
+
+        def branch_if(label)
+          @cond.branch_if_not(label)
+        end
+
+        def branch_if_not(label)
+          @cond.branch_if(label)
+        end
+      end
+    end
+
+    # Emit code to branch to +label+ if +cond+ (a JIT::Value or
+    # Condition) is true.
+    def branch_if(cond, label)
+      if cond.is_a?(Condition) then
+        cond.branch_if(label)
+      else
+        insn_branch_if(cond, label)
+      end
+    end
+
+    # Emit code to branch to +label+ if +cond+ (a JIT::Value or
+    # Condition) is false.
+    def branch_if_not(cond, label)
+      if cond.is_a?(Condition) then
+        cond.branch_if_not(label)
+      else
+        insn_branch_if_not(cond, label)
+      end
+    end
+
+    # A counted loop, which runs the block with each index from 0 up to
+    # (but not including) +count+.  Neither the index nor count (if it
+    # is a JIT::Value) can be assigned to in the loop, so the index is
+    # known to be in 0...count there, and bounds checks against count
+    # are elided (see check_index).
+    #
+    # Example usage:
+    #
+    #   function.times(n) { |i, loop|
+    #     # loop body
+    #   }
+    #
+    # +count+:: The number of iterations, an Integer or a JIT::Value.
+    #
+    def times(count, &block)
+      type = count.is_a?(JIT::Value) ? count.type : JIT::Type::INT
+      index = value(type)
+      insn_store(index, const(type, 0))
+      index.instance_eval { @index_bounds = [ 0, count ] }
+      freeze_limit(count)
+      self.while { index < count }.do { |loop|
+        block.call(index, loop)
+        insn_store(index, index + 1)
+      }.end
+
+      # After the loop the index equals count
+      index.instance_eval { @index_bounds = nil }
+      thaw_limit(count)
+    end
+
+    # A counted loop over +range+, optionally unrolled.  The block is
+    # called with each index and with the number of the copy of the
+    # body it is in.  With :unroll => k, a main loop runs k copies of
+    # the body (numbered 0 to k - 1, with indexes i to i + k - 1) per
+    # iteration, then a remainder loop runs the body (as copy 0) for the
+    # last few indexes.  As with times, the indexes are known to be in
+    # bounds, and neither they nor the limit can be assigned to.
+    #
+    # Example usage:
+    #
+    #   function.for(0...n, :unroll => 4) { |i, copy|
+    #     # loop body
+    #   }
+    #
+    # +range+::   A Range of Integers, or a count (an Integer or a
+    #             JIT::Value) for 0...count.  The start must be an
+    #             Integer.
+    # +options+:: :unroll, the number of copies of the body in the main
+    #             loop (default 1).
+    #
+    def for(range, options = {}, &block)
+      unroll = options[:unroll] || 1
+      raise ArgumentError, "unroll must be at least 1" if unroll < 1
+
+      if range.is_a?(Range) then
+        start = range.first
+        limit = range.exclude_end? ? range.last : range.last + 1
+      else
+        start = 0
+        limit = range
+      end
+
+      if not start.is_a?(Integer) then
+        raise TypeError, "The start of the range must be an Integer"
+      end
+
+      type = limit.is_a?(JIT::Value) ? limit.type : JIT::Type::INT
+      bounds = [ start, limit ]
+      index = value(type)
+      insn_store(index, const(type, start))
+      index.instance_eval { @index_bounds = bounds }
+      indexes = [ index ]
+      freeze_limit(limit)
+
+      if unroll > 1 then
+        # Compare before subtracting, so an unsigned limit below
+        # unroll - 1 does not wrap around
+        if limit.is_a?(JIT::Value) then
+          main_cond = proc {
+            and_then(limit >= unroll - 1) { index < limit - (unroll - 1) }
+          }
+        else
+          main_cond = proc { index < limit - (unroll - 1) }
+        end
+
+        self.while(&main_cond).do {
+          unroll.times do |copy|
+            copy_index = index
+            if copy > 0 then
+              copy_index = index + copy
+              copy_index.instance_eval { @index_bounds = bounds }
+              indexes << copy_index
+            end
+            block.call(copy_index, copy)
+          end
+          insn_store(index, index + unroll)
+        }.end
+      end
+
+      self.while { index < limit }.do {
+        block.call(index, 0)
+        insn_store(index, index + 1)
+      }.end
+
+      # After the loop the index equals the limit
+      indexes.each { |i| i.instance_eval { @index_bounds = nil } }
+      thaw_limit(limit)
+    end
+
+    # The proof that a loop index is in bounds depends on the limit not
+    # changing, so a JIT::Value limit cannot be assigned to (see
+    # Value#store) until the loop ends.  Loops may share a limit, so
+    # count them.
+    def freeze_limit(limit) # :nodoc:
+      if limit.is_a?(JIT::Value) then
+        limit.instance_eval { @limit_of_loops = (@limit_of_loops || 0) + 1 }
+      end
+    end
+
+    def thaw_limit(limit) # :nodoc:
+      if limit.is_a?(JIT::Value) then
+        limit.instance_eval { @limit_of_loops -= 1 }
+      end
+    end
+
+    # The starting values of the accumulators for reduce, by operator
+    REDUCE_IDENTITIES = { :+ => 0, :* => 1, :| => 0, :^ => 0 }
+
+    # Generate code to combine the elements ptr[0] to ptr[n - 1] with
+    # +op+ and return the result.  With :accumulators => m, the loop is
+    # unrolled m times (see for) and each copy of the body combines into
+    # its own accumulator, so the copies do not wait on each other; the
+    # accumulators are combined at the end.  This reassociates op, which
+    # may change the rounding of floating point results.
+    #
+    # If a block is given, it is called with each element and its
+    # index, and what it returns is combined instead of the element.
+    #
+    # Example usage:
+    #
+    #   dot = function.reduce(a, n, :+, :accumulators => 4) { |x, i|
+    #     x * b[i]
+    #   }
+    #
+    # +ptr+::     A JIT::Pointer::Instance or JIT::Array::Instance.
+    # +n+::       The number of elements, an Integer or a JIT::Value.
+    # +op+::      :+, :*, :&, :|, :^, :min, :max, or a Proc that is
+    #             given two values and returns their combination.
+    # +options+:: :accumulators, the number of accumulators (default
+    #             1); :initial, the starting value of each accumulator
+    #             (default: the identity for op, which only :+, :*, :|
+    #             and :^ have); :type, the type of the accumulators
+    #             (default: the element type).
+    #
+    def reduce(ptr, n, op, options = {}, &block)
+      num_accumulators = options[:accumulators] || 1
+      initial = options.include?(:initial) ? options[:initial] : REDUCE_IDENTITIES[op]
+      if initial.nil? then
+        raise ArgumentError, "No initial value given for #{op.inspect}"
+      end
+
+      type = options[:type]
+      type ||= ptr.respond_to?(:pointer_type) ? ptr.pointer_type.type : ptr.array_type.type
+
+      accumulators = (0...num_accumulators).map do
+        accumulator = value(type)
+        accumulator.store(initial)
+        accumulator
+      end
+
+      self.for(n, :unroll => num_accumulators) { |i, copy|
+        x = ptr[i]
+        x = block.call(x, i) if block
+        accumulator = accumulators[copy]
+        accumulator.store(reduce_op(op, accumulator, x))
+      }
+
+      result = accumulators[0]
+      accumulators[1..-1].each do |accumulator|
+        result = reduce_op(op, result, accumulator)
+      end
+      return result
+    end
+
+    def reduce_op(op, lhs, rhs) # :nodoc:
+      case op
+      when Proc then return op.call(lhs, rhs)
+      when :min then return insn_min(lhs, rhs)
+      when :max then return insn_max(lhs, rhs)
+      else return lhs.send(op, rhs)
+      end
+    end
+
+    # Emit a check that +index+ is in 0...+length+ (see
+    # insn_check_bounds), unless that is already known.  If both are
+    # Integers, the check is done now, raising IndexError if it fails;
+    # if index is a loop index whose limit is length (or, for Integers,
+    # at most length), no check is needed (see times).  Returns true if
+    # a check was emitted.
+    #
+    # +index+::  The index, an Integer or a JIT::Value.
+    # +length+:: The length, an Integer or a JIT::Value.
+    #
+    def check_index(index, length)
+      if index.is_a?(Integer) and length.is_a?(Integer) then
+        if index < 0 or index >= length then
+          raise IndexError, "index #{index} out of bounds (length #{length})"
+        end
+        return false
+      end
+
+      return false if index_within?(index, length)
+
+      if index.is_a?(Integer) then
+        length, index = length.coerce(index)
+      else
+        index, length = index.coerce(length)
+      end
+      insn_check_bounds(index, length)
+      return true
+    end
+
+    def index_within?(index, length) # :nodoc:
+      return false if not index.is_a?(JIT::Value) or not index.index_bounds
+      low, limit = index.index_bounds
+      return false if low < 0
+      return true if limit.equal?(length)
+      return limit.is_a?(Integer) && length.is_a?(Integer) && limit <= length
+    end
+
     # An alias for get_param
     def param(n)
       self.get_param(n)
@@ -195,6 +710,139 @@ module JIT
         JIT::Function.compile(context, *args, &block)
       end
     end
+
+    # Create a JIT::Context and a new function within that context, but
+    # defer running the block and compiling the function until the
+    # function is first used (see Function.compile_lazy).
+    def self.build_lazy(*args, &block)
+      context = JIT::Context.new
+      return JIT::Function.compile_lazy(context, *args, &block)
+    end
+
+    # Create a JIT::Context and a new lazy function within that context
+    # (see Function.build_lazy), whose code may be evicted to keep
+    # within JIT.code_budget and is rebuilt by running the block again
+    # when it is next used (see Function#evictable=).
+    def self.build_evictable(*args, &block)
+      function = self.build_lazy(*args, &block)
+      function.evictable = true
+      return function
+    end
+
+    # Create a JIT::Context and a new tiered function within that
+    # context (see Function.compile_tiered).
+    def self.build_tiered(*args, &block)
+      JIT::Context.build do |context|
+        JIT::Function.compile_tiered(context, *args, &block)
+      end
+    end
+
+    @memoized = {}
+    @memoized_lock = Mutex.new
+    @max_memoized = 1000
+
+    # Get a compiled function, building it (in a context from
+    # JIT::ContextPool.default) only the first time it is asked for.
+    # Functions are identified by where the block was written and by
+    # the specialization arguments, which are passed to the block after
+    # the function, so the block should depend on nothing else.
+    #
+    # Example usage:
+    #
+    #   def scale(factor)
+    #     JIT::Function.build_memoized({ [:INT] => :INT }, factor) do |f, k|
+    #       f.return(f.param(0) * k)
+    #     end
+    #   end
+    #
+    # At most max_memoized functions are kept; beyond that, the least
+    # recently used one is released (see Function#release) and built
+    # again if it is asked for again.  Use clear_memoized to release
+    # them all.  Since a function may be released this way, call
+    # build_memoized each time the function is needed rather than
+    # keeping the function it returns.
+    #
+    # +signature+::      The function's signature.
+    # +specialization+:: Arguments that select a particular variant of
+    #                    the function (they are used as hash keys).
+    #
+    def self.build_memoized(signature, *specialization, &block)
+      key = [ block_location(block), signature, specialization ]
+
+      function = @memoized_lock.synchronize do
+        # Move the function to the end, as the most recently used
+        found = @memoized.delete(key)
+        @memoized[key] = found if found
+        found
+      end
+      return function if function
+
+      # Build outside the lock; if two threads race, the first to
+      # finish wins and the others release what they built
+      function = JIT::ContextPool.default.build(signature) do |f|
+        block.call(f, *specialization)
+      end
+
+      winner = @memoized_lock.synchronize do
+        found = @memoized.delete(key) || function
+        @memoized[key] = found
+        trim_memoized
+        found
+      end
+      function.release if not winner.equal?(function)
+      return winner
+    end
+
+    # Release all the functions built by build_memoized.
+    def self.clear_memoized
+      @memoized_lock.synchronize do
+        @memoized.each_value { |function| function.release }
+        @memoized.clear
+      end
+    end
+
+    # The most functions build_memoized keeps (default 1000).
+    def self.max_memoized
+      return @max_memoized
+    end
+
+    # Set the most functions build_memoized keeps, releasing the least
+    # recently used ones if there are more.
+    def self.max_memoized=(max)
+      raise ArgumentError, "max_memoized must be at least 1" if max < 1
+      @memoized_lock.synchronize do
+        @max_memoized = max
+        trim_memoized
+      end
+    end
+
+    def self.trim_memoized # :nodoc:
+      # Hashes keep insertion order, so the first is the least recently
+      # used
+      while @memoized.size > @max_memoized
+        key, function = @memoized.shift
+        function.release
+      end
+    end
+
+    def self.block_location(block) # :nodoc:
+      if block.respond_to?(:source_location) then
+        return block.source_location
+      else
+        # Ruby 1.8: #<Proc:0x...@file:line>
+        return block.to_s[/@(.*)>/, 1]
+      end
+    end
+
+    # Force compilation of each of the given functions that has not yet
+    # been compiled (e.g. functions created with build_lazy), so the
+    # cost is paid ahead of time rather than on first call.
+    def self.precompile(*functions)
+      functions.flatten.each do |function|
+        function.compile if not function.compiled?
+      end
+      return functions
+    end
   end
 end
 
@@ -0,0 +1,119 @@
+require 'jit'
+
+module JIT
+
+  # A value handle (see Function#param_handle) together with the
+  # function it belongs to, so that it can be used with the same
+  # operators as a JIT::Value (a bare handle is a Fixnum, whose
+  # operators do integer arithmetic on the handle itself).
+  #
+  # Example usage:
+  #
+  #   x = JIT::Handle.new(f, f.param_handle(0))
+  #   f.insn_return(x * 2 + 1)
+  #
+  # A Handle can be passed to the insn_* methods anywhere a value
+  # handle can.  The result of an operator is a Handle, unless the
+  # other operand is a JIT::Value, in which case it is a JIT::Value.
+  # Other operands (such as Integers) are taken to be constants of the
+  # handle's type.
+  class Handle
+    attr_reader :function
+
+    # The value handle, which can be passed to the insn_* methods.
+    attr_reader :handle
+
+    # Wrap a value handle.
+    #
+    # +function+:: The function to which the handle belongs.
+    # +handle+::   The value handle.
+    #
+    def initialize(function, handle)
+      @function = function
+      @handle = handle
+    end
+
+    # Get a JIT::Value for this handle (see Function#handle_to_value).
+    def to_value
+      return @function.handle_to_value(@handle)
+    end
+
+    # The type of the value.
+    def type
+      return self.to_value.type
+    end
+
+    # Assign +value+ to this value.
+    #
+    # +value+:: The value to assign.
+    #
+    def store(value)
+      @function.insn_store(@handle, operand(value))
+    end
+
+    # Return the address of this value.
+    def address
+      return wrap(@function.insn_address_of(@handle))
+    end
+
+    {
+      :+   => :insn_add,
+      :-   => :insn_sub,
+      :*   => :insn_mul,
+      :/   => :insn_div,
+      :%   => :insn_rem,
+      :&   => :insn_and,
+      :|   => :insn_or,
+      :^   => :insn_xor,
+      :<   => :insn_lt,
+      :>   => :insn_gt,
+      :==  => :insn_eq,
+      :neq => :insn_ne,
+      :<=  => :insn_le,
+      :>=  => :insn_ge,
+      :<<  => :insn_shl,
+      :>>  => :insn_shr,
+    }.each do |name, insn|
+      define_method(name) do |rhs|
+        return wrap(@function.send(insn, @handle, operand(rhs)))
+      end
+    end
+
+    # Return the additive inverse (negation) of this value.
+    def -@()
+      return wrap(@function.insn_neg(@handle))
+    end
+
+    # Return the logical inverse of this value.
+    def ~()
+      return wrap(@function.insn_not(@handle))
+    end
+
+    def inspect
+      return "#<JIT::Handle #{@handle}>"
+    end
+
+    private
+
+    # Convert the right hand side of an operator to something the
+    # insn_* methods accept
+    def operand(rhs)
+      case rhs
+      when JIT::Handle, JIT::Value
+        return rhs
+      else
+        return @function.const_handle(self.type, rhs)
+      end
+    end
+
+    # Wrap the result of an insn_* method, which is a handle unless one
+    # of the operands was a JIT::Value
+    def wrap(result)
+      if result.kind_of?(Integer) then
+        return JIT::Handle.new(@function, result)
+      else
+        return result
+      end
+    end
+  end
+end
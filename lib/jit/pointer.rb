@@ -26,10 +26,13 @@ module JIT
 
     # Wrap an existing void pointer.
     #
-    # +ptr+:: The pointer to wrap.
+    # +ptr+::    The pointer to wrap.
+    # +length+:: If given, the number of elements pointed to (an Integer
+    #            or a JIT::Value), which indexes are checked against (see
+    #            Function#check_index).
     #
-    def wrap(ptr)
-      return Instance.wrap(self, ptr)
+    def wrap(ptr, length = nil)
+      return Instance.wrap(self, ptr, length)
     end
 
     # Return the offset (in bytes) of the element at the given +index+.
@@ -51,12 +54,16 @@ module JIT
     # An abstraction for a pointer object.
     #
     class Instance < JIT::Value
+      attr_reader :pointer_type
+
       # Wrap an existing void pointer.
       #
-      # +array_type+:: The JIT::Array type to wrap.
-      # +ptr+::        A pointer to the first element in the array.
+      # +pointer_type+:: The JIT::Pointer type to wrap.
+      # +ptr+::          A pointer to the first element.
+      # +length+::       If given, the number of elements, which indexes
+      #                  are checked against.
       #
-      def self.wrap(pointer_type, ptr)
+      def self.wrap(pointer_type, ptr, length = nil)
         value = self.new_value(ptr.function, pointer_type)
         value.store(ptr)
         value.instance_eval do
@@ -64,16 +71,21 @@ module JIT
           @pointed_type = pointer_type.type
           @function = ptr.function
           @ptr = ptr
+          @length = length
         end
         return value
       end
 
       # Generate JIT code to retrieve the element at the given +index+.
       #
-      # +index+:: The index of the desired element.  The value of the
-      #           index must be known at compile-time.
+      # +index+:: The index of the desired element, either an Integer
+      #           or a JIT::Value computed at runtime.
       #
       def [](index)
+        check_index(index)
+        if index.is_a?(JIT::Value) then
+          return @function.insn_load_elem(@ptr, index, @pointed_type)
+        end
         @function.insn_load_relative(
             @ptr,
             @pointer_type.offset_of(index),
@@ -82,16 +94,24 @@ module JIT
 
       # Generate JIT code to assign to the element at the given +index+.
       #
-      # +index+:: The index of the desired element.  The value of the
-      #           index must be known at compile-time.
+      # +index+:: The index of the desired element, either an Integer
+      #           or a JIT::Value computed at runtime.
       # +value+:: The JIT::Value to assign to the element.
       #
       def []=(index, value)
+        check_index(index)
+        if index.is_a?(JIT::Value) then
+          return @function.insn_store_elem(@ptr, index, value)
+        end
         @function.insn_store_relative(
             @ptr,
             @pointer_type.offset_of(index),
             value)
       end
+
+      def check_index(index) # :nodoc:
+        @function.check_index(index, @length) if @length
+      end
     end
   end
 end
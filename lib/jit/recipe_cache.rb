@@ -0,0 +1,141 @@
+require 'jit'
+require 'digest/sha2'
+require 'fileutils'
+require 'tmpdir'
+
+module JIT
+
+  # A directory of recorded function builds ("recipes"), so that a
+  # function built in one process can be rebuilt in another without
+  # running its builder block again.
+  #
+  # Example usage:
+  #
+  #   cache = JIT::RecipeCache.new('/var/cache/myapp/jit')
+  #   function = cache.build({ [:INT, :INT] => :INT }, "saxpy-#{width}") do |f|
+  #     generate_saxpy(f, width)
+  #   end
+  #
+  # The first time a function is built with a given signature and key,
+  # the block is run and the instructions it emits are recorded (see
+  # Function#start_recording) and saved.  After that, the recipe is
+  # mapped into memory and replayed straight into libjit.  The key must
+  # identify everything the block's output depends on.
+  #
+  # Builds that cannot be recorded (see Function#finish_recording) are
+  # not cached, but otherwise behave normally.
+  #
+  # Recipes are stored under a hash of the key, the signature, and
+  # JIT::RECIPE_VERSION, which changes whenever the extension or libjit
+  # is rebuilt, so stale recipes are never replayed.
+  class RecipeCache
+    attr_reader :dir
+
+    # Create a cache in the given directory, which is created (readable
+    # only by the current user) if it does not exist.
+    #
+    # A recipe is replayed straight into libjit, and can make the
+    # function it builds write anywhere in memory, so raises
+    # SecurityError unless the directory is owned by the current user
+    # and cannot be written by anyone else.
+    #
+    # +dir+:: The cache directory (default: the RUBY_LIBJIT_CACHE_DIR
+    #         environment variable, or a directory under Dir.tmpdir).
+    #
+    def initialize(dir = self.class.default_dir)
+      @dir = dir
+      FileUtils.mkdir_p(@dir, :mode => 0700)
+      check_dir
+    end
+
+    def self.default_dir
+      return ENV['RUBY_LIBJIT_CACHE_DIR'] ||
+        File.join(Dir.tmpdir, "ruby-libjit-#{Process.uid}")
+    end
+
+    # The default cache, used by Function.build_cached.
+    def self.default
+      @default ||= self.new
+      return @default
+    end
+
+    # Get the name of the file the recipe for a build is stored in.
+    def path_for(signature, key)
+      digest = Digest::SHA256.hexdigest(
+          [ JIT::RECIPE_VERSION, signature.inspect, key.to_s ].join("\0"))
+      return File.join(@dir, "#{digest}.recipe")
+    end
+
+    # Create a JIT::Context and compile a new function within that
+    # context, from the cached recipe if there is one, otherwise by
+    # running the block (and caching its recipe).
+    def build(signature, key, &block)
+      path = path_for(signature, key)
+
+      if File.exist?(path) then
+        begin
+          return JIT::Function.build(signature) do |f|
+            f.replay_recipe_file(path)
+          end
+        rescue ArgumentError, IndexError, TypeError
+          # The recipe is corrupt; rebuild it
+          File.delete(path) rescue nil
+        end
+      end
+
+      recipe = nil
+      function = JIT::Function.build(signature) do |f|
+        f.start_recording
+        block.call(f)
+        recipe = f.finish_recording
+      end
+
+      save(path, recipe) if recipe
+
+      return function
+    end
+
+    # Delete every recipe in the cache.
+    def clear
+      Dir.glob(File.join(@dir, '*.recipe')).each do |path|
+        File.delete(path) rescue nil
+      end
+    end
+
+    private
+
+    def check_dir
+      stat = File.stat(@dir)
+      if not stat.directory? then
+        raise SecurityError, "Recipe cache #{@dir} is not a directory"
+      end
+      if not stat.owned? then
+        raise SecurityError, "Recipe cache #{@dir} is not owned by the current user"
+      end
+      if stat.mode & 022 != 0 then
+        raise SecurityError, "Recipe cache #{@dir} is writable by other users"
+      end
+    end
+
+    # Write the recipe so that other processes see either all of it or
+    # none of it.
+    def save(path, recipe)
+      tmp = "#{path}.#{Process.pid}.tmp"
+      File.open(tmp, File::WRONLY | File::CREAT | File::EXCL, 0600) do |out|
+        out.binmode
+        out.write(recipe)
+      end
+      File.rename(tmp, path)
+    rescue SystemCallError
+      File.delete(tmp) rescue nil
+    end
+  end
+
+  class Function
+    # Build a function using JIT::RecipeCache.default (see
+    # RecipeCache#build).
+    def self.build_cached(signature, key, &block)
+      return JIT::RecipeCache.default.build(signature, key, &block)
+    end
+  end
+end
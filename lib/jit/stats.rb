@@ -0,0 +1,47 @@
+require 'jit'
+require 'json'
+
+module JIT
+
+  # Statistics about the functions the JIT has built and compiled.
+  #
+  # The counters are kept for every function as it is built and
+  # compiled, so there is nothing to turn on.  Use Function#stats,
+  # Context#stats and JIT::Stats.totals to read them.
+  #
+  # Example usage:
+  #
+  #   File.open('jit-stats.json', 'w') do |out|
+  #     out.puts JIT::Stats.to_json(JIT::Stats.report(functions))
+  #   end
+  #
+  module Stats
+
+    # Build a report of the process-wide totals and of the given
+    # functions' statistics, suitable for passing to to_json.
+    #
+    # +functions+:: JIT::Function objects to include in the report.
+    #
+    def self.report(*functions)
+      function_stats = functions.flatten.map do |function|
+        stats = function.stats
+        stats[:name] = function.name
+        stats
+      end
+
+      return {
+        :totals    => self.totals,
+        :functions => function_stats
+      }
+    end
+
+    # Convert a report (or any nesting of hashes, arrays, strings,
+    # symbols, numbers, true, false and nil) to JSON.
+    #
+    # +obj+:: The object to convert (default: JIT::Stats.totals).
+    #
+    def self.to_json(obj = self.totals)
+      return JSON.generate(obj)
+    end
+  end
+end
@@ -27,7 +27,9 @@ module JIT
   #
   class Struct < JIT::Type
 
-    # Construct a new JIT structure type.
+    # Construct a new JIT structure type.  Unlike other types, structure
+    # types are not interned, since each has its own member names and
+    # its layout can be changed with set_offset_of.
     #
     # +members+:: A list of members, where each element in the list is a
     #             two-element array [ :name, type ]
@@ -35,7 +37,7 @@ module JIT
     def self.new(*members)
       member_names = members.map { |m| m[0].to_s.intern }
       member_types = members.map { |m| m[1] }
-      type = self.create_struct(member_types)
+      type = self.create_struct(member_types, false)
       type.instance_eval do
         @members = members
         @member_names = member_names
@@ -68,6 +70,16 @@ module JIT
       return wrap(ptr)
     end
 
+    # Create a new structure whose fields are kept in separate values,
+    # rather than in memory, so that libjit can keep them in registers
+    # (see LocalInstance).
+    #
+    # +function+:: The JIT::Function this structure will be used in.
+    #
+    def create_local(function)
+      return LocalInstance.new(self, function)
+    end
+
     # Return the offset (in bytes) of the element with the given name.
     #
     # +name+:: The name of the desired element.
@@ -110,7 +122,40 @@ module JIT
         @struct = struct
         @function = ptr.function
         @ptr = ptr
+        define_accessors
+      end
+
+      # Generate JIT code to retrieve the element with the given name.
+      #
+      # +name+:: The name of the desired element.
+      #
+      def [](name)
+        @function.insn_load_relative(
+            @ptr,
+            @struct.offset_of(name),
+            @struct.type_of(name))
+      end
+
+      # Generate JIT code to assign to the element with the given name.
+      #
+      # +name+::  The name of the desired element.
+      # +value+:: The JIT::Value to assign to the element.
+      #
+      def []=(name, value)
+        @function.insn_store_relative(
+            @ptr,
+            @struct.offset_of(name),
+            value)
+      end
+
+      def members
+        return @struct.members
+      end
 
+      private
+
+      def define_accessors
+        struct = @struct
         mod = Module.new do
           struct.members.each do |name|
             define_method("#{name}") do
@@ -125,16 +170,51 @@ module JIT
 
         extend(mod)
       end
+    end
+
+    # An instance of a JIT::Struct whose fields are separate values (see
+    # Struct#create_local).  Field accesses are plain register moves
+    # rather than loads and stores, so a structure used in an inner
+    # loop need not touch memory.
+    #
+    # The structure is only copied to memory when its address is taken
+    # with ptr.  If the code the pointer is passed to may change the
+    # structure, call reload afterwards to copy it back.
+    #
+    # Example usage:
+    #
+    #   point = point_type.create_local(function)
+    #   point.x = function.const(JIT::Type::INT, 1)
+    #   point.y = function.const(JIT::Type::INT, 2)
+    #   function.insn_call_native(:normalize, normalize_ptr, signature, 0, point.ptr)
+    #   point.reload
+    #
+    class LocalInstance < Instance
+
+      # Create the structure's fields.
+      #
+      # +struct+::   The JIT::Struct type to create.
+      # +function+:: The JIT::Function this structure will be used in.
+      #
+      def initialize(struct, function)
+        @struct = struct
+        @function = function
+        @fields = {}
+        struct.members.each do |name|
+          @fields[name] = function.value(struct.type_of(name))
+        end
+        @memory = nil
+        define_accessors
+      end
 
       # Generate JIT code to retrieve the element with the given name.
+      # The result is a copy, so it is not changed by later assignments
+      # to the element.
       #
       # +name+:: The name of the desired element.
       #
       def [](name)
-        @function.insn_load_relative(
-            @ptr,
-            @struct.offset_of(name),
-            @struct.type_of(name))
+        return @function.insn_load(field(name))
       end
 
       # Generate JIT code to assign to the element with the given name.
@@ -143,14 +223,44 @@ module JIT
       # +value+:: The JIT::Value to assign to the element.
       #
       def []=(name, value)
-        @function.insn_store_relative(
-            @ptr,
-            @struct.offset_of(name),
-            value)
+        field(name).store(value)
       end
 
-      def members
-        return @struct.members
+      # Generate JIT code to copy the structure to memory, and return a
+      # pointer to it.  The copy is not kept up to date with later
+      # assignments; call ptr again to pass the structure on again.
+      def ptr
+        @memory ||= @function.value(@struct)
+        ptr = @function.insn_address_of(@memory)
+        @struct.members.each do |name|
+          @function.insn_store_relative(
+              ptr, @struct.offset_of(name), @fields[name])
+        end
+        return ptr
+      end
+
+      # Generate JIT code to copy the structure back from memory, after
+      # code it was passed to with ptr has changed it.
+      def reload
+        if not @memory then
+          raise RuntimeError, "Cannot reload a structure that was never copied to memory"
+        end
+        ptr = @function.insn_address_of(@memory)
+        @struct.members.each do |name|
+          @fields[name].store(@function.insn_load_relative(
+              ptr, @struct.offset_of(name), @struct.type_of(name)))
+        end
+      end
+
+      private
+
+      def field(name)
+        name = (Symbol === name) ? name : name.to_s.intern
+        value = @fields[name]
+        if not value then
+          raise ArgumentError, "No member #{name} in structure"
+        end
+        return value
       end
     end
   end
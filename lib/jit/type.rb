@@ -1,6 +1,7 @@
 module JIT
   class Type
-    # Create a new signature.
+    # Create a new signature.  Signatures are interned, so creating the
+    # same signature twice returns the same object.
     #
     # call-seq:
     #   jit = JIT::Type.create_signature(abi, return_type, array_of_param_types)
@@ -4,6 +4,10 @@ module JIT
   class Value
     module UNINITIALIZED; end
 
+    # If this value is the index of a counted loop (see Function#times),
+    # its bounds: [ low, limit ], where low <= index < limit.
+    attr_reader :index_bounds
+
     # Create a new JIT::Value.  If value is specified, the value will be
     # variable, otherwise it will be a constant with the given value.
     #
@@ -25,6 +29,12 @@ module JIT
     # +value+:: The value to assign.
     #
     def store(value)
+      if @index_bounds then
+        raise TypeError, "Cannot assign to a loop index"
+      end
+      if @limit_of_loops and @limit_of_loops > 0 then
+        raise TypeError, "Cannot assign to the limit of a loop while it runs"
+      end
       lhs, rhs = coerce(value)
       self.function.insn_store(lhs, rhs)
     end
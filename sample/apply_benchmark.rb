@@ -0,0 +1,59 @@
+require 'jit'
+
+# Measure the per-call overhead of Function#apply for small functions.
+# The all-INT and all-OBJECT signatures take the specialized fast paths;
+# the mixed signature goes through the generic marshaling plan.  As a
+# baseline, the fast-path functions are also run with the fast paths
+# turned off (see JIT.apply_fast_paths=), so that they go through the
+# generic plan too.
+
+add_int = JIT::Function.build([:INT, :INT] => :INT) do |f|
+  f.return(f.param(0) + f.param(1))
+end
+
+add_int3 = JIT::Function.build([:INT, :INT, :INT] => :INT) do |f|
+  f.return(f.param(0) + f.param(1) + f.param(2))
+end
+
+identity_object = JIT::Function.build([:OBJECT, :OBJECT] => :OBJECT) do |f|
+  f.return(f.param(1))
+end
+
+add_mixed = JIT::Function.build([:INT, :UINT] => :INT) do |f|
+  f.return(f.param(0) + f.param(1))
+end
+
+def ruby_add(x, y)
+  return x + y
+end
+
+N = 1_000_000
+
+def calls_per_sec(&block)
+  start = Time.now
+  N.times(&block)
+  elapsed = Time.now - start
+  return N / elapsed
+end
+
+def report_calls_per_sec(label, &block)
+  printf("%-20s %12.0f calls/sec\n", label, calls_per_sec(&block))
+end
+
+# Report a function's calls/sec with the fast paths and through the
+# generic plan, and the speedup of the former over the latter
+def report_fast_path(label, &block)
+  JIT.apply_fast_paths = false
+  generic = calls_per_sec(&block)
+  JIT.apply_fast_paths = true
+  fast = calls_per_sec(&block)
+  printf(
+      "%-20s %12.0f calls/sec (generic plan: %12.0f, %.2fx)\n",
+      label, fast, generic, fast / generic)
+end
+
+report_calls_per_sec("ruby method:")      { ruby_add(1, 2) }
+report_fast_path("jit int, int:")         { add_int.apply(1, 2) }
+report_fast_path("jit int x3:")           { add_int3.apply(1, 2, 3) }
+report_fast_path("jit object:")           { identity_object.apply(1, 2) }
+report_calls_per_sec("jit int, uint:")    { add_mixed.apply(1, 2) }
@@ -0,0 +1,39 @@
+require 'jit'
+require 'benchmark'
+
+# Compare the time to build (not compile) a large straight-line function
+# with JIT::Value objects versus value handles, which do not allocate a
+# ruby object per value.
+
+NUM_INSNS = (ARGV[0] || 50000).to_i
+
+def build_with_values
+  JIT::Context.build do |context|
+    function = JIT::Function.new(context, [:INT] => :INT)
+    f = function
+    x = f.param(0)
+    one = f.const(:INT, 1)
+    NUM_INSNS.times do
+      x = f.insn_add(x, one)
+    end
+    f.insn_return(x)
+  end
+end
+
+def build_with_handles
+  JIT::Context.build do |context|
+    function = JIT::Function.new(context, [:INT] => :INT)
+    f = function
+    x = f.param_handle(0)
+    one = f.const_handle(:INT, 1)
+    NUM_INSNS.times do
+      x = f.insn_add(x, one)
+    end
+    f.insn_return(x)
+  end
+end
+
+Benchmark.bm(8) do |x|
+  x.report("values:")  { build_with_values }
+  x.report("handles:") { build_with_handles }
+end
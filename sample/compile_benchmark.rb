@@ -0,0 +1,47 @@
+require 'jit'
+require 'benchmark'
+
+# Compare the wall-clock time to compile a batch of kernels on one
+# thread versus several.  Each kernel is built in its own context, with
+# its IR built up front, so only jit_function_compile is being timed.
+
+NUM_KERNELS = 300
+NUM_THREADS = (ARGV[0] || 8).to_i
+
+def build_kernels
+  return (0...NUM_KERNELS).map do |n|
+    context = JIT::Context.new
+    function = nil
+    context.build do
+      function = JIT::Function.new(context, [:INT, :INT] => :INT)
+      f = function
+      x = f.value(:INT, f.param(0))
+      y = f.value(:INT, f.param(1))
+      i = f.value(:INT, 0)
+      f.while{ i < 100 }.do {
+        50.times do |k|
+          x.store((x * (k + n)) ^ y)
+          y.store(y + (x >> 3))
+        end
+        i.store(i + 1)
+      }.end
+      f.return(x + y)
+    end
+    function
+  end
+end
+
+serial_kernels = build_kernels
+parallel_kernels = build_kernels
+
+serial = Benchmark.realtime do
+  JIT::Compiler.compile_all(serial_kernels, :threads => 1)
+end
+
+parallel = Benchmark.realtime do
+  JIT::Compiler.compile_all(parallel_kernels, :threads => NUM_THREADS)
+end
+
+printf("%d kernels, 1 thread:   %8.3fs\n", NUM_KERNELS, serial)
+printf("%d kernels, %d threads: %8.3fs\n", NUM_KERNELS, NUM_THREADS, parallel)
+printf("speedup: %.2fx\n", serial / parallel)
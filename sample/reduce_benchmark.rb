@@ -0,0 +1,57 @@
+require 'jit'
+require 'jit/function'
+require 'jit/pointer'
+
+# Compare reductions over a buffer of doubles with one accumulator (a
+# single dependency chain) against several independent accumulators
+# (see Function#reduce).
+
+N = 1_000_000
+REPEAT = 50
+
+A = Array.new(N) { |j| (j % 1000) * 0.5 }
+B = Array.new(N) { |j| ((j * 7) % 1000) * 0.25 }
+A_BUF = A.pack('d*')
+B_BUF = B.pack('d*')
+
+def build_kernel(accumulators, op, initial = nil, &block)
+  JIT::Function.build([:VOID_PTR, :VOID_PTR, :INT] => :FLOAT64) do |f|
+    p_type = JIT::Pointer.new(JIT::Type::FLOAT64)
+    n = f.param(2)
+    a = p_type.wrap(f.param(0), n)
+    b = p_type.wrap(f.param(1), n)
+    options = { :accumulators => accumulators }
+    options[:initial] = initial if initial
+    result = if block then
+      f.reduce(a, n, op, options) { |x, i| block.call(x, b[i]) }
+    else
+      f.reduce(a, n, op, options)
+    end
+    f.return result
+    f.optimization_level = 3
+  end
+end
+
+KERNELS = [
+  [ 'sum', proc { |m| build_kernel(m, :+) } ],
+  [ 'dot', proc { |m| build_kernel(m, :+) { |x, y| x * y } } ],
+  [ 'min', proc { |m| build_kernel(m, :min, A[0]) } ],
+  [ 'max', proc { |m| build_kernel(m, :max, A[0]) } ],
+]
+
+def elements_per_sec(function)
+  function.apply(A_BUF, B_BUF, N)
+  start = Time.now
+  REPEAT.times { function.apply(A_BUF, B_BUF, N) }
+  return N * REPEAT / (Time.now - start)
+end
+
+KERNELS.each do |name, build|
+  baseline = nil
+  [ 1, 2, 4, 8 ].each do |m|
+    rate = elements_per_sec(build.call(m))
+    baseline ||= rate
+    printf("%-4s accumulators=%d %14.0f elements/sec (%.2fx)\n",
+        name, m, rate, rate / baseline)
+  end
+end
@@ -34,6 +34,13 @@ class TestJitArray < Test::Unit::TestCase
     # TODO: check out of bounds
   end
 
+  def test_large_array
+    a_type = JIT::Array.new(JIT::Type::INT, 1_000_000)
+    assert_equal 4_000_000, a_type.size
+    assert_equal 3_999_996, a_type.offset_of(999_999)
+    assert_same a_type, JIT::Array.new(JIT::Type::INT, 1_000_000)
+  end
+
   def test_type_of
     a_type = JIT::Array.new(JIT::Type::INT, 4)
     assert_equal JIT::Type::INT, a_type.type_of(0)
@@ -66,5 +73,17 @@ class TestJitArray < Test::Unit::TestCase
         :result => [ JIT::Type::INT, 42 ],
         &p)
   end
-end
 
+  def test_instance_bracket_runtime_index
+    function = JIT::Function.build([:INT] => :INT) do |f|
+      a_type = JIT::Array.new(JIT::Type::INT, 4)
+      a = a_type.create(f)
+      4.times { |i| a[i] = f.const(JIT::Type::INT, i * 10) }
+      i = f.param(0)
+      a[i] = a[i] + f.const(JIT::Type::INT, 1)
+      f.return a[i]
+    end
+    assert_equal 1, function.apply(0)
+    assert_equal 31, function.apply(3)
+  end
+end
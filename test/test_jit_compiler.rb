@@ -0,0 +1,28 @@
+require 'jit/compiler'
+require 'jit/function'
+require 'test/unit'
+
+class TestJitCompiler < Test::Unit::TestCase
+  def test_compile_all
+    functions = (1..4).map do |n|
+      JIT::Function.build_lazy([:INT] => :INT) do |f|
+        f.return(f.param(0) + n)
+      end
+    end
+
+    JIT::Compiler.compile_all(functions, :threads => 2)
+
+    assert_equal([true] * 4, functions.map { |f| f.compiled? })
+    assert_equal([11, 12, 13, 14], functions.map { |f| f.apply(10) })
+  end
+
+  def test_compile_all_skips_compiled_functions
+    function = JIT::Function.build([:INT] => :INT) do |f|
+      f.return(f.param(0))
+    end
+
+    JIT::Compiler.compile_all([ function ], :threads => 2)
+
+    assert_equal(42, function.apply(42))
+  end
+end
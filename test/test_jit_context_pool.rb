@@ -0,0 +1,54 @@
+require 'jit/context_pool'
+require 'jit/function'
+require 'jit/value'
+require 'test/unit'
+
+class TestJitContextPool < Test::Unit::TestCase
+  def test_build
+    pool = JIT::ContextPool.new(2)
+    functions = (1..6).map do |n|
+      pool.build([:INT] => :INT) do |f|
+        f.return(f.param(0) + n)
+      end
+    end
+    assert_equal([11, 12, 13, 14, 15, 16], functions.map { |f| f.apply(10) })
+    assert_equal(2, pool.contexts.size)
+    assert_equal([3, 3], pool.contexts.map { |c| c.stats[:functions] })
+  end
+
+  def test_context_with_fewest_live_functions
+    pool = JIT::ContextPool.new(2)
+    functions = (1..4).map do |n|
+      pool.build([:INT] => :INT) do |f|
+        f.return(f.param(0) + n)
+      end
+    end
+    first = pool.contexts[0]
+    first.functions.each { |function| function.release }
+    assert_same(first, pool.context)
+  end
+
+  def test_mostly_released_context_is_retired
+    pool = JIT::ContextPool.new(1)
+    functions = (1..JIT::ContextPool::RETIRE_MIN_FUNCTIONS).map do |n|
+      pool.build([:INT] => :INT) do |f|
+        f.return(f.param(0) + n)
+      end
+    end
+    old = pool.contexts[0]
+    functions[1..-1].each { |function| function.release }
+    assert_not_same(old, pool.context)
+    assert_equal(1, pool.contexts.size)
+    assert_equal(11, functions[0].apply(10))
+  end
+
+  def test_default
+    threads = (1..4).map { Thread.new { JIT::ContextPool.default } }
+    pools = threads.map { |thread| thread.value }
+    assert(pools.all? { |pool| pool.equal?(pools[0]) })
+  end
+
+  def test_size_must_be_positive
+    assert_raise(ArgumentError) { JIT::ContextPool.new(0) }
+  end
+end
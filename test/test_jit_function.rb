@@ -1,6 +1,13 @@
 require 'jit/function'
+require 'jit/handle'
 require 'jit/value'
+require 'jit/struct'
+require 'jit/pointer'
 require 'test/unit'
+require 'tmpdir'
+
+class JitNameTest
+end
 
 class TestJitFunction < Test::Unit::TestCase
   def test_if_false
@@ -279,6 +286,283 @@ class TestJitFunction < Test::Unit::TestCase
       assert_equal(0, function.apply)
   end
 
+  def test_times
+    function = JIT::Function.build([:INT] => :INT) do |f|
+      sum = f.value(JIT::Type::INT)
+      sum.store(f.const(JIT::Type::INT, 0))
+      f.times(f.param(0)) { |i|
+        sum.store(sum + i)
+      }
+      f.return sum
+    end
+    assert_equal(0, function.apply(0))
+    assert_equal(10, function.apply(5))
+  end
+
+  def test_times_index_cannot_be_assigned
+    JIT::Function.build([] => :INT) do |f|
+      f.times(4) { |i|
+        assert_raise(TypeError) { i.store(f.const(JIT::Type::INT, 0)) }
+      }
+      f.return f.const(JIT::Type::INT, 0)
+    end
+  end
+
+  def test_check_index
+    checks = []
+    JIT::Function.build([:INT] => :INT) do |f|
+      n = f.param(0)
+      checks << f.check_index(f.const(JIT::Type::INT, 2), n)
+      f.times(n) { |i| checks << f.check_index(i, n) }
+      f.times(4) { |i|
+        checks << f.check_index(i, 4)
+        checks << f.check_index(i, 8)
+        checks << f.check_index(i, 3)
+      }
+      checks << f.check_index(3, 4)
+      assert_raise(IndexError) { f.check_index(4, 4) }
+      index = nil
+      f.times(n) { |i| index = i }
+      checks << f.check_index(index, n)
+      f.return n
+    end
+    assert_equal([ true, false, false, false, true, false, true ], checks)
+  end
+
+  def test_loop_limit_cannot_be_assigned
+    function = JIT::Function.build([:INT] => :INT) do |f|
+      len = f.value(JIT::Type::INT, f.param(0))
+      f.times(len) { |i|
+        assert_raise(TypeError) { len.store(len - 1) }
+        f.times(len) { |j| assert_raise(TypeError) { len.store(0) } }
+        assert_raise(TypeError) { len.store(len - 1) }
+      }
+      f.for(0...len, :unroll => 2) { |i, copy|
+        assert_raise(TypeError) { len.store(0) }
+      }
+      len.store(len - 1)
+      f.return len
+    end
+    assert_equal(4, function.apply(5))
+  end
+
+  def test_for_unrolled
+    [ 1, 3, 4 ].each do |unroll|
+      copies = []
+      function = JIT::Function.build([:INT] => :INT) do |f|
+        sum = f.value(JIT::Type::INT)
+        sum.store(f.const(JIT::Type::INT, 0))
+        f.for(f.param(0), :unroll => unroll) { |i, copy|
+          copies << copy
+          sum.store(sum + i)
+        }
+        f.return sum
+      end
+      assert_equal((0...unroll).to_a + (unroll > 1 ? [ 0 ] : []), copies)
+      [ 0, 1, 2, 7, 8, 100 ].each do |n|
+        assert_equal(n * (n - 1) / 2, function.apply(n))
+      end
+    end
+  end
+
+  def test_for_range
+    function = JIT::Function.build([] => :INT) do |f|
+      sum = f.value(JIT::Type::INT)
+      sum.store(f.const(JIT::Type::INT, 0))
+      f.for(3..10, :unroll => 4) { |i, copy| sum.store(sum + i) }
+      f.return sum
+    end
+    assert_equal((3..10).inject(0) { |a, b| a + b }, function.apply)
+  end
+
+  def test_for_unrolled_unsigned_limit
+    function = JIT::Function.build([:VOID_PTR, :UINT] => :INT) do |f|
+      n = f.param(1)
+      a = JIT::Pointer.new(JIT::Type::INT).wrap(f.param(0), n)
+      f.return f.reduce(a, n, :+, :accumulators => 4)
+    end
+    buf = [ 5, 7, 100, 100, 100 ].pack('i*')
+    assert_equal(0, function.apply(buf, 0))
+    assert_equal(5, function.apply(buf, 1))
+    assert_equal(12, function.apply(buf, 2))
+    assert_equal(312, function.apply(buf, 5))
+  end
+
+  def test_for_start_must_be_integer
+    JIT::Function.build([:INT] => :INT) do |f|
+      assert_raise(TypeError) { f.for(1.5...4) { |i, copy| } }
+      f.return f.param(0)
+    end
+  end
+
+  def build_reduce(op, options = {}, &block)
+    return JIT::Function.build([:VOID_PTR, :VOID_PTR, :INT] => :INT) do |f|
+      p_type = JIT::Pointer.new(JIT::Type::INT)
+      n = f.param(2)
+      a = p_type.wrap(f.param(0), n)
+      b = p_type.wrap(f.param(1), n)
+      if block then
+        f.return f.reduce(a, n, op, options) { |x, i| block.call(x, b[i]) }
+      else
+        f.return f.reduce(a, n, op, options)
+      end
+    end
+  end
+
+  def test_reduce
+    a = [ 5, -3, 8, 2, 9, 1, -7 ]
+    b = [ 1, 2, 3, 4, 5, 6, 7 ]
+    a_buf = a.pack('i*')
+    b_buf = b.pack('i*')
+    dot = 0
+    a.each_with_index { |x, j| dot += x * b[j] }
+
+    [ 1, 2, 4 ].each do |m|
+      sum = build_reduce(:+, :accumulators => m)
+      assert_equal(15, sum.apply(a_buf, b_buf, a.length))
+      assert_equal(0, sum.apply(a_buf, b_buf, 0))
+
+      min = build_reduce(:min, :accumulators => m, :initial => 1000)
+      assert_equal(-7, min.apply(a_buf, b_buf, a.length))
+
+      max = build_reduce(proc { |x, y| x.function.insn_max(x, y) },
+          :accumulators => m, :initial => -1000)
+      assert_equal(9, max.apply(a_buf, b_buf, a.length))
+
+      dot_function = build_reduce(:+, :accumulators => m) { |x, y| x * y }
+      assert_equal(dot, dot_function.apply(a_buf, b_buf, a.length))
+    end
+
+    assert_raise(ArgumentError) { build_reduce(:min) }
+  end
+
+  def test_and_then_short_circuits
+    function = JIT::Function.build([:VOID_PTR] => :INT) do |f|
+      ptr = f.param(0)
+      cond = f.and_then(ptr.neq(f.const(JIT::Type::VOID_PTR, 0))) {
+        f.insn_load_relative(ptr, 0, JIT::Type::INT) > f.const(JIT::Type::INT, 5)
+      }
+      f.if(cond) {
+        f.return f.const(JIT::Type::INT, 1)
+      }.end
+      f.return f.const(JIT::Type::INT, 0)
+    end
+    assert_equal(0, function.apply(nil))
+    assert_equal(0, function.apply([3].pack('i')))
+    assert_equal(1, function.apply([7].pack('i')))
+  end
+
+  def test_or_else_and_not
+    function = JIT::Function.build([:INT, :INT] => :INT) do |f|
+      zero = f.const(JIT::Type::INT, 0)
+      cond = f.or_else(f.param(0) == zero) { f.param(1) == zero }
+      result = f.value(JIT::Type::INT)
+      result.store(f.const(JIT::Type::INT, 0))
+      f.unless(cond.not) {
+        result.store(f.const(JIT::Type::INT, 1))
+      }.end
+      f.return result
+    end
+    assert_equal(1, function.apply(0, 0))
+    assert_equal(1, function.apply(0, 1))
+    assert_equal(1, function.apply(1, 0))
+    assert_equal(0, function.apply(1, 1))
+  end
+
+  def test_condition_in_while
+    function = JIT::Function.build([:INT] => :INT) do |f|
+      i = f.value(JIT::Type::INT)
+      i.store(f.param(0))
+      count = f.value(JIT::Type::INT)
+      count.store(f.const(JIT::Type::INT, 0))
+      f.while {
+        f.and_then(i > f.const(JIT::Type::INT, 0)) { i.neq(f.const(JIT::Type::INT, 3)) }
+      }.do {
+        i.store(i - f.const(JIT::Type::INT, 1))
+        count.store(count + f.const(JIT::Type::INT, 1))
+      }.end
+      f.return count
+    end
+    assert_equal(7, function.apply(10))
+    assert_equal(2, function.apply(2))
+  end
+
+  def build_case(keys)
+    kase = nil
+    function = JIT::Function.build([:INT] => :INT) do |f|
+      result = f.value(JIT::Type::INT)
+      kase = f.case(f.param(0))
+      keys.each_with_index do |key, j|
+        kase.when(key) { result.store(f.const(JIT::Type::INT, j)) }
+      end
+      kase.else { result.store(f.const(JIT::Type::INT, -1)) }
+      kase.end
+      f.return result
+    end
+    keys.each_with_index do |key, j|
+      assert_equal(j, function.apply(key))
+    end
+    return function, kase.lowering
+  end
+
+  def test_case_chain
+    function, lowering = build_case([ 3, 1 ])
+    assert_equal(:chain, lowering)
+    assert_equal(-1, function.apply(2))
+  end
+
+  def test_case_jump_table
+    function, lowering = build_case([ 5, 6, 7, 9, 10, 8 ])
+    assert_equal(:jump_table, lowering)
+    assert_equal(-1, function.apply(4))
+    assert_equal(-1, function.apply(11))
+    assert_equal(-1, function.apply(-1))
+  end
+
+  def test_case_binary_search
+    keys = [ -1000, 3, 17, 250, 4096, 70000, 123456, 999999 ]
+    function, lowering = build_case(keys)
+    assert_equal(:binary_search, lowering)
+    assert_equal(-1, function.apply(0))
+    assert_equal(-1, function.apply(18))
+    assert_equal(-1, function.apply(1000000))
+  end
+
+  def test_case_first_duplicate_arm_wins
+    function = JIT::Function.build([:INT] => :INT) do |f|
+      result = f.value(JIT::Type::INT)
+      kase = f.case(f.param(0))
+      kase.when(f.const(JIT::Type::INT, 1)) { result.store(f.const(JIT::Type::INT, 1)) }
+      kase.when(2) { result.store(f.const(JIT::Type::INT, 2)) }
+      kase.when(1) { result.store(f.const(JIT::Type::INT, 3)) }
+      kase.when(4) { result.store(f.const(JIT::Type::INT, 4)) }
+      kase.when(5) { result.store(f.const(JIT::Type::INT, 5)) }
+      kase.else { result.store(f.const(JIT::Type::INT, 0)) }
+      kase.end
+      assert_equal(:jump_table, kase.lowering)
+      f.return result
+    end
+    assert_equal(1, function.apply(1))
+    assert_equal(0, function.apply(3))
+    assert_equal(5, function.apply(5))
+  end
+
+  def test_case_non_constant_arms
+    function = JIT::Function.build([:INT, :INT] => :INT) do |f|
+      result = f.value(JIT::Type::INT)
+      result.store(f.const(JIT::Type::INT, 0))
+      kase = f.case(f.param(0))
+      kase.when(f.param(1)) { result.store(f.const(JIT::Type::INT, 1)) }
+      kase.when(7) { result.store(f.const(JIT::Type::INT, 2)) }
+      kase.end
+      assert_equal(:chain, kase.lowering)
+      f.return result
+    end
+    assert_equal(1, function.apply(3, 3))
+    assert_equal(2, function.apply(7, 3))
+    assert_equal(0, function.apply(8, 3))
+  end
+
   # TODO: while/break
   # TODO: while/redo
   # TODO: until/break
@@ -311,11 +595,868 @@ class TestJitFunction < Test::Unit::TestCase
     # TODO: should raise an exception
   end
 
+  def test_apply_int_params
+    function = JIT::Function.build([:INT, :INT, :INT] => :INT) do |f|
+      f.return(f.param(0) * f.param(1) + f.param(2))
+    end
+    assert_equal(42, function.apply(5, 8, 2))
+  end
+
+  def test_apply_object_params
+    function = JIT::Function.build([:OBJECT, :OBJECT] => :OBJECT) do |f|
+      f.return(f.param(1))
+    end
+    o = Object.new
+    assert_same(o, function.apply(42, o))
+  end
+
+  def test_apply_mixed_params
+    function = JIT::Function.build([:INT, :UINT, :ID] => :ID) do |f|
+      f.return(f.param(2))
+    end
+    assert_equal(:foo, function.apply(-1, 1, :foo))
+  end
+
+  def test_apply_without_fast_paths
+    int = JIT::Function.build([:INT, :INT] => :INT) do |f|
+      f.return(f.param(0) - f.param(1))
+    end
+    object = JIT::Function.build([:OBJECT, :OBJECT] => :OBJECT) do |f|
+      f.return(f.param(1))
+    end
+    o = Object.new
+    begin
+      JIT.apply_fast_paths = false
+      assert(!JIT.apply_fast_paths?)
+      assert_equal(-3, int.apply(2, 5))
+      assert_same(o, object.apply(42, o))
+    ensure
+      JIT.apply_fast_paths = true
+    end
+  end
+
+  def test_apply_wrong_number_of_arguments
+    function = JIT::Function.build([:INT, :INT] => :INT) do |f|
+      f.return(f.param(0))
+    end
+    assert_raise(ArgumentError) { function.apply(1) }
+  end
+
+  def test_apply_many_array
+    function = JIT::Function.build([:INT, :INT] => :INT) do |f|
+      f.return(f.param(0) + f.param(1))
+    end
+    assert_equal([3, 7, 11], function.apply_many([[1, 2], [3, 4], [5, 6]]))
+  end
+
+  def test_apply_many_array_into_output_array
+    function = JIT::Function.build([:INT] => :INT) do |f|
+      f.return(f.param(0) * 2)
+    end
+    output = [ nil, nil ]
+    result = function.apply_many([[1], [2]], output)
+    assert_same(output, result)
+    assert_equal([2, 4], output)
+  end
+
+  # An argument whose conversion empties the rows it is in
+  class RowShrinker
+    def initialize(rows)
+      @rows = rows
+    end
+
+    def to_int
+      @rows.clear
+      return 1
+    end
+  end
+
+  def test_apply_many_rows_modified
+    function = JIT::Function.build([:INT] => :INT) do |f|
+      f.return(f.param(0) * 2)
+    end
+    rows = [ [ 0 ], [ 2 ], [ 3 ] ]
+    rows[0][0] = RowShrinker.new(rows)
+    assert_raise(RuntimeError) { function.apply_many(rows) }
+  end
+
+  def test_apply_many_packed
+    function = JIT::Function.build([:INT, :INT] => :INT) do |f|
+      f.return(f.param(0) - f.param(1))
+    end
+    rows = [10, 3, 20, 5].pack('i*')
+    output = "\0" * 8
+    function.apply_many(rows, output)
+    assert_equal([7, 15], output.unpack('i*'))
+  end
+
+  def test_apply_many_packed_object_raises
+    function = JIT::Function.build([:OBJECT] => :OBJECT) do |f|
+      f.return(f.param(0))
+    end
+    assert_raise(TypeError) { function.apply_many([0].pack('L!')) }
+  end
+
+  def test_apply_long_params
+    function = JIT::Function.build([:LONG, :LONG] => :LONG) do |f|
+      f.return(f.param(0) + f.param(1))
+    end
+    assert_equal(2**40 + 1, function.apply(2**40, 1))
+  end
+
+  def test_apply_float64_params
+    function = JIT::Function.build([:FLOAT64, :FLOAT64] => :FLOAT64) do |f|
+      f.return(f.param(0) * f.param(1))
+    end
+    assert_equal(1.5, function.apply(0.5, 3.0))
+  end
+
+  def test_apply_short_params
+    function = JIT::Function.build([:SHORT] => :SHORT) do |f|
+      f.return(f.param(0))
+    end
+    assert_equal(-42, function.apply(-42))
+  end
+
+  def test_apply_void_return
+    function = JIT::Function.build([:INT] => :VOID) do |f|
+      f.insn_return
+    end
+    assert_nil(function.apply(1))
+  end
+
+  def test_apply_pointer_param_from_string
+    function = JIT::Function.build([:VOID_PTR] => :INT) do |f|
+      f.return(f.insn_load_relative(f.param(0), 4, JIT::Type::INT))
+    end
+    assert_equal(42, function.apply([1, 42].pack('i*')))
+  end
+
+  def test_apply_into_float64
+    function = JIT::Function.build([:FLOAT64] => :FLOAT64) do |f|
+      f.return(f.param(0) * 2)
+    end
+    buffer = "\0" * 8
+    assert_same(buffer, function.apply_into(buffer, 1.25))
+    assert_equal([2.5], buffer.unpack('d'))
+  end
+
+  def test_apply_into_struct
+    point = JIT::Struct.new(
+        [ :x, JIT::Type::INT ],
+        [ :y, JIT::Type::INT ])
+    function = JIT::Function.build([:INT] => point) do |f|
+      value = f.value(point)
+      p = point.wrap(f.insn_address_of(value))
+      p.x = f.param(0)
+      p.y = f.param(0) + 1
+      f.return(value)
+    end
+    buffer = "\0" * point.size
+    function.apply_into(buffer, 41)
+    assert_equal([41, 42], buffer.unpack('i2'))
+  end
+
+  def test_compile_lazy_not_compiled_until_applied
+    built = false
+    function = JIT::Function.build_lazy([:INT] => :INT) do |f|
+      built = true
+      f.return(f.param(0) + 1)
+    end
+    assert_equal(false, built)
+    assert_equal(false, function.compiled?)
+    assert_equal(42, function.apply(41))
+    assert_equal(true, built)
+    assert_equal(true, function.compiled?)
+  end
+
+  def test_compile_lazy_via_define_jit_method
+    function = JIT::Function.build_lazy([:OBJECT] => :OBJECT) do |f|
+      f.return(f.const(JIT::Type::OBJECT, 42))
+    end
+    c = Class.new
+    c.instance_eval do
+      define_jit_method('foo', function)
+    end
+    assert_equal(false, function.compiled?)
+    assert_equal(42, c.new.foo)
+    assert_equal(true, function.compiled?)
+  end
+
+  def test_compile_lazy_inside_build
+    context = JIT::Context.new
+    function = JIT::Function.compile_lazy(context, [:INT] => :INT) do |f|
+      f.return(f.param(0) + 1)
+    end
+    method_function = JIT::Function.compile_lazy(context, [:OBJECT] => :OBJECT) do |f|
+      f.return(f.const(JIT::Type::OBJECT, 42))
+    end
+    c = Class.new
+    c.instance_eval do
+      define_jit_method('foo', method_function)
+    end
+    context.build do
+      assert_equal(42, function.apply(41))
+      assert_equal(42, c.new.foo)
+    end
+    assert_equal(true, function.compiled?)
+    assert_equal(true, method_function.compiled?)
+  end
+
+  def test_compile_lazy_while_another_thread_builds
+    context = JIT::Context.new
+    function = JIT::Function.compile_lazy(context, [:OBJECT] => :OBJECT) do |f|
+      f.return(f.const(JIT::Type::OBJECT, 42))
+    end
+    c = Class.new
+    c.instance_eval do
+      define_jit_method('foo', function)
+    end
+    building = false
+    thread = Thread.new do
+      context.build do
+        building = true
+        sleep 0.1
+      end
+    end
+    Thread.pass until building
+    assert_equal(42, c.new.foo)
+    thread.join
+  end
+
+  def test_precompile
+    functions = (1..3).map do |n|
+      JIT::Function.build_lazy([] => :INT) do |f|
+        f.return(f.const(JIT::Type::INT, n))
+      end
+    end
+    JIT::Function.precompile(functions)
+    assert_equal([true, true, true], functions.map { |f| f.compiled? })
+    assert_equal([1, 2, 3], functions.map { |f| f.apply })
+  end
+
+  def test_compile_tiered
+    function = JIT::Function.build_tiered([:INT] => :INT) do |f|
+      f.return(f.param(0) * 2)
+    end
+    function.tier_up_threshold = 3
+    assert_equal(0, function.tier)
+    assert_equal(0, function.call_count)
+    assert_equal(2, function.apply(1))
+    assert_equal(4, function.apply(2))
+    assert_equal(0, function.tier)
+    assert_equal(6, function.apply(3))
+    assert_equal(1, function.tier)
+    assert_equal(8, function.apply(4))
+    assert_equal(4, function.call_count)
+  end
+
+  def test_tiered_object_constant_survives_rebuild
+    function = JIT::Function.build_tiered([] => :OBJECT) do |f|
+      f.return(f.const(JIT::Type::OBJECT, 'tiered' * 2))
+    end
+    function.tier_up_threshold = 2
+    GC.start
+    assert_equal('tieredtiered', function.apply)
+    assert_equal('tieredtiered', function.apply)
+    assert_equal(1, function.tier)
+    GC.start
+    assert_equal('tieredtiered', function.apply)
+  end
+
+  def test_tier_up_inside_build
+    context = JIT::Context.new
+    function = context.build do
+      JIT::Function.compile_tiered(context, [:INT] => :INT) do |f|
+        f.return(f.param(0) * 2)
+      end
+    end
+    function.tier_up_threshold = 2
+    context.build do
+      assert_equal(2, function.apply(1))
+      assert_equal(4, function.apply(2))
+    end
+    assert_equal(1, function.tier)
+  end
+
+  def test_tier_up_while_another_thread_builds
+    context = JIT::Context.new
+    function = context.build do
+      JIT::Function.compile_tiered(context, [:INT] => :INT) do |f|
+        f.return(f.param(0) * 2)
+      end
+    end
+    function.tier_up_threshold = 1
+    building = false
+    thread = Thread.new do
+      context.build do
+        building = true
+        sleep 0.1
+      end
+    end
+    Thread.pass until building
+    assert_equal(2, function.apply(1))
+    assert_equal(1, function.tier)
+    thread.join
+  end
+
+  def test_tier_up_error
+    builds = 0
+    function = JIT::Function.build_tiered([:INT] => :INT) do |f|
+      builds += 1
+      raise ArgumentError, "broken builder" if builds > 1
+      f.return(f.param(0) * 2)
+    end
+    function.tier_up_threshold = 1
+    assert_nil(function.tier_up_error)
+    verbose = $VERBOSE
+    begin
+      $VERBOSE = nil
+      assert_equal(2, function.apply(1))
+      assert_equal(4, function.apply(2))
+    ensure
+      $VERBOSE = verbose
+    end
+    assert_equal(0, function.tier)
+    assert_kind_of(ArgumentError, function.tier_up_error)
+    assert_equal("broken builder", function.tier_up_error.message)
+  end
+
+  def test_tier_of_untiered_function_is_nil
+    function = JIT::Function.build([:INT] => :INT) do |f|
+      f.return(f.param(0))
+    end
+    assert_nil(function.tier)
+    assert_nil(function.call_count)
+  end
+
+  def test_apply_nogvl
+    function = JIT::Function.build([:INT, :INT] => :INT) do |f|
+      f.return(f.param(0) + f.param(1))
+    end
+    assert_equal(42, function.apply_nogvl(40, 2))
+  end
+
+  def test_apply_nogvl_object_raises
+    function = JIT::Function.build([:OBJECT] => :OBJECT) do |f|
+      f.return(f.param(0))
+    end
+    assert_raise(TypeError) { function.apply_nogvl(1) }
+    assert_raise(TypeError) { function.release_gvl = true }
+  end
+
+  def test_release_gvl
+    function = JIT::Function.build([:FLOAT64] => :FLOAT64) do |f|
+      f.return(f.param(0) + 1)
+    end
+    assert_equal(false, function.release_gvl)
+    function.release_gvl = true
+    assert_equal(true, function.release_gvl)
+    assert_equal(2.5, function.apply(1.5))
+    output = function.apply_many([1.0, 2.0].pack('d*'))
+    assert_equal([2.0, 3.0], output.unpack('d*'))
+  end
+
+  def test_name
+    function = JIT::Function.build([:INT] => :INT) do |f|
+      f.return(f.param(0))
+    end
+    function.name = 'identity'
+    assert_equal('identity', function.name)
+  end
+
+  def test_define_jit_method_sets_name
+    function = JIT::Function.build([:OBJECT] => :OBJECT) do |f|
+      f.return(f.param(0))
+    end
+    JitNameTest.define_jit_method(:itself_jit, function)
+    assert_equal('JitNameTest#itself_jit', function.name)
+  end
+
+  def test_perf_map
+    old_path = JIT.perf_map_path
+    path = File.join(Dir.tmpdir, "test_jit_perf-#{Process.pid}.map")
+    begin
+      JIT.disable_perf_map
+      JIT.enable_perf_map(path)
+      assert JIT.perf_map_enabled?
+      assert_equal(path, JIT.perf_map_path)
+      function = JIT::Function.build([:INT] => :INT) do |f|
+        f.return(f.param(0) + 1)
+      end
+      function.name = 'perf_map_test'
+      JIT.disable_perf_map
+      assert !JIT.perf_map_enabled?
+      assert_equal(nil, JIT.perf_map_path)
+      map = File.read(path)
+      assert_match(/^[0-9a-f]+ [0-9a-f]+ perf_map_test$/, map)
+    ensure
+      JIT.disable_perf_map
+      File.delete(path) if File.exist?(path)
+      JIT.enable_perf_map(old_path) if old_path
+    end
+  end
+
+  def test_handles
+    function = JIT::Function.build([:INT, :INT] => :INT) do |f|
+      x = f.param_handle(0)
+      y = f.param_handle(1)
+      sum = f.insn_add(x, y)
+      assert_kind_of(Integer, sum)
+      done = f.label_handle
+      f.insn_branch_if(f.insn_gt(sum, f.const_handle(:INT, 10)), done)
+      f.insn_return(f.insn_mul(sum, f.const_handle(:INT, 2)))
+      f.insn_label(done)
+      f.insn_return(sum)
+    end
+    assert_equal(10, function.apply(2, 3))
+    assert_equal(20, function.apply(15, 5))
+  end
+
+  def test_handles_with_value_api
+    function = JIT::Function.build([:INT] => :INT) do |f|
+      x = f.param_handle(0)
+      value = f.handle_to_value(x) + 1
+      assert_kind_of(JIT::Value, value)
+      f.return(f.insn_mul(f.value_to_handle(value), x))
+    end
+    assert_equal(12, function.apply(3))
+  end
+
+  def test_handle_operators
+    function = JIT::Function.build([:INT, :INT] => :INT) do |f|
+      x = JIT::Handle.new(f, f.param_handle(0))
+      y = JIT::Handle.new(f, f.param_handle(1))
+      result = (x + 1) * y - (-x)
+      assert_kind_of(JIT::Handle, result)
+      assert_kind_of(JIT::Value, result + f.get_param(1))
+      f.insn_return(result)
+    end
+    assert_equal(3 * 4 + 2, function.apply(2, 4))
+  end
+
+  def test_insn_call_with_handles
+    callee = JIT::Function.build([:INT, :INT] => :INT) do |f|
+      f.return(f.param(0) - f.param(1))
+    end
+    caller = JIT::Function.build([:INT] => :INT) do |f|
+      x = f.param_handle(0)
+      result = f.insn_call('callee', callee, 0, x, f.const_handle(:INT, 1))
+      assert_kind_of(Integer, result)
+      f.insn_return(f.insn_call('callee', callee, 0, result, f.get_param(0)))
+    end
+    assert_equal(-1, caller.apply(5))
+  end
+
+  def test_invalid_handle
+    JIT::Context.build do |context|
+      f = JIT::Function.new(context, [:INT] => :INT)
+      x = f.param_handle(0)
+      assert_raise(IndexError) { f.insn_add(x, x + 100) }
+    end
+  end
+
+  def test_emit_program
+    function = JIT::Function.build([:INT] => :INT) do |f|
+      f.emit_program([
+        [ :param, 0 ],
+        [ :const, :INT, 10 ],
+        [ :gt, 0, 1 ],
+        [ :branch_if, 2, 0 ],
+        [ :return, 0 ],
+        [ :label, 0 ],
+        [ :mul, 0, 1 ],
+        [ :return, 3 ],
+      ])
+    end
+    assert_equal(5, function.apply(5))
+    assert_equal(110, function.apply(11))
+  end
+
+  def test_emit_packed_program
+    ops = JIT::Function::OPCODES
+    float64 = JIT::Function::PROGRAM_TYPES.index(:FLOAT64)
+    half = [0.5].pack('d').unpack('q')[0]
+    program = [
+      ops.index(:param), 0,
+      ops.index(:const), float64, half,
+      ops.index(:mul), 0, 1,
+      ops.index(:return), 2,
+    ].pack('q*')
+    function = JIT::Function.build([:FLOAT64] => :FLOAT64) do |f|
+      f.emit_program(program)
+    end
+    assert_equal(1.5, function.apply(3.0))
+  end
+
+  def test_emit_program_returns_base_handle
+    JIT::Context.build do |context|
+      f = JIT::Function.new(context, [:INT] => :INT)
+      base = f.emit_program([ [ :param, 0 ], [ :const, :INT, 1 ] ])
+      sum = f.insn_add(base, base + 1)
+      assert_kind_of(Integer, sum)
+    end
+  end
+
+  def test_emit_program_errors
+    JIT::Context.build do |context|
+      f = JIT::Function.new(context, [:INT] => :INT)
+      assert_raise(ArgumentError) { f.emit_program([ [ :bogus ] ]) }
+      assert_raise(ArgumentError) { f.emit_program([ [ :add, 0 ] ]) }
+      assert_raise(IndexError) { f.emit_program([ [ :neg, 5 ] ]) }
+    end
+  end
+
+  def scale(factor)
+    return JIT::Function.build_memoized({ [:INT] => :INT }, factor) do |f, k|
+      f.return(f.param(0) * k)
+    end
+  end
+
+  def test_build_memoized
+    JIT::Function.clear_memoized
+    double = scale(2)
+    assert_same(double, scale(2))
+    triple = scale(3)
+    assert_not_same(double, triple)
+    assert_equal([10, 15], [double.apply(5), triple.apply(5)])
+    JIT::Function.clear_memoized
+    assert(double.released?)
+    assert(triple.released?)
+  end
+
+  def test_max_memoized
+    JIT::Function.clear_memoized
+    max = JIT::Function.max_memoized
+    begin
+      JIT::Function.max_memoized = 2
+      double = scale(2)
+      triple = scale(3)
+      assert_same(double, scale(2))
+      scale(4)
+      assert(triple.released?)
+      assert_same(double, scale(2))
+      assert_not_same(triple, scale(3))
+      assert_raise(ArgumentError) { JIT::Function.max_memoized = 0 }
+    ensure
+      JIT::Function.max_memoized = max
+      JIT::Function.clear_memoized
+    end
+  end
+
+  def test_release
+    function = JIT::Function.build([:INT] => :INT) do |f|
+      f.return(f.param(0))
+    end
+    closure = function.to_closure
+    context = function.context
+    function.release
+    assert function.released?
+    assert_equal([], context.functions)
+    assert_raise(RuntimeError) { function.apply(1) }
+    assert closure.to_int != 0
+  end
+
+  def test_redefine_jit_method
+    c = Class.new
+    [ 1, 2 ].each do |n|
+      function = JIT::Function.build([:OBJECT] => :INT) do |f|
+        f.return(f.const(:INT, n))
+      end
+      c.define_jit_method(:n, function)
+      function.release
+    end
+    assert_equal(2, c.new.n)
+    c.remove_jit_method(:n)
+    assert(!c.method_defined?(:n))
+  end
+
+  def test_redefine_jit_method_alias_kept_alive_by_closure
+    c = Class.new
+    function = JIT::Function.build([:OBJECT] => :INT) do |f|
+      f.return(f.const(:INT, 1))
+    end
+    c.define_jit_method(:n, function)
+    c.send(:alias_method, :old_n, :n)
+    closure = function.to_closure
+    function.release
+    function = nil
+
+    function = JIT::Function.build([:OBJECT] => :INT) do |f|
+      f.return(f.const(:INT, 2))
+    end
+    c.define_jit_method(:n, function)
+    GC.start
+    assert_equal(2, c.new.n)
+    assert_equal(1, c.new.old_n)
+    assert_kind_of(JIT::Closure, closure)
+  end
+
+  def test_migrate
+    old_context = JIT::Context.new
+    old_context.keep_recipes = true
+    function = nil
+    method = nil
+    old_context.build do
+      function = JIT::Function.compile(old_context, [:INT] => :INT) do |f|
+        f.return(f.param(0) + f.const(:INT, 1))
+      end
+      method = JIT::Function.compile(old_context, [:OBJECT] => :INT) do |f|
+        f.return(f.const(:INT, 1))
+      end
+    end
+    assert_not_nil(function.recipe)
+
+    c = Class.new
+    c.define_jit_method(:one, method)
+
+    new_context = old_context.compact
+    assert new_context.keep_recipes?
+    assert_equal(new_context, function.context)
+    assert_equal(new_context, method.context)
+    assert_equal([function, method], new_context.functions)
+    assert_equal([], old_context.functions)
+    assert_equal(42, function.apply(41))
+    assert_equal(1, c.new.one)
+  end
+
+  def test_migrate_requires_recipe
+    function = JIT::Function.build([:INT] => :INT) do |f|
+      f.return(f.param(0))
+    end
+    assert_raise(RuntimeError) { function.migrate(JIT::Context.new) }
+  end
+
+  def test_code_budget
+    builds = 0
+    functions = (1..3).map do |n|
+      JIT::Function.build_evictable([:INT] => :INT) do |f|
+        builds += 1
+        f.return(f.param(0) + f.const(:INT, n))
+      end
+    end
+    assert functions.all? { |function| function.evictable? }
+
+    before = JIT::Stats.totals
+    begin
+      functions[0].compile
+      JIT.code_budget = JIT.code_cache_size * 3 / 2
+      functions[1].compile
+      assert JIT.code_cache_size <= JIT.code_budget
+      assert(!functions[0].compiled?)
+      assert_equal(11, functions[1].apply(10))
+      assert_equal(13, functions[2].apply(10))
+      assert_equal(11, functions[0].apply(10))
+    ensure
+      JIT.code_budget = nil
+    end
+    after = JIT::Stats.totals
+
+    assert after[:evictions] > before[:evictions]
+    assert after[:rebuilds] > before[:rebuilds]
+    assert builds > 3
+    assert functions[0].stats[:rebuilds] >= 1
+  end
+
+  def test_evict_while_running_without_gvl
+    # A UINT result goes through the generic apply plan, which is still
+    # read after the call returns
+    spin = JIT::Function.build_evictable([:INT] => :UINT) do |f|
+      i = f.value(:INT, f.const(:INT, 0))
+      f.while { i < f.param(0) }.do {
+        i.store(i + f.const(:INT, 1))
+      }.end
+      f.return(i)
+    end
+    other = JIT::Function.build_evictable([:INT] => :INT) do |f|
+      f.return(f.param(0) + f.const(:INT, 1))
+    end
+
+    spin.compile
+    spin.release_gvl = true
+    begin
+      JIT.code_budget = JIT.code_cache_size
+      thread = Thread.new { spin.apply(100_000_000) }
+      sleep 0.1
+      other.compile
+      assert(!spin.compiled?)
+      GC.start
+      assert_equal(100_000_000, thread.value)
+    ensure
+      JIT.code_budget = nil
+    end
+    assert_equal(10, spin.apply(10))
+  end
+
+  def test_evictable_requires_lazy_function
+    function = JIT::Function.build([:INT] => :INT) do |f|
+      f.return(f.param(0))
+    end
+    assert_raise(RuntimeError) { function.evictable = true }
+    assert(!function.evictable?)
+  end
+
+  def test_optimizations
+    JIT::Function.build([] => :INT) do |f|
+      assert_equal([], f.optimizations)
+      f.optimizations = true
+      assert_equal([:fold, :cse, :strength, :licm], f.optimizations)
+      f.optimizations = [:licm, :cse]
+      assert_equal([:cse, :licm], f.optimizations)
+      assert_raise(ArgumentError) { f.optimizations = [:inline] }
+      f.optimizations = false
+      assert_equal([], f.optimizations)
+      f.return(f.const(JIT::Type::INT, 0))
+    end
+  end
+
+  def build_product_sum(optimizations)
+    return JIT::Function.build([:INT, :INT] => :INT) do |f|
+      f.optimizations = optimizations
+      x = f.param(0)
+      y = f.param(1)
+      two = f.const(JIT::Type::INT, 2)
+      f.return((x * y) + (y * x) + (x * y) * (two + two))
+    end
+  end
+
+  def test_optimizer_cse
+    plain = build_product_sum(false)
+    optimized = build_product_sum([:fold, :cse])
+    [ [0, 0], [3, 4], [-5, 7] ].each do |x, y|
+      assert_equal(plain.apply(x, y), optimized.apply(x, y))
+    end
+    assert optimized.stats[:insns] < plain.stats[:insns]
+  end
+
+  def test_optimizer_cse_struct_loads
+    s_type = JIT::Struct.new([ :a, JIT::Type::INT ], [ :b, JIT::Type::INT ])
+    counts = [false, [:cse]].map do |optimizations|
+      function = JIT::Function.build([:INT] => :INT) do |f|
+        f.optimizations = optimizations
+        s = s_type.create(f)
+        s[:a] = f.param(0)
+        s[:b] = f.const(JIT::Type::INT, 3)
+        sum = (s[:a] * s[:b]) + (s[:a] * s[:b])
+        s[:a] = sum
+        f.return(s[:a] + s[:b])
+      end
+      assert_equal(33, function.apply(5))
+      function.stats[:insns]
+    end
+    assert counts[1] < counts[0]
+  end
+
+  def test_optimizer_strength_reduction
+    signed = JIT::Function.build([:INT] => :INT) do |f|
+      f.optimizations = [:strength]
+      x = f.param(0)
+      f.return((x / f.const(JIT::Type::INT, 4)) + (x * f.const(JIT::Type::INT, 8)))
+    end
+    (-9..9).each do |x|
+      q = x < 0 ? -(-x / 4) : x / 4
+      assert_equal(q + x * 8, signed.apply(x))
+    end
+
+    unsigned = JIT::Function.build([:UINT] => :UINT) do |f|
+      f.optimizations = [:strength]
+      u = f.param(0)
+      f.return((u % f.const(JIT::Type::UINT, 16)) + (u / f.const(JIT::Type::UINT, 8)))
+    end
+    [0, 7, 37, 4000000000].each do |u|
+      assert_equal(u % 16 + u / 8, unsigned.apply(u))
+    end
+  end
+
+  def build_invariant_sum(optimizations)
+    return JIT::Function.build([:INT, :INT, :INT] => :INT) do |f|
+      f.optimizations = optimizations
+      a = f.param(1)
+      b = f.param(2)
+      sum = f.value(JIT::Type::INT)
+      sum.store(f.const(JIT::Type::INT, 0))
+      f.times(f.param(0)) { |i|
+        f.times(f.const(JIT::Type::INT, 3)) { |j|
+          sum.store(sum + (a * b) + (a + f.const(JIT::Type::INT, 1)) * i + j)
+        }
+      }
+      f.return sum
+    end
+  end
+
+  def test_optimizer_licm
+    plain = build_invariant_sum(false)
+    optimized = build_invariant_sum(true)
+    [ [0, 2, 3], [1, 2, 3], [5, -4, 6] ].each do |n, a, b|
+      assert_equal(plain.apply(n, a, b), optimized.apply(n, a, b))
+    end
+  end
+
+  def test_optimizer_licm_keeps_loop_variant_code
+    function = JIT::Function.build([:INT, :INT, :INT] => :INT) do |f|
+      f.optimizations = [:licm]
+      a = f.param(1)
+      b = f.param(2)
+      acc = f.value(JIT::Type::INT)
+      acc.store(f.const(JIT::Type::INT, 1))
+      f.times(f.param(0)) { |i|
+        current = f.insn_load(acc)
+        acc.store((current * b) + (a * b))
+      }
+      f.return acc
+    end
+    [ [0, 2, 3], [1, 2, 3], [4, -1, 2] ].each do |n, a, b|
+      expected = 1
+      n.times { expected = expected * b + a * b }
+      assert_equal(expected, function.apply(n, a, b))
+    end
+  end
+
+  def test_optimizer_licm_operand_cannot_be_assigned
+    JIT::Function.build([:INT, :INT] => :INT) do |f|
+      f.optimizations = [:licm]
+      a = f.param(0)
+      f.times(4) { |i|
+        product = a * f.param(1)
+        assert_raise(RuntimeError) { a.store(product) }
+      }
+      f.return a
+    end
+  end
+
+  def test_optimizer_sees_stores_in_programs
+    function = JIT::Function.build([:INT, :INT] => :INT) do |f|
+      f.optimizations = true
+      a = f.param(0)
+      b = f.param(1)
+      before = a * b
+      f.emit_program([
+        [ :param, 0 ],
+        [ :const, :INT, 10 ],
+        [ :store, 0, 1 ],
+      ])
+      f.return(before + (a * b))
+    end
+    assert_equal(6 + 30, function.apply(2, 3))
+  end
+
+  def test_insn_call_keeps_callee_context
+    callee = JIT::Function.build([:INT] => :INT) do |f|
+      f.return(f.param(0) + f.const(:INT, 1))
+    end
+    caller = JIT::Function.build([:INT] => :INT) do |f|
+      x = f.param(0)
+      3.times { x = f.insn_call('callee', callee, 0, x) }
+      f.return(x)
+    end
+    callee = nil
+    GC.start
+    assert_equal(3, caller.apply(0))
+  end
+
   # TODO: get_param
-  # TODO: insn_call
   # TODO: insn_call_native
   # TODO: insn_return
-  # TODO: apply
   # TODO: value
   # TODO: const
   # TODO: optimization_level
@@ -324,6 +1465,5 @@ class TestJitFunction < Test::Unit::TestCase
   # TODO: dump
   # TODO: to_closure
   # TODO: context
-  # TODO: compiled?
 end
 
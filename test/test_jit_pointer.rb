@@ -59,5 +59,32 @@ class TestJitArray < Test::Unit::TestCase
         :result => [ JIT::Type::INT, 42 ],
         &p)
   end
-end
 
+  def test_instance_bracket_runtime_index
+    function = JIT::Function.build([:INT] => :INT) do |f|
+      a_type = JIT::Array.new(JIT::Type::INT, 4)
+      p_type = JIT::Pointer.new(JIT::Type::INT)
+      a = a_type.create(f)
+      ptr = p_type.wrap(a.ptr, 4)
+      sum = f.value(JIT::Type::INT)
+      sum.store(f.const(JIT::Type::INT, 0))
+      f.times(4) { |i| ptr[i] = i * 2 }
+      f.times(4) { |i| sum.store(sum + ptr[i]) }
+      f.return sum + ptr[f.param(0)]
+    end
+    assert_equal 12, function.apply(0)
+    assert_equal 18, function.apply(3)
+  end
+
+  def test_instance_bracket_out_of_bounds
+    function = JIT::Function.build([:VOID_PTR, :INT] => :INT) do |f|
+      ptr = JIT::Pointer.new(JIT::Type::INT).wrap(f.param(0), 2)
+      f.return ptr[f.param(1)]
+    end
+    buf = [ 5, 7 ].pack('i*')
+    assert_equal 7, function.apply(buf, 1)
+    assert_raise(IndexError) { function.apply(buf, 2) }
+    assert_raise(IndexError) { function.apply(buf, -1) }
+    assert_equal 5, function.apply(buf, 0)
+  end
+end
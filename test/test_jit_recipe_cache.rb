@@ -0,0 +1,103 @@
+require 'jit/recipe_cache'
+require 'jit/function'
+require 'jit/value'
+require 'test/unit'
+require 'tmpdir'
+require 'fileutils'
+
+class TestJitRecipeCache < Test::Unit::TestCase
+  def setup
+    @dir = File.join(Dir.tmpdir, "test-jit-recipe-cache-#{Process.pid}")
+    @cache = JIT::RecipeCache.new(@dir)
+  end
+
+  def teardown
+    FileUtils.rm_rf(@dir)
+  end
+
+  def build_max(cache, calls)
+    return cache.build({ [:INT, :INT] => :INT }, 'max') do |f|
+      calls << f
+      x = f.param(0)
+      y = f.param(1)
+      f.if(x > y) {
+        f.return(x)
+      }.end
+      f.return(y + 0)
+    end
+  end
+
+  def test_build_records_and_replays
+    calls = []
+    first = build_max(@cache, calls)
+    second = build_max(@cache, calls)
+    assert_equal(1, calls.size)
+    assert_equal(1, Dir.glob(File.join(@dir, '*.recipe')).size)
+    assert_equal([7, 9], [first.apply(7, 3), first.apply(2, 9)])
+    assert_equal([7, 9], [second.apply(7, 3), second.apply(2, 9)])
+  end
+
+  def test_files_are_private
+    build_max(@cache, [])
+    assert_equal(0700, File.stat(@dir).mode & 0777)
+    Dir.glob(File.join(@dir, '*.recipe')).each do |path|
+      assert_equal(0600, File.stat(path).mode & 0777)
+    end
+  end
+
+  def test_writable_dir_is_refused
+    dir = File.join(Dir.tmpdir, "test-jit-recipe-cache-shared-#{Process.pid}")
+    begin
+      Dir.mkdir(dir)
+      File.chmod(0777, dir)
+      assert_raise(SecurityError) { JIT::RecipeCache.new(dir) }
+    ensure
+      FileUtils.rm_rf(dir)
+    end
+  end
+
+  def test_keys_are_separate
+    calls = []
+    @cache.build({ [:INT] => :INT }, 'a') { |f| calls << f; f.return(f.param(0) + 1) }
+    @cache.build({ [:INT] => :INT }, 'b') { |f| calls << f; f.return(f.param(0) + 2) }
+    assert_equal(2, calls.size)
+  end
+
+  def test_unrecordable_build_is_not_cached
+    calls = []
+    2.times do
+      @cache.build({ [:INT] => :INT }, 'pointer') do |f|
+        calls << f
+        f.const(:VOID_PTR, 0)
+        f.return(f.param(0))
+      end
+    end
+    assert_equal(2, calls.size)
+    assert_equal([], Dir.glob(File.join(@dir, '*.recipe')))
+  end
+
+  def test_corrupt_recipe_is_rebuilt
+    calls = []
+    build_max(@cache, calls)
+    Dir.glob(File.join(@dir, '*.recipe')).each do |path|
+      File.open(path, 'wb') { |out| out.write('garbage!') }
+    end
+    function = build_max(@cache, calls)
+    assert_equal(2, calls.size)
+    assert_equal(5, function.apply(5, 1))
+  end
+
+  def test_recording
+    JIT::Context.build do |context|
+      f = JIT::Function.new(context, [:INT] => :INT)
+      f.start_recording
+      f.return(f.param(0) * 2)
+      recipe = f.finish_recording
+      assert_kind_of(String, recipe)
+      g = JIT::Function.new(context, [:INT] => :INT)
+      g.replay_recipe(recipe)
+      g.compile
+      assert_equal(6, g.apply(3))
+    end
+  end
+end
@@ -0,0 +1,114 @@
+require 'jit/stats'
+require 'jit/function'
+require 'test/unit'
+
+class TestJitStats < Test::Unit::TestCase
+  def test_function_stats
+    function = JIT::Function.build([:INT] => :INT) do |f|
+      f.return(f.param(0) + f.const(:INT, 1))
+    end
+    stats = function.stats
+    assert_equal(1, stats[:compiles])
+    assert_equal(1, stats[:constants])
+    assert stats[:values] >= 1
+    assert stats[:insns] >= 2
+    assert stats[:code_size] > 0
+    assert stats[:build_time] >= 0
+    assert stats[:compile_time] >= 0
+    assert_equal(function.optimization_level, stats[:optimization_level])
+  end
+
+  def test_constants_are_interned
+    function = JIT::Function.build([:INT] => :INT) do |f|
+      x = f.param(0)
+      10.times { x = x + f.const(:INT, 1) }
+      f.return(x * f.const(:INT, 2))
+    end
+    stats = function.stats
+    assert_equal(2, stats[:constants])
+    assert_equal(9, stats[:saved_constants])
+    assert_equal(20, function.apply(0))
+  end
+
+  def test_context_stats
+    context = JIT::Context.new
+    context.build do
+      2.times do
+        JIT::Function.compile(context, [:INT] => :INT) do |f|
+          f.return(f.param(0))
+        end
+      end
+    end
+    stats = context.stats
+    assert_equal(2, stats[:functions])
+    assert_equal(2, stats[:compiles])
+  end
+
+  def test_totals
+    before = JIT::Stats.totals
+    JIT::Function.build([:INT] => :INT) do |f|
+      f.return(f.param(0))
+    end
+    after = JIT::Stats.totals
+    assert_equal(before[:functions] + 1, after[:functions])
+    assert_equal(before[:compiles] + 1, after[:compiles])
+  end
+
+  def test_memory_stats
+    function = JIT::Function.build([:INT] => :INT) do |f|
+      f.return(f.param(0))
+    end
+    stats = JIT.memory_stats
+    assert stats[:contexts] >= 1
+    assert stats[:functions] >= 1
+    assert stats[:code_size] >= function.stats[:code_size]
+  end
+
+  def test_memsize_of
+    begin
+      require 'objspace'
+    rescue LoadError
+      return
+    end
+    return if not ObjectSpace.respond_to?(:memsize_of)
+
+    context = JIT::Context.new
+    function = context.build do
+      JIT::Function.compile(context, [:INT] => :INT) do |f|
+        f.return(f.param(0))
+      end
+    end
+    assert ObjectSpace.memsize_of(context) >= function.stats[:code_size]
+  end
+
+  def test_typed_data_wrappers
+    context = JIT::Context.new
+    assert_equal(0, context.stats[:functions])
+    assert_equal(JIT::Type::INT.size, JIT::Type::UINT.size)
+    function = context.build do
+      JIT::Function.compile(context, [:INT] => :INT) do |f|
+        param = f.param(0)
+        assert(!param.temporary?)
+        label = JIT::Label.new
+        f.insn_branch(label)
+        f.insn_label(label)
+        f.return(param)
+      end
+    end
+    assert_equal(5, function.apply(5))
+    closure = function.to_closure
+    assert_kind_of(Integer, closure.to_int)
+  end
+
+  def test_to_json
+    function = JIT::Function.build([:INT] => :INT) do |f|
+      f.return(f.param(0))
+    end
+    function.name = 'identity'
+    json = JIT::Stats.to_json(JIT::Stats.report(function))
+    assert_match(/"totals":\{/, json)
+    assert_match(/"name":"identity"/, json)
+    assert_equal('identity', JSON.parse(json)['functions'][0]['name'])
+    assert_equal('{"a":[1,null,"x\\"y"]}', JIT::Stats.to_json(:a => [1, nil, 'x"y']))
+  end
+end
@@ -123,5 +123,46 @@ class TestJitStruct < Test::Unit::TestCase
         :result => [ JIT::Type::FLOAT64, 42.0 ],
         &p)
   end
+
+  def test_create_local
+    p = proc { |f|
+      s_type = JIT::Struct.new(
+          [ :foo, JIT::Type::INT ],
+          [ :bar, JIT::Type::INT ])
+      s = s_type.create_local(f)
+      s.foo = f.const(JIT::Type::INT, 3)
+      s[:bar] = f.const(JIT::Type::INT, 4)
+      old_foo = s.foo
+      s.foo = s.bar
+      s.bar = old_foo
+      f.return s.foo * f.const(JIT::Type::INT, 10) + s.bar
+    }
+    assert_function_result(
+        :result => [ JIT::Type::INT, 43 ],
+        &p)
+  end
+
+  def test_create_local_ptr
+    p = proc { |f|
+      s_type = JIT::Struct.new(
+          [ :foo, JIT::Type::INT ],
+          [ :bar, JIT::Type::FLOAT64 ])
+      s = s_type.create_local(f)
+      assert_raise(RuntimeError) { s.reload }
+      s.foo = f.const(JIT::Type::INT, 1)
+      s.bar = f.const(JIT::Type::FLOAT64, 2.0)
+      ptr = s.ptr
+      bar = f.insn_load_relative(ptr, s_type.offset_of(:bar), JIT::Type::FLOAT64)
+      f.insn_store_relative(
+          ptr,
+          s_type.offset_of(:bar),
+          bar + f.const(JIT::Type::FLOAT64, 40.0))
+      s.reload
+      f.return s.bar
+    }
+    assert_function_result(
+        :result => [ JIT::Type::FLOAT64, 42.0 ],
+        &p)
+  end
 end
 
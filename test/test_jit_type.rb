@@ -0,0 +1,78 @@
+require 'jit'
+require 'jit/array'
+require 'jit/pointer'
+require 'jit/struct'
+require 'jit/function'
+require 'test/unit'
+
+class TestJitType < Test::Unit::TestCase
+  def test_signatures_are_interned
+    s1 = JIT::Type.create_signature([:INT, :FLOAT64] => :INT)
+    s2 = JIT::Type.create_signature(
+        JIT::ABI::CDECL, JIT::Type::INT, [ JIT::Type::INT, JIT::Type::FLOAT64 ])
+    s3 = JIT::Type.create_signature([:INT] => :INT)
+    assert_same(s1, s2)
+    assert_not_same(s1, s3)
+    assert_equal(s1.hash, s2.hash)
+  end
+
+  def test_pointers_are_interned
+    assert_same(
+        JIT::Type.create_pointer(JIT::Type::INT),
+        JIT::Type.create_pointer(JIT::Type::INT))
+    assert_same(JIT::Pointer.new(JIT::Type::INT), JIT::Pointer.new(JIT::Type::INT))
+    assert_not_same(
+        JIT::Type.create_pointer(JIT::Type::INT),
+        JIT::Pointer.new(JIT::Type::INT))
+  end
+
+  def test_structs_are_interned
+    fields = [ JIT::Type::INT, JIT::Type::INT ]
+    assert_same(JIT::Type.create_struct(fields), JIT::Type.create_struct(fields))
+    assert_same(JIT::Array.new(JIT::Type::INT, 2), JIT::Array.new(JIT::Type::INT, 2))
+    assert_not_same(
+        JIT::Type.create_struct(fields, false),
+        JIT::Type.create_struct(fields, false))
+    assert_raise(TypeError) { JIT::Type.create_struct(fields).set_offset(1, 8) }
+  end
+
+  def test_types_from_a_type_are_interned_with_it
+    s = JIT::Type.create_struct([ JIT::Type::INT ], false)
+    assert_same(JIT::Type.create_pointer(s), JIT::Type.create_pointer(s))
+    assert_same(
+        JIT::Type.create_signature([s] => :INT),
+        JIT::Type.create_signature([s] => :INT))
+  end
+
+  def count_types
+    GC.start
+    return ObjectSpace.each_object(JIT::Type) { }
+  end
+
+  def test_interned_types_are_freed_with_their_parts
+    # Older rubies cannot look types up by pointer without keeping
+    # them alive
+    return if RUBY_VERSION < '2.7'
+    before = count_types
+    1000.times do
+      s = JIT::Type.create_struct([ JIT::Type::INT ], false)
+      JIT::Type.create_signature([JIT::Type.create_pointer(s)] => :INT)
+    end
+    assert(count_types - before < 1000)
+  end
+
+  def test_struct_types_are_not_interned
+    s1 = JIT::Struct.new([ :x, JIT::Type::INT ])
+    s2 = JIT::Struct.new([ :x, JIT::Type::INT ])
+    assert_not_same(s1, s2)
+    s1.set_offset_of(:x, 4)
+    assert_equal(0, s2.offset_of(:x))
+  end
+
+  def test_value_type_is_interned_type
+    JIT::Function.build([:INT] => :INT) do |f|
+      assert_same(JIT::Type::INT, f.param(0).type)
+      f.return(f.param(0))
+    end
+  end
+end